@@ -3,12 +3,26 @@
 
 #include <algorithm>
 #include <armadillo>
+#include <array>
+#include <atomic>
 #include <carma>
 #include <chrono>
+#include <complex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tiffio.h>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 // fix for windows visual c++
@@ -48,8 +62,8 @@ static std::string grabStr(const std::string &source,
     return std::string();
 }
 
-template <typename T>
-int findNearestIdx(const std::vector<T> &toBeSearched, const T &findMe) {
+template <typename Range, typename T>
+int findNearestIdx(const Range &toBeSearched, const T &findMe) {
   if (!(toBeSearched.empty())) {
     auto low =
         std::upper_bound(toBeSearched.begin(), toBeSearched.end(), findMe);
@@ -107,9 +121,145 @@ static constexpr char space_token[] = " ";
 // per full rotation might change too
 static constexpr unsigned int rotary_encoder_units_per_turn =
     36800; // the new value
+// The rotary encoder files give the rotation in degrees
+static constexpr double rotary_file_units_per_turn = 360.0;
+
+/*
+Splits [0, n) into contiguous blocks, one per thread, and calls
+fn(thread, begin, end) for each block. thread is the index of the block
+so callers can keep per-thread state such as an SITiffReader each (libtiff
+handles can't be shared between threads). nthreads = 0 uses all the
+hardware threads. The first exception thrown by any block is rethrown
+once all the threads have finished
+*/
+template <typename Fn>
+void parallelFor(std::size_t n, Fn &&fn, unsigned int nthreads = 0) {
+  if (n == 0)
+    return;
+  if (nthreads == 0)
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  nthreads = static_cast<unsigned int>(std::min<std::size_t>(nthreads, n));
+  if (nthreads == 1) {
+    fn(0u, std::size_t{0}, n);
+    return;
+  }
+  std::exception_ptr error = nullptr;
+  std::mutex error_mutex;
+  std::vector<std::thread> threads;
+  const std::size_t block = (n + nthreads - 1) / nthreads;
+  for (unsigned int t = 0; t < nthreads; ++t) {
+    const std::size_t begin = t * block;
+    const std::size_t end = std::min(n, begin + block);
+    if (begin >= end)
+      break;
+    threads.emplace_back([&, t, begin, end]() {
+      try {
+        fn(t, begin, end);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+/*
+A fixed set of worker threads that run submitted tasks in the order they
+were submitted. submit() returns a future for the result of the task.
+Destroying the pool finishes the queued tasks before joining the threads
+*/
+class WorkerPool {
+public:
+  explicit WorkerPool(unsigned int nthreads = 0) {
+    if (nthreads == 0)
+      nthreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < nthreads; ++i)
+      m_threads.emplace_back([this]() { run(); });
+  }
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto &thread : m_threads)
+      thread.join();
+  }
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+  template <typename Fn>
+  auto submit(Fn &&fn) -> std::future<std::invoke_result_t<Fn>> {
+    using R = std::invoke_result_t<Fn>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<Fn>(fn));
+    auto result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.emplace_back([task]() { (*task)(); });
+    }
+    m_cv.notify_one();
+    return result;
+  }
+  unsigned int size() const { return m_threads.size(); }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+        if (m_tasks.empty())
+          return;
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+      }
+      task();
+    }
+  }
+  std::vector<std::thread> m_threads;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_stop = false;
+};
 
 class SITiffReader;
 
+/*
+The encoded contents of a single tiff directory - the tags needed to
+reproduce it and the raw (possibly compressed) bytes of each strip.
+This lets directories be copied between files without decoding and
+re-encoding the image data (see SITiffReader::readRawDirectory and
+SITiffWriter::writeRawDirectory)
+*/
+struct RawDirectory {
+  uint32_t width = 0;
+  uint32_t length = 0;
+  uint32_t rowsperstrip = 0;
+  uint16_t bitspersample = 16;
+  uint16_t samplesperpixel = 1;
+  uint16_t compression = COMPRESSION_NONE;
+  uint16_t predictor = 1;
+  uint16_t photometric = PHOTOMETRIC_MINISBLACK;
+  uint16_t planarconfig = 1;
+  uint16_t sampleformat = SAMPLEFORMAT_INT;
+  uint16_t resolutionunit = RESUNIT_INCH;
+  float xresolution = 0;
+  float yresolution = 0;
+  // the ScanImage specific tags
+  std::string swTag;
+  std::string imDescTag;
+  std::string artistTag; // holds the ROI data in newer versions of scanimage
+  // all strips are stored back to back in strip_data
+  std::vector<uint64_t> strip_sizes;
+  std::vector<uint8_t> strip_data;
+};
+
 class SITiffHeader {
 public:
   SITiffHeader(SITiffReader *parent)
@@ -172,6 +322,9 @@ public:
   const std::string getFrameNumberString() const { return frameString; }
   const std::string getFrameTimeStampString() const { return frameTimeStamp; }
   ptime getEpochTime(TIFF *m_tif);
+  // the time taken to scan one line (seconds) from the header, or 0 if the
+  // header doesn't say
+  double getLinePeriod(TIFF *m_tif);
 
 private:
   SITiffReader *m_parent;
@@ -196,6 +349,7 @@ private:
   std::string channelNames;
   std::string frameString;
   std::string frameTimeStamp;
+  std::string linePeriod;
 
   // Filled out in scrapeHeaders
   std::vector<double> m_timestamps;
@@ -224,6 +378,12 @@ private:
   ptime m_epoch_time;
 };
 
+/*
+libtiff keeps the current directory in the TIFF handle so every call on a
+reader that touches the file is serialised by a mutex; a reader can be
+shared between threads but they take turns. To read from several threads
+at once give each its own reader (see SITiffReaderPool)
+*/
 class SITiffReader {
 public:
   SITiffReader() = delete;
@@ -239,59 +399,106 @@ public:
   std::string getfilename() const { return m_filename; }
   std::vector<double> getAllTimeStamps() const;
   int scrapeHeaders(int &count) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->scrapeHeaders(m_tif, count);
   }
-  int countDirectories() const { return headerdata->countDirectories(m_tif); }
+  /*
+  Counting walks every directory in the file so the result is cached and
+  only recounted if the size of the file on disk changes (i.e. it is still
+  being written to)
+  */
+  int countDirectories() const;
+  /*
+  Fills dir with the tags and raw strip data of directory dirnum without
+  decoding the image. The buffers in dir are reused so passing the same
+  RawDirectory in a loop avoids reallocating for every directory
+  */
+  bool readRawDirectory(unsigned int dirnum, RawDirectory &dir);
+  /*
+  Decodes rows row_begin to row_end (exclusive) of directory dirnum into
+  dst, which must hold (row_end - row_begin) rows of the width of the
+  file, without allocating a frame. Fails if the directory isn't that
+  width or is too short
+  */
+  bool readRows(unsigned int dirnum, unsigned int row_begin,
+                unsigned int row_end, int16_t *dst);
+  // gets the Software and ImageDescription tags of directory dirnum
+  // with a single seek and without parsing them
+  bool readTags(unsigned int dirnum, std::string &swTag,
+                std::string &imDescTag);
   unsigned int getSizePerDir(int dirnum = 0) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getSizePerDir(m_tif, dirnum);
   }
   std::map<int, std::pair<int, int>> getChanLut() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getChanLut();
   }
   std::map<unsigned int, unsigned int> getSavedChans() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getChanSaved();
   }
   std::map<int, int> getChanOffsets() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getChanOffsets();
   }
-  ptime getEpochTime() const { return headerdata->getEpochTime(m_tif); };
+  ptime getEpochTime() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return headerdata->getEpochTime(m_tif);
+  };
+  double getLinePeriod() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return headerdata->getLinePeriod(m_tif);
+  }
 
   /*
   The first argument is the directory in the tiff file you want the frame number
-  & timestamp for which are the last two args
+  & timestamp for which are the last two args. Calls for increasing
+  directories step through the file rather than seeking from the start
   */
   void getFrameNumAndTimeStamp(const unsigned int, unsigned int &,
                                double &) const;
 
   void printHeader(int framenum) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     headerdata->printHeader(m_tif, framenum);
   }
   void printImageDescriptionTag() const {
-    std::string tag;
+    std::lock_guard<std::mutex> lock(m_mutex);
     headerdata->getImageDescTag(m_tif);
   }
   std::string getSWTag(int n) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getSoftwareTag(m_tif, n);
   }
   std::string getImDescTag(int n) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     return headerdata->getImageDescTag(m_tif, n);
   }
 
   void getImageSize(unsigned int &h, unsigned int &w) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
     h = m_imageheight;
     w = m_imagewidth;
   }
 
-  // called only by SITiffHeader
+  // called only by SITiffHeader, with m_mutex already held
   void setImageSize(int h, int w) {
     m_imageheight = h;
     m_imagewidth = w;
   }
 
 private:
+  // moves to directory dirnum, stepping forward with TIFFReadDirectory
+  // when reading sequentially rather than calling TIFFSetDirectory
+  bool seekDirectory(unsigned int dirnum) const;
   SITiffHeader *headerdata = nullptr;
   std::string m_filename;
   TIFF *m_tif = NULL;
+  mutable std::mutex m_mutex;
+  // cached result of countDirectories() and the file size it was valid for
+  mutable int m_ndirs = -1;
+  mutable std::uintmax_t m_ndirs_file_size = 0;
   // some values to do with frame size, byte values etc
   unsigned int m_imagewidth = 512;
   unsigned int m_imageheight = 512;
@@ -309,6 +516,73 @@ private:
   bool isopened = false;
 };
 
+/*
+Readers of one file kept open for reuse so concurrent calls, and the
+threads of the parallel stages, each decode with their own libtiff handle
+without reopening the file (and re-parsing its header) every time.
+acquire() hands out an idle reader or opens a new one; it goes back to the
+pool when the returned Lease is destroyed. Leases keep the pool alive so
+it can be replaced while some are still out
+*/
+class SITiffReaderPool
+    : public std::enable_shared_from_this<SITiffReaderPool> {
+public:
+  using Lease =
+      std::unique_ptr<SITiffReader, std::function<void(SITiffReader *)>>;
+  explicit SITiffReaderPool(const std::string &filename)
+      : m_filename(filename) {}
+  SITiffReaderPool(const SITiffReaderPool &) = delete;
+  SITiffReaderPool &operator=(const SITiffReaderPool &) = delete;
+  // throws std::runtime_error if a new reader can't be opened
+  Lease acquire();
+  std::string getfilename() const { return m_filename; }
+
+private:
+  void release(SITiffReader *reader);
+  std::string m_filename;
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<SITiffReader>> m_idle;
+};
+
+/*
+One channel of a tiff file as a read-only array of shape (frames, height,
+width) that is only read when it is indexed (see SITiffIO::asArray).
+getItem() takes the same indices as a numpy array - ints, slices with
+steps, ellipsis and integer or boolean arrays - and reads just the frames
+and the band of rows they select, in parallel and with one reader per
+thread; the rest of the index is then applied to that block by numpy
+*/
+class SITiffArray {
+public:
+  SITiffArray(std::shared_ptr<SITiffReaderPool> readers, unsigned int nchans,
+              unsigned int channel, std::size_t n_frames, unsigned int height,
+              unsigned int width, unsigned int nthreads);
+  std::size_t nFrames() const { return m_n_frames; }
+  unsigned int height() const { return m_height; }
+  unsigned int width() const { return m_width; }
+  /*
+  Reads rows row_begin to row_end (exclusive) of frames (0-indexed) into
+  dst as a row-major (frames.size(), row_end - row_begin, width) block.
+  Throws std::runtime_error if a frame can't be read
+  */
+  void read(std::span<const std::size_t> frames, unsigned int row_begin,
+            unsigned int row_end, int16_t *dst) const;
+  py::tuple shape() const;
+  py::dtype dtype() const { return py::dtype::of<int16_t>(); }
+  py::object getItem(py::object index) const;
+  // the whole array, for numpy.asarray()
+  py::object toNumpy(py::object dtype, py::object copy) const;
+
+private:
+  std::shared_ptr<SITiffReaderPool> m_readers;
+  unsigned int m_nchans;
+  unsigned int m_channel; // 1-indexed
+  std::size_t m_n_frames;
+  unsigned int m_height;
+  unsigned int m_width;
+  unsigned int m_nthreads;
+};
+
 class SITiffWriter {
 public:
   SITiffWriter() {};
@@ -324,7 +598,11 @@ public:
   // writeHdr fills out some tiff tags directly from information contained
   // in the image such as width & length and hard codes some other tags
   bool writeHdr(const arma::Mat<int16_t> &img);
+  // writes a directory read with SITiffReader::readRawDirectory, copying
+  // the strips verbatim
+  bool writeRawDirectory(RawDirectory &dir);
   std::string modifyChannel(std::string &, const unsigned int);
+  std::string modifyChannel(std::string &, const std::vector<unsigned int> &);
 
 protected:
   bool writeLibTiff(arma::Mat<int16_t> &img, const std::vector<int> &params);
@@ -337,33 +615,87 @@ private:
   std::string replaceHeaderValue(std::string &, std::string, std::string);
 };
 
+/*
+A read-only memory mapping of a whole file. The log and rotary encoder
+files are parsed in place from the mapping rather than copied line by
+line into strings. An empty file is open but has no data
+*/
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &fname);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  bool isOpen() const { return m_open; }
+  const char *data() const { return static_cast<const char *>(m_data); }
+  std::size_t size() const { return m_size; }
+
+private:
+  void *m_data = nullptr;
+  std::size_t m_size = 0;
+  bool m_open = false;
+};
+
+/*
+The per-sample data of a log or rotary encoder file held as a structure of
+arrays - one contiguous column per quantity, all of the same length. The
+rotary encoder files only fill the columns common to both
+*/
+struct VRSamples {
+  std::vector<ptime> ptimes;
+  std::vector<double> times;     // in seconds relative to the trigger
+  // as they are in the file: encoder units (rotary_encoder_units_per_turn)
+  // in log files and degrees in rotary encoder files
+  std::vector<double> rotations;
+  std::vector<double> theta; // the rotations in radians, wrapped to [0, 2PI)
+  // the translations as they are in the file and normalised to [0, 1]
+  std::vector<double> raw_x, raw_z;
+  std::vector<double> x, z;
+  std::size_t size() const { return ptimes.size(); }
+};
+
 // An abstract base class for LogFileLoader and RotaryFileLoader
 class VRDataFile {
 public:
   explicit VRDataFile(std::string fname) { m_filename = fname; }
   std::string getFilename() const { return m_filename; }
   virtual bool load() = 0;
-  double getRadianRotation(const int &i) const {
-    return m_rotations_in_rads[i];
-  }
-  int getRotation(const int &i) const { return m_rotations[i]; }
-  double getTime(const int &i) const { return m_times[i]; }
+  double getRadianRotation(const int &i) const { return m_samples.theta[i]; }
+  int getRotation(const int &i) const { return m_samples.rotations[i]; }
+  double getTime(const int &i) const { return m_samples.times[i]; }
   int getTriggerIndex() const { return m_trigger_index; }
   bool containsAcquisition() const { return m_hasAcquisition; }
   ptime getTriggerTime() const { return m_trigger_time; }
-  std::vector<ptime> getPTimes() const { return m_ptimes; }
-  std::vector<double> getTimes() const { return m_times; } // in ms
-  std::vector<double> getTheta() const { return m_rotations_in_rads; };
+  // views of the columns; they are valid for as long as the loader is
+  const VRSamples &getSamples() const { return m_samples; }
+  std::span<const ptime> getPTimes() const { return m_samples.ptimes; }
+  std::span<const double> getTimes() const { return m_samples.times; }
+  std::span<const double> getTheta() const { return m_samples.theta; };
+  /*
+  The parsed data is cached in a binary file (see getCachePath()) keyed by
+  the path, size and modification time of the file and the version of the
+  parser, so loading an unchanged file again skips the parsing. The cache
+  lives in $SITIFF_CACHE_DIR if that is set and the user's cache directory
+  otherwise
+  */
+  std::string getCachePath() const;
+  bool use_cache = true;
   bool isloaded = false;
 
 protected:
-  bool _calculateDurationsAndRotations(bool convertToRadians = true);
+  // units_per_turn is what the rotations column counts in a full turn
+  bool _calculateDurationsAndRotations(double units_per_turn);
   void setTriggerIndex(const int &n) { m_trigger_index = n; };
+  // fill m_samples from the cache, returning false if there is no valid
+  // cache for the file
+  bool readCache();
+  void writeCache();
+  // the columns of per-sample data cached alongside the times
+  virtual std::vector<std::vector<double> *> cachedColumns() {
+    return {&m_samples.rotations};
+  }
   std::string m_filename;
-  std::vector<ptime> m_ptimes;
-  std::vector<double> m_times;
-  std::vector<double> m_rotations; // these are in degrees in the file
-  std::vector<double> m_rotations_in_rads;
+  VRSamples m_samples;
   bool m_hasAcquisition = false;
   bool foundTrigger = false;
   ptime m_trigger_time = ptime();
@@ -378,28 +710,23 @@ class LogFileLoader : public VRDataFile {
 public:
   explicit LogFileLoader(std::string fname) : VRDataFile(fname) {};
   bool load() override;
-  double getXTranslation(const int &i) const { return m_x_translation[i]; };
-  double getRawXTranslation(const int &i) const {
-    return m_original_x_translation[i];
-  };
-  double getZTranslation(const int &i) const { return m_z_translation[i]; };
-  double getRawZTranslation(const int &i) const {
-    return m_original_z_translation[i];
-  };
-  std::vector<double> getX() const { return m_x_translation; };
-  std::vector<double> getRawX() const { return m_original_x_translation; };
-  std::vector<double> getZ() const { return m_z_translation; };
-  std::vector<double> getRawZ() const { return m_original_z_translation; };
+  double getXTranslation(const int &i) const { return m_samples.x[i]; };
+  double getRawXTranslation(const int &i) const { return m_samples.raw_x[i]; };
+  double getZTranslation(const int &i) const { return m_samples.z[i]; };
+  double getRawZTranslation(const int &i) const { return m_samples.raw_z[i]; };
+  std::span<const double> getX() const { return m_samples.x; };
+  std::span<const double> getRawX() const { return m_samples.raw_x; };
+  std::span<const double> getZ() const { return m_samples.z; };
+  std::span<const double> getRawZ() const { return m_samples.raw_z; };
   bool calculateDurationsAndRotations();
 
+protected:
+  std::vector<std::vector<double> *> cachedColumns() override {
+    return {&m_samples.rotations, &m_samples.raw_x, &m_samples.raw_z};
+  }
+
 private:
-  // processData converts log file times to fractional seconds
-  // and converts rotations from log file units (rotary encoder units)
-  // into radians
-  std::vector<double> m_x_translation;
-  std::vector<double> m_z_translation;
-  std::vector<double> m_original_x_translation;
-  std::vector<double> m_original_z_translation;
+  void parse();
 };
 
 class RotaryEncoderLoader : public VRDataFile {
@@ -407,6 +734,12 @@ public:
   explicit RotaryEncoderLoader(std::string fname) : VRDataFile(fname) {};
   bool load() override;
   bool calculateDurationsAndRotations();
+  // files are split into chunks of at least this many bytes that are
+  // parsed in parallel, so small files are parsed as one chunk
+  std::size_t min_chunk_size = std::size_t(4) << 20;
+
+private:
+  void parse();
 };
 /*
         This class holds the transformations that are to be applied to the
@@ -419,8 +752,8 @@ public:
    through other tools to extract the ROIs, fluorescent traces, do the spike
         deconvolution steps etc.
 
-        This class has serialization methods associated with it - the objective
-   being to store the transformations on disk in an .xml file. Each frame of the
+        The transformations of all the frames can be saved to and loaded from a
+   binary file (see TransformTable::save()). Each frame of the
    video file has an x, z and rotation value attached. These are the positional
    information extracted from the movement of the animal through the VR (x,z)
    and the rotation of the bearing as detected by a rotary encoder.
@@ -484,7 +817,7 @@ public:
   void addTransform(const TransformType &T, arma::mat M) {
     m_transforms[T] = M;
   }
-  bool hasTransform(const TransformType &T) {
+  bool hasTransform(const TransformType &T) const {
     auto search = m_transforms.find(T);
     if (search != m_transforms.end())
       return true;
@@ -492,10 +825,10 @@ public:
       return false;
   };
   // Grab a transform type and its contents
-  arma::mat getTransform(const TransformType &T) {
+  arma::mat getTransform(const TransformType &T) const {
     auto search = m_transforms.find(T);
     if (search != m_transforms.end())
-      return m_transforms[T];
+      return search->second;
     else
       return arma::mat();
   };
@@ -545,6 +878,647 @@ static std::ostream &operator<<(std::ostream &out,
   return out;
 }
 
+/*
+The positions and transforms of every frame of a file held as columns, one
+row per frame in file order. Each transform type is a dense column of
+matrices of a fixed shape (set by the first one added, e.g. 1x1 for
+kInitialRotation or 1x2 for kTrackerTranslation) stored inline one after
+the other, plus a flag per frame saying whether it has been set. Pulling
+a column out is then a copy of contiguous memory rather than a walk over
+a tree of per-frame containers
+*/
+class TransformTable {
+public:
+  struct Column {
+    unsigned int n_rows = 0;
+    unsigned int n_cols = 0;
+    std::vector<double> values;   // size() matrices, each column-major
+    std::vector<uint8_t> present; // one per frame
+    std::size_t stride() const { return std::size_t(n_rows) * n_cols; }
+    bool empty() const { return values.empty(); }
+  };
+  static constexpr std::size_t n_types =
+      std::size_t(TransformType::kHaimanPieceWiseMapping) + 1;
+
+  std::size_t size() const { return frame_numbers.size(); }
+  bool empty() const { return frame_numbers.empty(); }
+  // resizes all the columns to n frames; new frames are zeroed
+  void resize(std::size_t n);
+  void clear();
+  // the row of ScanImage frame number frame or size() if there isn't one
+  std::size_t find(unsigned int frame) const;
+
+  bool hasTransform(TransformType T) const;
+  bool hasTransform(TransformType T, std::size_t row) const;
+  // an empty matrix if row doesn't have T
+  arma::mat getTransform(TransformType T, std::size_t row) const;
+  void setTransform(TransformType T, std::size_t row, const arma::mat &M);
+  // as setTransform but tracker translations are added to any already there
+  void updateTransform(TransformType T, std::size_t row, const arma::mat &M);
+  // sets T for every frame at once from size() n_rows x n_cols matrices
+  void setTransforms(TransformType T, unsigned int n_rows, unsigned int n_cols,
+                     std::vector<double> values);
+  // sets T for the frames at positions first to first + count - 1 in the
+  // file (1-indexed) from count n_rows x n_cols matrices, leaving the
+  // other frames alone
+  void setFrameTransforms(TransformType T, unsigned int first,
+                          unsigned int count, unsigned int n_rows,
+                          unsigned int n_cols,
+                          const std::vector<double> &values);
+  const Column &column(TransformType T) const {
+    return m_columns[std::size_t(T)];
+  }
+  // everything held for one frame
+  TransformContainer getContainer(std::size_t row) const;
+  /*
+  Writes the table to / reads it from a versioned binary file: a header,
+  the per-frame columns and then a block per transform type holding its
+  presence flags and matrices. Every array starts on an 8 byte boundary so
+  the file can be memory-mapped and copied straight into the columns.
+  Values are stored in the native byte order of the machine, not swapped,
+  so a file from a machine of the other byte order is refused (its
+  version number doesn't match) rather than misread. save() writes to a
+  temporary file that is renamed over fname so a failed save leaves any
+  existing file alone. Both return false if the file can't be written/
+  isn't a valid transform file
+  */
+  bool save(const std::string &fname) const;
+  bool load(const std::string &fname);
+
+  std::vector<unsigned int> frame_numbers; // ScanImage's, 1-indexed
+  std::vector<unsigned int> frame_indices; // position in the file, 0-indexed
+  std::vector<double> timestamps;
+  std::vector<double> x;
+  std::vector<double> z;
+  std::vector<double> raw_x;
+  std::vector<double> raw_z;
+  std::vector<double> theta;
+
+private:
+  // sets the shape of T's column, allocating it if it is empty
+  Column &shapeColumn(TransformType T, unsigned int n_rows,
+                      unsigned int n_cols);
+  std::array<Column, n_types> m_columns;
+};
+
+/*
+************************* DEROTATION *************************
+
+The bearing the animal sits on rotates so the imaging plane rotates with
+it. The per-frame angle of the bearing is calculated in
+SITiffIO::interpolateIndices() and stored as TransformType::kInitialRotation.
+Derotator undoes that rotation by resampling each frame about its centre.
+*/
+enum class InterpolationType : int { kNearest, kBilinear, kBicubic };
+
+/*
+A rotation of a fixed size frame precomputed for one angle. For every
+output pixel it holds the index into the zero-padded source frame of the
+top-left pixel of the interpolation kernel and the fractional offsets
+into that kernel. Output pixels that land outside the source frame point
+into the zero border so the interpolation loops have no branches in them
+*/
+struct RotationMap {
+  std::vector<int32_t> index;
+  std::vector<float> fx;
+  std::vector<float> fy;
+};
+
+class Derotator {
+public:
+  /*
+  h and w are the size of the frames. Angles are quantised to angle_step
+  (radians) so the rotation maps can be reused between frames; the
+  max_maps most recently used are kept
+  */
+  Derotator(unsigned int h, unsigned int w,
+            InterpolationType interp = InterpolationType::kBilinear,
+            double angle_step = deg2rad(0.1), std::size_t max_maps = 32);
+  /*
+  Rotates src (h x w, row-major) by minus angle (radians) about its centre
+  into dst which must also hold h x w pixels. Safe to call from several
+  threads at once
+  */
+  void derotate(const int16_t *src, int16_t *dst, double angle);
+  arma::Mat<int16_t> derotate(const arma::Mat<int16_t> &src, double angle);
+  /*
+  As above but with a different angle for each of the h rows of src i.e.
+  the angle of the bearing when each scanline was acquired. Each output
+  pixel is rotated by the angle of the source row it comes from, looked up
+  in per-row tables of the rotation. Frames with (near enough) the same
+  angle for every row are done with a single cached map
+  */
+  void derotate(const int16_t *src, int16_t *dst,
+                std::span<const double> row_angles);
+  arma::Mat<int16_t> derotate(const arma::Mat<int16_t> &src,
+                              std::span<const double> row_angles);
+  unsigned int getHeight() const { return m_h; }
+  unsigned int getWidth() const { return m_w; }
+  InterpolationType getInterpolation() const { return m_interp; }
+
+private:
+  std::shared_ptr<const RotationMap> getMap(double angle);
+  std::shared_ptr<const RotationMap> buildMap(double angle) const;
+  // the kernel position in the padded frame of the source point (xs, ys)
+  void mapPoint(double xs, double ys, int32_t &index, float &fx,
+                float &fy) const;
+  // interpolates the n output pixels at the kernel positions given
+  void sample(const float *padded, const int32_t *index, const float *fx,
+              const float *fy, std::size_t n, int16_t *dst) const;
+  // copies src into the middle of a zero bordered float buffer
+  void pad(const int16_t *src, std::vector<float> &padded) const;
+  // the border around the padded frame is wide enough for the taps of
+  // the bicubic kernel to all land in it
+  static constexpr unsigned int border = 4;
+  unsigned int m_h;
+  unsigned int m_w;
+  unsigned int m_padded_w;
+  unsigned int m_padded_h;
+  InterpolationType m_interp;
+  double m_angle_step;
+  long m_n_steps;
+  std::size_t m_max_maps;
+  // least recently used cache of maps keyed on the quantised angle
+  std::mutex m_mutex;
+  std::list<long> m_lru;
+  std::unordered_map<
+      long, std::pair<std::shared_ptr<const RotationMap>,
+                      std::list<long>::iterator>>
+      m_maps;
+};
+
+/*
+************************* REGISTRATION *************************
+
+Rigid motion correction by phase correlation. The translation of a frame
+relative to a reference image is the position of the peak of the inverse
+FFT of their normalised cross-power spectrum. The images are windowed and
+zero-padded to powers of two so a radix-2 FFT can be used throughout.
+The translations are stored as TransformType::kHaimanFFTTranslation.
+*/
+
+/*
+An in-place complex FFT of a fixed power of two length. The twiddle
+factors and bit-reversal permutation are computed once when the plan is
+made; get() keeps one plan per length so they are made once per process.
+Plans are immutable so one can be used from several threads at once. The
+inverse is unscaled
+*/
+class FFTPlan {
+public:
+  explicit FFTPlan(std::size_t n);
+  static std::shared_ptr<const FFTPlan> get(std::size_t n);
+  std::size_t size() const { return m_n; }
+  void forward(std::complex<float> *data) const { transform(data, false); }
+  void inverse(std::complex<float> *data) const { transform(data, true); }
+
+private:
+  void transform(std::complex<float> *data, bool inverse) const;
+  std::size_t m_n;
+  std::vector<uint32_t> m_bitrev;
+  std::vector<std::complex<float>> m_twiddles;
+  std::vector<std::complex<float>> m_inverse_twiddles;
+};
+
+// the (unscaled if inverse) 2D FFT of a rows x cols row-major array in
+// place; both have to be powers of two
+void fft2d(std::complex<float> *data, std::size_t rows, std::size_t cols,
+           bool inverse = false);
+
+class PhaseCorrelator {
+public:
+  /*
+  reference is h x w, row-major. Shifts are looked for up to max_shift
+  pixels in each direction (0 means a quarter of the smaller side).
+  Without window the images aren't tapered, which is what is wanted when
+  they are periodic and a power of two in size so the correlation is
+  circular
+  */
+  PhaseCorrelator(const float *reference, unsigned int h, unsigned int w,
+                  unsigned int max_shift = 0, bool window = true);
+  PhaseCorrelator(const arma::Mat<float> &reference,
+                  unsigned int max_shift = 0, bool window = true);
+  /*
+  The (x, y) translation of frame (h x w, row-major) relative to the
+  reference i.e. frame(y, x) ~ reference(y - dy, x - dx). The peak is
+  refined to sub-pixel precision by fitting a parabola through it and its
+  neighbours along each axis. Safe to call from several threads at once
+  */
+  std::pair<double, double> shift(const int16_t *frame) const;
+  std::pair<double, double> shift(const float *frame) const;
+  unsigned int getHeight() const { return m_h; }
+  unsigned int getWidth() const { return m_w; }
+
+private:
+  template <typename T> std::pair<double, double> shiftOf(const T *frame) const;
+  auto separable() const {
+    return [this](unsigned int y, unsigned int x) {
+      return m_window_y[y] * m_window_x[x];
+    };
+  }
+  unsigned int m_h;
+  unsigned int m_w;
+  std::size_t m_ph;
+  std::size_t m_pw;
+  unsigned int m_max_shift;
+  // the separable Hann window (all ones without window)
+  std::vector<float> m_window_y;
+  std::vector<float> m_window_x;
+  // the conjugate of the whitened FFT of the reference, low-pass filtered
+  std::vector<std::complex<float>> m_reference;
+};
+
+/*
+Estimates the rotation and scale of a frame relative to a reference from
+their FFT magnitude spectra, which don't change when the frame is
+translated (Fourier-Mellin). Rotating or scaling a frame rotates or
+scales its spectrum so, resampled onto log-polar coordinates, both become
+translations that are found by phase correlation. The spectra are
+high-pass filtered first so the low frequencies, which every image has
+plenty of, don't swamp the peak. The remap from the spectrum to log-polar
+coordinates (n_angles angles over half a turn by n_radii log-spaced
+radii, both powers of two) is precomputed for the frame size
+*/
+class LogPolarEstimator {
+public:
+  LogPolarEstimator(const float *reference, unsigned int h, unsigned int w,
+                    unsigned int n_angles = 256, unsigned int n_radii = 128);
+  LogPolarEstimator(const arma::Mat<float> &reference,
+                    unsigned int n_angles = 256, unsigned int n_radii = 128);
+  /*
+  The angle (radians) and scale of frame (h x w, row-major) relative to
+  the reference: frame is the reference rotated by angle about its centre
+  and magnified by scale, so Derotator::derotate(frame, angle) undoes the
+  rotation. The spectra are symmetric so angles are only found to within
+  a quarter of a turn either way. Safe to call from several threads at
+  once
+  */
+  std::pair<double, double> estimate(const int16_t *frame) const;
+  unsigned int getHeight() const { return m_h; }
+  unsigned int getWidth() const { return m_w; }
+
+private:
+  // the log of the high-pass filtered magnitude spectrum of img in
+  // log-polar coordinates, n_angles rows by n_radii columns
+  template <typename T>
+  void logPolar(const T *img, std::vector<float> &out) const;
+  unsigned int m_h;
+  unsigned int m_w;
+  std::size_t m_ph;
+  std::size_t m_pw;
+  unsigned int m_n_angles;
+  unsigned int m_n_radii;
+  // the step in log(radius) between columns
+  double m_log_step;
+  // h x w, radially symmetric
+  std::vector<float> m_window;
+  // for each log-polar pixel the four spectrum bins around it, the
+  // bilinear weights between them and the high-pass filter there
+  std::vector<std::array<uint32_t, 4>> m_taps;
+  std::vector<float> m_fx;
+  std::vector<float> m_fy;
+  std::vector<float> m_filter;
+  std::unique_ptr<PhaseCorrelator> m_correlator;
+};
+
+/*
+Translates src (h x w, row-major) by (dx, dy) pixels into dst so that
+dst(y, x) = src(y - dy, x - dx), interpolating bilinearly. Pixels that
+come from outside the frame are zero
+*/
+void translateFrame(const int16_t *src, int16_t *dst, unsigned int h,
+                    unsigned int w, double dx, double dy);
+
+/*
+Non-rigid motion correction. The frame is split into a grid of
+overlapping patch_size square patches (patches along an edge are moved in
+to end at it) and the translation of each against the same patch of the
+reference is found by phase correlation. The shifts of the grid are
+smoothed by replacing each with the median of it and its neighbours so a
+patch that locked onto the wrong peak doesn't distort its part of the
+frame. warp() undoes them, the shift at each pixel being interpolated
+bilinearly between the centres of the patches. The shifts are stored as
+TransformType::kHaimanPieceWiseMapping, an n_patches x 2 (x, y) matrix
+with the patches in row-major grid order
+*/
+class PiecewiseRegistration {
+public:
+  /*
+  reference is h x w, row-major. overlap is the fraction of a patch that
+  neighbouring patches share. Shifts are looked for up to max_shift pixels
+  (0 means a quarter of a patch)
+  */
+  PiecewiseRegistration(const float *reference, unsigned int h,
+                        unsigned int w, unsigned int patch_size = 128,
+                        double overlap = 0.5, unsigned int max_shift = 0);
+  PiecewiseRegistration(const arma::Mat<float> &reference,
+                        unsigned int patch_size = 128, double overlap = 0.5,
+                        unsigned int max_shift = 0);
+  /*
+  The smoothed (x, y) translations of the patches of frame (h x w,
+  row-major) relative to the reference, as in PhaseCorrelator::shift. The
+  x shifts of all the patches come first, then the y shifts (the
+  column-major order of the n_patches x 2 matrix). Safe to call from
+  several threads at once
+  */
+  std::vector<double> shifts(const int16_t *frame) const;
+  /*
+  Undoes shifts (as returned by shifts()) so dst(y, x) = src(y + dy, x +
+  dx) with (dx, dy) the shift interpolated at (x, y). Pixels that come
+  from outside the frame are zero
+  */
+  void warp(const int16_t *src, int16_t *dst,
+            std::span<const double> shifts) const;
+  unsigned int getHeight() const { return m_h; }
+  unsigned int getWidth() const { return m_w; }
+  unsigned int nPatchRows() const { return m_ys.size(); }
+  unsigned int nPatchCols() const { return m_xs.size(); }
+  unsigned int nPatches() const { return m_ys.size() * m_xs.size(); }
+
+private:
+  unsigned int m_h;
+  unsigned int m_w;
+  unsigned int m_ph;
+  unsigned int m_pw;
+  // the top rows and left columns of the patches
+  std::vector<unsigned int> m_ys;
+  std::vector<unsigned int> m_xs;
+  std::vector<PhaseCorrelator> m_correlators;
+  // for each row (column) of the frame the patch row (column) whose centre
+  // is at or before it and how far it is towards the next one
+  std::vector<unsigned int> m_row_patch;
+  std::vector<float> m_row_weight;
+  std::vector<unsigned int> m_col_patch;
+  std::vector<float> m_col_weight;
+};
+
+/*
+Follows a template through a stream of frames by normalised
+cross-correlation. Each call to track() looks for the template within
+search pixels of where it was found in the last frame so drift is
+followed over any distance at the cost of a small search. The
+correlations of all the candidate positions are accumulated a template
+row at a time into contiguous rows of the correlation surface, and the
+local means and energies of the frame come from running sums. The peak
+is refined to sub-pixel precision as in PhaseCorrelator. Translations are stored as
+TransformType::kMultiTrackerTranslation (n_templates x 2) and, averaged
+over the templates, kTrackerTranslation (1 x 2)
+*/
+class TemplateTracker {
+public:
+  /*
+  tmpl is th x tw, row-major, and starts with its top-left corner at
+  (x, y) in frames that are h x w. It has to fit inside the frames and
+  can't be flat
+  */
+  TemplateTracker(const float *tmpl, unsigned int th, unsigned int tw,
+                  unsigned int h, unsigned int w, double x, double y,
+                  unsigned int search = 16);
+  TemplateTracker(const arma::Mat<float> &tmpl, unsigned int h,
+                  unsigned int w, double x, double y,
+                  unsigned int search = 16);
+  /*
+  Finds the template in frame (h x w, row-major), moves it there and
+  returns its (x, y) translation from where it started i.e. the frame
+  around it is the first one moved by (dx, dy). Not thread-safe: one
+  tracker follows one template through the frames in order
+  */
+  std::pair<double, double> track(const int16_t *frame);
+  // the normalised cross-correlation (-1 to 1) of the last match
+  double getScore() const { return m_score; }
+  std::pair<double, double> getPosition() const { return {m_x, m_y}; }
+
+private:
+  unsigned int m_th;
+  unsigned int m_tw;
+  unsigned int m_h;
+  unsigned int m_w;
+  unsigned int m_search;
+  double m_x0;
+  double m_y0;
+  double m_x;
+  double m_y;
+  double m_score = 0;
+  // zero mean and unit norm
+  std::vector<float> m_template;
+  // the part of the frame searched and the correlation surface over it
+  std::vector<float> m_region;
+  std::vector<float> m_corr;
+  std::vector<double> m_sum;
+  std::vector<double> m_sum_sq;
+};
+
+/*
+Dense optical flow by pyramidal Lucas-Kanade against a fixed reference.
+As the reference doesn't change its gradients and the inverse of their
+windowed structure tensor are worked out once for every level of its
+pyramid, so each iteration on a frame is a warp, two products and two
+box filters, all straight loops over contiguous rows. The flow is found
+on the coarsest level first and each finer level refines it, so motion
+of a few pixels times 2^(levels - 1) can be followed. Pixels whose
+window has no texture in it keep the flow of the coarser level
+*/
+class OpticalFlow {
+public:
+  /*
+  reference is h x w, row-major. window is the side of the square the
+  flow is assumed constant over and iterations the number of updates per
+  level
+  */
+  OpticalFlow(const float *reference, unsigned int h, unsigned int w,
+              unsigned int levels = 3, unsigned int window = 11,
+              unsigned int iterations = 3);
+  OpticalFlow(const arma::Mat<float> &reference, unsigned int levels = 3,
+              unsigned int window = 11, unsigned int iterations = 3);
+  /*
+  The flow (u, v) at every pixel of frame (h x w, row-major) i.e.
+  frame(y + v, x + u) ~ reference(y, x), the same sense as
+  PhaseCorrelator::shift. u and v are resized to h x w, row-major. Safe
+  to call from several threads at once
+  */
+  void flow(const int16_t *frame, std::vector<float> &u,
+            std::vector<float> &v) const;
+  unsigned int getHeight() const { return m_h; }
+  unsigned int getWidth() const { return m_w; }
+
+private:
+  struct Level {
+    unsigned int h;
+    unsigned int w;
+    std::vector<float> reference;
+    std::vector<float> gx;
+    std::vector<float> gy;
+    // the inverse of the windowed structure tensor [a b; b c]
+    std::vector<float> a;
+    std::vector<float> b;
+    std::vector<float> c;
+  };
+  unsigned int m_h;
+  unsigned int m_w;
+  unsigned int m_radius;
+  unsigned int m_iterations;
+  std::vector<Level> m_levels;
+};
+
+/*
+Optical flow fields of a run of frames kept compactly: the flow averaged
+over step x step cells and quantised to int16 in units of quantum
+pixels, (frames, rows, cols, 2) with (u, v) last
+*/
+struct OpticalFlowFields {
+  static constexpr float quantum = 1.0f / 256;
+  unsigned int first = 1; // the frame (1-indexed) of the first field
+  unsigned int n_frames = 0;
+  unsigned int rows = 0;
+  unsigned int cols = 0;
+  unsigned int step = 0;
+  std::vector<int16_t> values;
+  /*
+  Averages the flow (u, v) of an h x w frame (as from OpticalFlow::flow())
+  over the cells and stores it quantised as field k, which values has to
+  hold already. Returns the mean and largest speed over the cells in
+  pixels. Different fields can be stored from different threads at once
+  */
+  std::pair<double, double> store(std::size_t k, const std::vector<float> &u,
+                                  const std::vector<float> &v,
+                                  unsigned int h, unsigned int w);
+};
+
+/*
+Linear-time alignment of behavioural samples to frame (or any other) times.
+bracketTimes locates each of the times in at among sample_times with a
+single two-pointer sweep, so both should be sorted (out of order times
+fall back to a binary search). index[i] is the last sample at or before
+at[i] and weight[i] is how far at[i] lies between that sample and the next
+one; times outside the samples are clamped to the first or last sample.
+The interpolate functions then resample a column of the samples at the
+bracketed times. interpolateAngle takes the shorter way round the circle
+between neighbouring samples and keeps angles that were in [0, 2PI) there
+*/
+struct SampleBracket {
+  std::vector<std::size_t> index;
+  std::vector<double> weight;
+  std::size_t size() const { return index.size(); }
+};
+
+SampleBracket bracketTimes(std::span<const double> sample_times,
+                           std::span<const double> at);
+std::vector<double> interpolateLinear(std::span<const double> values,
+                                      const SampleBracket &bracket);
+std::vector<double> interpolateAngle(std::span<const double> values,
+                                     const SampleBracket &bracket);
+// the times in seconds relative to origin
+std::vector<double> secondsSince(std::span<const ptime> times, ptime origin);
+
+/*
+Resamples columns of values taken at sample_times onto another sorted grid
+of times. kNearest takes the closest sample, kLinear interpolates between
+the samples either side and kBoxcar averages the samples in a bin around
+each grid time, the bins meeting halfway between neighbouring grid times
+(a bin with no samples in it is interpolated instead). The bracketing is
+done once on construction so any number of columns sampled at the same
+times can be resampled with it. Large grids are split across nthreads
+threads (0 means all of them)
+*/
+enum class ResampleMode : int { kNearest, kLinear, kBoxcar };
+
+class Resampler {
+public:
+  Resampler(std::span<const double> sample_times, std::span<const double> grid,
+            ResampleMode mode = ResampleMode::kLinear,
+            unsigned int nthreads = 0);
+  std::vector<double> operator()(std::span<const double> values) const;
+  std::size_t size() const { return m_bracket.size(); }
+
+private:
+  unsigned int threadsFor(std::size_t n) const;
+  ResampleMode m_mode;
+  unsigned int m_nthreads;
+  std::size_t m_nsamples;
+  SampleBracket m_bracket;
+  // the samples [m_begin[i], m_end[i]) in the bin of grid time i (kBoxcar)
+  std::vector<std::size_t> m_begin, m_end;
+};
+
+// angles with the jumps of 2PI where they wrap around removed
+std::vector<double> unwrapAngles(std::span<const double> radians);
+
+/*
+Regions of interest as a sparse matrix in compressed sparse row form (as
+scipy.sparse.csr_matrix): the pixels of ROI i are indices[indptr[i]] to
+indices[indptr[i + 1] - 1] (row-major indices into a frame) with the
+matching weights. sort() orders each ROI's pixels so reading them steps
+forward through the frame
+*/
+struct RoiMasks {
+  std::vector<uint32_t> indptr;
+  std::vector<uint32_t> indices;
+  std::vector<float> weights;
+  std::size_t size() const { return indptr.empty() ? 0 : indptr.size() - 1; }
+  // throws std::invalid_argument if the masks aren't valid CSR or index
+  // pixels outside a frame of n_pixels
+  void check(std::size_t n_pixels) const;
+  void sort();
+};
+
+/*
+The local correlation image of a stream of frames: for each pixel the
+mean over its 4 or 8 neighbours of the correlation of their values
+through time. Only running sums are kept - of each pixel, its square and
+its product with the neighbour to the right and below it (and the two
+below diagonals for 8 neighbours) - so memory doesn't depend on the
+number of frames. They are int64 so they are exact for any length of
+recording. Frames are added a row band per thread
+*/
+class LocalCorrelation {
+public:
+  LocalCorrelation(unsigned int h, unsigned int w,
+                   unsigned int neighbours = 8);
+  // adds frames (each h x w, row-major), splitting the rows among
+  // nthreads threads (0 means all of them)
+  void add(std::span<const int16_t *const> frames, unsigned int nthreads = 1);
+  void add(const int16_t *frame) { add(std::span(&frame, 1)); }
+  std::size_t count() const { return m_count; }
+  // the correlation image (h x w, row-major); zero where a pixel or all
+  // its neighbours didn't change
+  arma::Mat<float> image() const;
+
+private:
+  unsigned int m_h;
+  unsigned int m_w;
+  std::size_t m_count = 0;
+  std::vector<int64_t> m_sum;
+  std::vector<int64_t> m_sum_sq;
+  // the sums of products with the neighbour in each of the directions
+  // below (dy, dx), indexed by the pixel the direction starts from
+  std::vector<std::pair<int, int>> m_directions;
+  std::vector<std::vector<int64_t>> m_cross;
+};
+
+// The ScanImage frame number and timestamp (seconds from the start of the
+// acquisition) of each frame of a tiff file
+struct FrameIndex {
+  std::vector<unsigned int> frame_numbers;
+  std::vector<double> timestamps;
+  std::size_t size() const { return timestamps.size(); }
+};
+
+// The behavioural data resampled onto a grid of times (see
+// SITiffIO::resampleBehaviour). The columns from the log file are empty if
+// none is loaded
+struct ResampledBehaviour {
+  std::vector<double> x, z, raw_x, raw_z;
+  std::vector<double> theta; // unwrapped, in radians
+};
+
+/*
+Calls that read the file open for reading (frames, headers, exports,
+projections, derotation, interpolateIndices) can be made from several
+threads at once: frames are decoded with readers from a pool, one per
+concurrent call, and the cached frame index and transform table are
+swapped for new copies rather than changed in place. Opening or closing
+files while other calls are in flight is not supported
+*/
 class SITiffIO {
 public:
   ~SITiffIO();
@@ -555,7 +1529,27 @@ public:
   bool openRotary(std::string fname);
   unsigned int countDirectories();
   void interpolateIndices(const int &);
+  /*
+  The frame numbers and timestamps of all the frames in the file open for
+  reading. The headers are read once, in parallel, and the result is kept
+  until another file is opened; frames appended to the file since are
+  read when it is next asked for
+  */
+  std::shared_ptr<const FrameIndex> getFrameIndex();
+  /*
+  Resamples X, Z and the rotation onto times, given in seconds from the
+  start of the acquisition (the same clock as getTiffTimeStamps()). The
+  rotation comes from the rotary encoder file if one is loaded and the log
+  file otherwise and is unwrapped so it is continuous across full turns
+  */
+  ResampledBehaviour
+  resampleBehaviour(std::span<const double> times,
+                    ResampleMode mode = ResampleMode::kLinear);
+  py::dict resample(
+      py::array_t<double, py::array::c_style | py::array::forcecast> times,
+      ResampleMode mode = ResampleMode::kLinear);
   std::tuple<unsigned int> getNChannels() const;
+  std::tuple<unsigned int, unsigned int> getImageSize() const;
   void setChannel(unsigned int i) { channel2display = i; }
   unsigned int getDisplayChannel() const;
   py::array_t<int16_t> readFrame(int frame_num);
@@ -569,10 +1563,230 @@ public:
   std::vector<double> getFrameNumbers() const;
   std::vector<ptime> getLogFileTimes() const;
   std::vector<ptime> getRotaryTimes() const;
+  /*
+  The per-sample columns of the log file (time, x, z, raw_x, raw_z and
+  theta) and the rotary encoder file (time and theta) as a dict of numpy
+  arrays. The arrays are read-only views of the loader's memory rather
+  than copies and keep the loader alive for as long as they exist
+  */
+  py::dict getLogData() const;
+  py::dict getRotaryData() const;
   ptime getLogFileTriggerTime() const;
   ptime getRotaryEncoderTriggerTime() const;
   ptime getEpochTime() const;
   void saveTiffTail(const int &, std::string);
+  /*
+  Copies frames first to last (1-indexed, inclusive; last = 0 means the
+  last frame in the file) of the given channels (1-indexed; empty means
+  all saved channels) to a new file. The strips are copied raw along with
+  the ScanImage headers so nothing is decoded
+  */
+  bool saveFrames(const std::string &fname, unsigned int first = 1,
+                  unsigned int last = 0,
+                  std::vector<unsigned int> channels = {});
+  /*
+  Writes each channel to its own file in a single pass through the file
+  currently open for reading. Directories are routed to a writer by their
+  position in the channel interleave and copied raw. The files are named
+  <fname>_chanN<ext> where N is the channel number and fname defaults to
+  that of the file open for reading. Returns the names of the new files.
+  Throws std::runtime_error if a file can't be opened or written to
+  */
+  std::vector<std::string> splitChannels(std::string fname = "",
+                                         unsigned int first = 1,
+                                         unsigned int last = 0);
+  /*
+  Writes frames first to last of the display channel to fname, each rotated
+  by minus its kInitialRotation angle so the field of view is stabilised.
+  interpolateIndices() has to have been called first. Frames are read and
+  derotated in parallel in batches and streamed in order to an SITiffWriter
+  along with the ScanImage headers of the source directories.
+  With per_line each row is instead rotated by the angle of the bearing
+  when that scanline was acquired (see getLineTimes()), which keeps fast
+  turns sharp. This needs a log or rotary encoder file rather than
+  interpolateIndices()
+  */
+  bool derotate(const std::string &fname, unsigned int first = 1,
+                unsigned int last = 0,
+                InterpolationType interp = InterpolationType::kBilinear,
+                bool per_line = false);
+  /*
+  Rigid motion correction of frames first to last of channel (0 means the
+  display channel). The reference is the mean projection of the first
+  n_reference frames of the range, sharpened by registering those frames
+  to it and averaging them again. Every frame is then registered to the
+  reference by phase correlation (see PhaseCorrelator) to within max_shift
+  pixels (0 means a quarter of the frame), in parallel in batches. The
+  (x, y) shifts are stored as kHaimanFFTTranslation for the frames in the
+  table made by interpolateIndices(), which has to be called first. If
+  fname isn't empty the frames are also written there with the shifts
+  undone, streamed in order to an SITiffWriter with the ScanImage headers
+  of the source directories. Returns the number of frames registered.
+  With rotation the residual rotation and scale of each frame against the
+  reference are estimated in the same pass (see LogPolarEstimator) and
+  stored as kLogPolarRotation (angle, scale). Each frame is derotated by
+  its angle before its translation is found, so the translations are
+  those of the derotated frames. The scale is only estimated
+  */
+  unsigned int registerTranslation(unsigned int channel = 0,
+                                   unsigned int first = 1,
+                                   unsigned int last = 0,
+                                   const std::string &fname = "",
+                                   unsigned int n_reference = 500,
+                                   unsigned int max_shift = 0,
+                                   bool rotation = false);
+  /*
+  Non-rigid registration of frames first to last (1-indexed, 0 means the
+  last frame) of channel by PiecewiseRegistration, the reference being
+  built as for registerTranslation. Any kLogPolarRotation and
+  kHaimanFFTTranslation already found for a frame are undone before its
+  patches are compared, so this can refine the rigid registration. The
+  shifts of the patches are stored as kHaimanPieceWiseMapping and, if
+  fname isn't empty, the corrected frames are written there as for
+  registerTranslation. Frames are done in parallel batches so memory use
+  doesn't grow with their number. Returns the number of frames registered
+  */
+  unsigned int registerPiecewise(unsigned int channel = 0,
+                                 unsigned int first = 1, unsigned int last = 0,
+                                 const std::string &fname = "",
+                                 unsigned int patch_size = 128,
+                                 double overlap = 0.5,
+                                 unsigned int n_reference = 500,
+                                 unsigned int max_shift = 0);
+  /*
+  Tracks templates through frames first to last (1-indexed, 0 means the
+  last frame) of channel with a TemplateTracker each. The templates are
+  the boxes (x, y, width, height) of the mean of the first n_reference
+  frames of the range. Frames are read in parallel batches and the
+  templates are tracked in parallel over each batch. The translations
+  are stored as kMultiTrackerTranslation (one row per box) and their mean
+  as kTrackerTranslation, which getTrackerTranslation() reads back.
+  Returns the number of frames tracked
+  */
+  unsigned int trackTemplates(
+      const std::vector<std::array<unsigned int, 4>> &boxes,
+      unsigned int channel = 0, unsigned int first = 1, unsigned int last = 0,
+      unsigned int search = 16, unsigned int n_reference = 10);
+  /*
+  Dense optical flow (see OpticalFlow) of frames first to last (1-indexed,
+  0 means the last frame) of channel against the reference
+  registerTranslation uses, computed for frames in parallel. The fields
+  are kept as OpticalFlowFields averaged over step x step pixel cells
+  (getOpticalFlow()) and the mean and largest flow (pixels) of each
+  frame's field are stored as kOpticalFlow (1 x 2) for quality control.
+  Returns the number of frames done
+  */
+  unsigned int estimateOpticalFlow(unsigned int channel = 0,
+                                   unsigned int first = 1,
+                                   unsigned int last = 0,
+                                   unsigned int step = 16,
+                                   unsigned int n_reference = 500,
+                                   unsigned int levels = 3,
+                                   unsigned int window = 11);
+  // the fields from the last estimateOpticalFlow() (null if there weren't
+  // any)
+  std::shared_ptr<const OpticalFlowFields> getOpticalFlowFields() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_optical_flow;
+  }
+  // the fields as a float32 array of shape (frames, rows, cols, 2) in
+  // pixels; empty if there aren't any
+  py::array_t<float> getOpticalFlow() const;
+  /*
+  The time taken to scan one line of a frame (seconds). Taken from the
+  header if it is there, otherwise estimated by spreading the median
+  interval between frames evenly over the rows of a frame
+  */
+  double getLinePeriod();
+  /*
+  The time (seconds from the start of the acquisition) of the middle of
+  each scanline of frame (1-indexed), i.e. the frame's timestamp plus
+  (row + 0.5) line periods
+  */
+  std::vector<double> getLineTimes(unsigned int frame);
+  /*
+  Export frames first to last of channel (0 means the display channel) to a
+  chunked on-disk array of shape (frames, height, width) so later passes
+  can memory-map or slice the data without going through libtiff.
+  exportZarr writes a Zarr v2 directory store at path with the given chunk
+  shape (0 means the whole of that dimension, except for chunk_frames where
+  it means as many frames as fit in 256MB per thread) and zlib compression at
+  compression_level (0 means uncompressed). exportNpy writes a single .npy
+  file that can be opened with np.load(path, mmap_mode="r").
+  Frames are decoded in parallel with an SITiffReader per thread
+  */
+  bool exportZarr(const std::string &path, unsigned int channel = 0,
+                  unsigned int first = 1, unsigned int last = 0,
+                  unsigned int chunk_frames = 64, unsigned int chunk_height = 0,
+                  unsigned int chunk_width = 0, int compression_level = 0);
+  bool exportNpy(const std::string &path, unsigned int channel = 0,
+                 unsigned int first = 1, unsigned int last = 0);
+  /*
+  Mean and maximum intensity projections of frames first to last of channel
+  (0 means the display channel). Like the frames from SITiffReader::readframe
+  the images are held row-major in memory; getProjection() hands them to
+  numpy as C-order (height, width) arrays
+  */
+  std::tuple<arma::Mat<float>, arma::Mat<int16_t>>
+  project(unsigned int channel = 0, unsigned int first = 1,
+          unsigned int last = 0);
+  std::tuple<py::array_t<float>, py::array_t<int16_t>>
+  getProjection(unsigned int channel = 0, unsigned int first = 1,
+                unsigned int last = 0);
+  /*
+  The fluorescence traces of masks through frames first to last of channel
+  (0 means the display channel) in one parallel pass over the frames: the
+  weighted mean of each ROI's pixels (the weighted sum if its weights add
+  up to 0) in every frame, as an (rois, frames) matrix. Stops at the first
+  frame that can't be read
+  */
+  arma::Mat<float> extractTraces(RoiMasks masks, unsigned int channel = 0,
+                                 unsigned int first = 1,
+                                 unsigned int last = 0);
+  // extractTraces with the masks as the arrays of a scipy.sparse.csr_matrix
+  using IndexArray =
+      py::array_t<int64_t, py::array::c_style | py::array::forcecast>;
+  py::array_t<float>
+  getTraces(IndexArray indptr, IndexArray indices,
+            py::array_t<float, py::array::c_style | py::array::forcecast>
+                weights,
+            unsigned int channel = 0, unsigned int first = 1,
+            unsigned int last = 0);
+  /*
+  The local correlation image (see LocalCorrelation) of frames first to
+  last of channel (0 means the display channel) with 4 or 8 neighbours,
+  made in one streaming pass with constant memory. Like project() the
+  image is held row-major and getLocalCorrelation() returns it as a
+  C-order (height, width) array
+  */
+  arma::Mat<float> localCorrelation(unsigned int channel = 0,
+                                    unsigned int first = 1,
+                                    unsigned int last = 0,
+                                    unsigned int neighbours = 8);
+  py::array_t<float> getLocalCorrelation(unsigned int channel = 0,
+                                         unsigned int first = 1,
+                                         unsigned int last = 0,
+                                         unsigned int neighbours = 8);
+  /*
+  A lazily read view of channel (0 means the display channel) of the file
+  open for reading as an array of shape (frames, height, width). The
+  number of frames is fixed when it is made
+  */
+  SITiffArray asArray(unsigned int channel = 0);
+  /*
+  asyncio versions of reading frames (1-indexed, of channel; 0 means the
+  display channel), tail() and countDirectories(). Each has to be called
+  from the thread running an asyncio event loop and returns a future of
+  that loop. The work is done on a native worker pool without the GIL,
+  which is only taken to hand the result over to the loop
+  */
+  py::object readFramesAsync(std::vector<unsigned int> frames,
+                             unsigned int channel = 0);
+  py::object tailAsync(unsigned int n = 1000);
+  py::object countDirectoriesAsync();
+  // the number of threads the parallel stages use; 0 means all of them
+  void setNThreads(unsigned int n) { m_nthreads = n; }
+  unsigned int getNThreads() const;
   std::tuple<py::array_t<int16_t>, std::vector<double>> tail(const int &);
   std::pair<int, int> getChannelLUT();
   std::tuple<double, double, double> getPos(const unsigned int) const;
@@ -581,19 +1795,106 @@ public:
   std::tuple<double, double> getTrackerTranslation(const unsigned int) const;
   std::tuple<std::vector<double>, std::vector<double>>
   getAllTrackerTranslation() const;
-  auto getAllTransforms() { return m_all_transforms; }
+  std::shared_ptr<const TransformTable> getAllTransforms() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_all_transforms;
+  }
+  /*
+  A read-only numpy view of shape (frames, rows, cols) of transform T for
+  every frame in the table filled out by interpolateIndices(). Frames that
+  don't have T are zero
+  */
+  py::array_t<double> getTransformArray(TransformType T) const;
+  /*
+  The per-frame columns of the table filled out by interpolateIndices()
+  (frame, timestamp, x, z, raw_x, raw_z and theta) as a dict of read-only
+  numpy views, so the whole table can be had without copying it
+  */
+  py::dict getFrameTable() const;
+  // saves/ loads the transform table (see TransformTable::save())
+  bool saveTransforms(const std::string &fname) const;
+  bool loadTransforms(const std::string &fname);
   void printVersion();
   unsigned int m_nchans = 1;
   unsigned int channel2display = 1;
 
 private:
+  // checks first and last are a valid (1-indexed, inclusive) frame range,
+  // setting last to the final frame if it is 0
+  void checkFrameRange(unsigned int &first, unsigned int &last);
+  // checks channel is valid (1-indexed), returning the display channel if
+  // it is 0
+  unsigned int checkChannel(unsigned int channel) const;
+  // the number ScanImage knows channel (1-indexed in the file) by, for the
+  // channelSave entry of the headers of files written from it
+  unsigned int savedChannelId(unsigned int channel) const;
+  // n readers on the file open for reading from the pool, one per worker
+  // thread as libtiff handles can't be shared between threads
+  std::vector<SITiffReaderPool::Lease> openReaders(unsigned int n) const;
+  // the reference registerTranslation() registers frames of channel to:
+  // the mean of frames first to last registered to their mean
+  arma::Mat<float> registrationReference(unsigned int channel,
+                                         unsigned int first, unsigned int last,
+                                         unsigned int max_shift);
+  // a frame read by readBatches() and, if asked for, the ScanImage
+  // headers of its directory
+  struct SourceFrame {
+    arma::Mat<int16_t> img;
+    std::string swTag;
+    std::string imDescTag;
+  };
+  /*
+  Reads frames first to last of channel in parallel batches of a few
+  frames per worker thread and calls process(start, batch) with each in
+  order, start being the first frame of the batch. Reading stops at the
+  first frame that can't be read, which is left out of its batch along
+  with those after it. Returns the number of frames read
+  */
+  unsigned int readBatches(
+      unsigned int channel, unsigned int first, unsigned int last,
+      bool with_tags,
+      const std::function<void(unsigned int, std::vector<SourceFrame> &)>
+          &process);
+  /*
+  Reads frames first to last of channel with readBatches() and calls
+  correct(frame, src, dst) on each from the worker threads. dst is null
+  unless fname isn't empty, in which case what is put in it is streamed
+  in order to fname along with the ScanImage headers of the source
+  directories, changed to say the file holds just channel. Stops at the
+  first frame that can't be read and returns the number of frames done
+  */
+  unsigned int correctFrames(
+      unsigned int channel, unsigned int first, unsigned int last,
+      const std::string &fname,
+      const std::function<void(unsigned int, const int16_t *, int16_t *)>
+          &correct);
+  unsigned int copyDirectories(SITiffWriter &writer, unsigned int first,
+                               unsigned int last,
+                               std::vector<unsigned int> channels);
+  // applies update to a copy of the transforms and swaps the copy in, so
+  // numpy views of the old table don't change underneath Python and
+  // updates from concurrent calls aren't lost
+  void updateTransforms(const std::function<void(TransformTable &)> &update);
+  // the workers the async functions run on, started on first use
+  WorkerPool &asyncWorkers();
   std::string log_fname;
+  unsigned int m_nthreads = 0;
+  std::shared_ptr<const FrameIndex> m_frame_index = nullptr;
+  std::atomic<double> m_line_period = 0;
+  // guards swapping m_all_transforms and m_optical_flow; held only while
+  // copying the pointer, or the table in updateTransforms()
+  mutable std::mutex m_mutex;
+  // guards m_frame_index and is held while it is being extended
+  std::mutex m_index_mutex;
   std::shared_ptr<SITiffReader> TiffReader = nullptr;
+  std::shared_ptr<SITiffReaderPool> m_readers = nullptr;
   std::shared_ptr<SITiffWriter> TiffWriter = nullptr;
   std::shared_ptr<LogFileLoader> LogLoader = nullptr;
   std::shared_ptr<RotaryEncoderLoader> RotaryLoader = nullptr;
-  std::shared_ptr<std::map<unsigned int, TransformContainer>> m_all_transforms =
-      nullptr;
+  std::shared_ptr<TransformTable> m_all_transforms = nullptr;
+  std::shared_ptr<const OpticalFlowFields> m_optical_flow = nullptr;
+  // last so it's destroyed (finishing its tasks) before anything they use
+  std::unique_ptr<WorkerPool> m_async_workers = nullptr;
 };
 }; // namespace twophoton
 #endif // namespace twophoton
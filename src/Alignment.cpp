@@ -0,0 +1,360 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace twophoton {
+
+SampleBracket bracketTimes(std::span<const double> sample_times,
+                           std::span<const double> at) {
+  SampleBracket bracket;
+  const std::size_t n = at.size();
+  const std::size_t ns = sample_times.size();
+  bracket.index.assign(n, 0);
+  bracket.weight.assign(n, 0.0);
+  if (ns == 0)
+    return bracket;
+  // start from the sample at or before the first time so a sweep over part
+  // of a grid doesn't have to walk the samples before it
+  std::size_t j = 0;
+  if (n > 0) {
+    auto it = std::upper_bound(sample_times.begin(), sample_times.end(), at[0]);
+    j = it == sample_times.begin() ? 0 : (it - sample_times.begin()) - 1;
+  }
+  for (std::size_t i = 0; i < n; ++i) {
+    const double t = at[i];
+    if (t < sample_times[j] && j > 0) {
+      // at isn't sorted here so start again from a binary search
+      auto it = std::upper_bound(sample_times.begin(), sample_times.end(), t);
+      j = it == sample_times.begin() ? 0 : (it - sample_times.begin()) - 1;
+    }
+    while (j + 1 < ns && sample_times[j + 1] <= t)
+      ++j;
+    bracket.index[i] = j;
+    if (t > sample_times[j] && j + 1 < ns)
+      bracket.weight[i] =
+          (t - sample_times[j]) / (sample_times[j + 1] - sample_times[j]);
+  }
+  return bracket;
+}
+
+std::vector<double> interpolateLinear(std::span<const double> values,
+                                      const SampleBracket &bracket) {
+  const std::size_t n = bracket.size();
+  std::vector<double> result(n, 0.0);
+  if (values.empty())
+    return result;
+  const std::size_t last = values.size() - 1;
+  const std::size_t *index = bracket.index.data();
+  const double *weight = bracket.weight.data();
+  for (std::size_t i = 0; i < n; ++i) {
+    const double a = values[index[i]];
+    const double b = values[std::min(index[i] + 1, last)];
+    result[i] = a + weight[i] * (b - a);
+  }
+  return result;
+}
+
+std::vector<double> interpolateAngle(std::span<const double> values,
+                                     const SampleBracket &bracket) {
+  const std::size_t n = bracket.size();
+  std::vector<double> result(n, 0.0);
+  if (values.empty())
+    return result;
+  const std::size_t last = values.size() - 1;
+  const std::size_t *index = bracket.index.data();
+  const double *weight = bracket.weight.data();
+  for (std::size_t i = 0; i < n; ++i) {
+    const double a = values[index[i]];
+    const double b = values[std::min(index[i] + 1, last)];
+    // the signed difference the short way round, in [-PI, PI]
+    const double d = std::remainder(b - a, 2 * M_PI);
+    double v = a + weight[i] * d;
+    if (a >= 0 && a < 2 * M_PI && (v < 0 || v >= 2 * M_PI)) {
+      v = std::fmod(v, 2 * M_PI);
+      if (v < 0)
+        v += 2 * M_PI;
+    }
+    result[i] = v;
+  }
+  return result;
+}
+
+std::vector<double> secondsSince(std::span<const ptime> times, ptime origin) {
+  std::vector<double> seconds(times.size());
+  std::transform(times.begin(), times.end(), seconds.begin(),
+                 [origin](const ptime &t) {
+                   return std::chrono::duration<double>(t - origin).count();
+                 });
+  return seconds;
+}
+
+std::vector<double> unwrapAngles(std::span<const double> radians) {
+  std::vector<double> unwrapped(radians.size());
+  if (radians.empty())
+    return unwrapped;
+  unwrapped[0] = radians[0];
+  for (std::size_t i = 1; i < radians.size(); ++i)
+    unwrapped[i] =
+        unwrapped[i - 1] + std::remainder(radians[i] - radians[i - 1], 2 * M_PI);
+  return unwrapped;
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  Resampler  ++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+Resampler::Resampler(std::span<const double> sample_times,
+                     std::span<const double> grid, ResampleMode mode,
+                     unsigned int nthreads)
+    : m_mode(mode), m_nthreads(nthreads), m_nsamples(sample_times.size()) {
+  if (m_nthreads == 0)
+    m_nthreads = std::max(1u, std::thread::hardware_concurrency());
+  const std::size_t n = grid.size();
+  const std::size_t ns = sample_times.size();
+  m_bracket.index.resize(n);
+  m_bracket.weight.resize(n);
+  if (mode == ResampleMode::kBoxcar) {
+    m_begin.resize(n);
+    m_end.resize(n);
+  }
+  // the edges of the bin around grid time i
+  auto binStart = [&](std::size_t i) {
+    if (i > 0)
+      return (grid[i - 1] + grid[i]) / 2;
+    return n > 1 ? grid[0] - (grid[1] - grid[0]) / 2 : grid[0];
+  };
+  auto binEnd = [&](std::size_t i) {
+    if (i + 1 < n)
+      return (grid[i] + grid[i + 1]) / 2;
+    return n > 1 ? grid[i] + (grid[i] - grid[i - 1]) / 2 : grid[i];
+  };
+  parallelFor(
+      n,
+      [&](unsigned int, std::size_t begin, std::size_t end) {
+        auto part = bracketTimes(sample_times, grid.subspan(begin, end - begin));
+        std::copy(part.index.begin(), part.index.end(),
+                  m_bracket.index.begin() + begin);
+        std::copy(part.weight.begin(), part.weight.end(),
+                  m_bracket.weight.begin() + begin);
+        if (m_mode != ResampleMode::kBoxcar)
+          return;
+        // the samples in each bin, with the same sort of sweep
+        std::size_t lo = std::lower_bound(sample_times.begin(),
+                                          sample_times.end(), binStart(begin)) -
+                         sample_times.begin();
+        std::size_t hi = lo;
+        for (std::size_t i = begin; i < end; ++i) {
+          const double start = binStart(i);
+          const double stop = binEnd(i);
+          while (lo < ns && sample_times[lo] < start)
+            ++lo;
+          hi = std::max(hi, lo);
+          while (hi < ns && sample_times[hi] < stop)
+            ++hi;
+          m_begin[i] = lo;
+          m_end[i] = hi;
+        }
+      },
+      threadsFor(n));
+}
+
+unsigned int Resampler::threadsFor(std::size_t n) const {
+  // not worth starting threads for small grids
+  constexpr std::size_t min_per_thread = 16384;
+  return static_cast<unsigned int>(std::clamp<std::size_t>(
+      n / min_per_thread, 1, m_nthreads));
+}
+
+std::vector<double> Resampler::operator()(std::span<const double> values) const {
+  if (values.size() != m_nsamples) {
+    throw std::invalid_argument(
+        "The number of values doesn't match the number of sample times");
+  }
+  const std::size_t n = size();
+  std::vector<double> result(n, 0.0);
+  if (values.empty())
+    return result;
+  const std::size_t last = values.size() - 1;
+  std::vector<double> prefix;
+  if (m_mode == ResampleMode::kBoxcar) {
+    prefix.resize(values.size() + 1, 0.0);
+    for (std::size_t i = 0; i < values.size(); ++i)
+      prefix[i + 1] = prefix[i] + values[i];
+  }
+  parallelFor(
+      n,
+      [&](unsigned int, std::size_t begin, std::size_t end) {
+        const std::size_t *index = m_bracket.index.data();
+        const double *weight = m_bracket.weight.data();
+        for (std::size_t i = begin; i < end; ++i) {
+          const std::size_t j = index[i];
+          const std::size_t k = std::min(j + 1, last);
+          switch (m_mode) {
+          case ResampleMode::kNearest:
+            result[i] = weight[i] > 0.5 ? values[k] : values[j];
+            break;
+          case ResampleMode::kBoxcar:
+            if (m_end[i] > m_begin[i]) {
+              result[i] = (prefix[m_end[i]] - prefix[m_begin[i]]) /
+                          (m_end[i] - m_begin[i]);
+              break;
+            }
+            [[fallthrough]];
+          case ResampleMode::kLinear:
+            result[i] = values[j] + weight[i] * (values[k] - values[j]);
+            break;
+          }
+        }
+      },
+      threadsFor(n));
+  return result;
+}
+
+// Hands a vector over to numpy without copying it
+static py::array_t<double> toNumpy(std::vector<double> &&values) {
+  auto owner = new std::vector<double>(std::move(values));
+  py::capsule base(owner, [](void *p) {
+    delete static_cast<std::vector<double> *>(p);
+  });
+  return py::array_t<double>(owner->size(), owner->data(), base);
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+std::shared_ptr<const FrameIndex> SITiffIO::getFrameIndex() {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  // callers arriving while the index is being extended wait for it rather
+  // than reading the same headers again
+  std::lock_guard<std::mutex> lock(m_index_mutex);
+  const std::size_t n_frames = countDirectories();
+  const std::size_t done = m_frame_index ? m_frame_index->size() : 0;
+  if (m_frame_index && n_frames <= done)
+    return m_frame_index;
+  // only the frames not already in the index are read
+  const std::size_t n_new = n_frames - done;
+  FrameIndex extra;
+  extra.frame_numbers.resize(n_new);
+  extra.timestamps.resize(n_new);
+  const unsigned int nthreads =
+      std::min<std::size_t>(getNThreads(), n_new);
+  auto readers = openReaders(nthreads);
+  parallelFor(
+      n_new,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        for (std::size_t i = begin; i < end; ++i)
+          reader.getFrameNumAndTimeStamp((done + i) * m_nchans,
+                                         extra.frame_numbers[i],
+                                         extra.timestamps[i]);
+      },
+      nthreads);
+  // a new index rather than appending to the old one which callers may
+  // still be reading
+  auto index = m_frame_index ? std::make_shared<FrameIndex>(*m_frame_index)
+                             : std::make_shared<FrameIndex>();
+  index->frame_numbers.insert(index->frame_numbers.end(),
+                              extra.frame_numbers.begin(),
+                              extra.frame_numbers.end());
+  index->timestamps.insert(index->timestamps.end(), extra.timestamps.begin(),
+                           extra.timestamps.end());
+  m_frame_index = std::move(index);
+  return m_frame_index;
+}
+
+double SITiffIO::getLinePeriod() {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  if (m_line_period > 0)
+    return m_line_period;
+  double line_period = TiffReader->getLinePeriod();
+  if (line_period <= 0) {
+    auto index = getFrameIndex();
+    const auto &times = index->timestamps;
+    if (times.size() > 1) {
+      std::vector<double> intervals(times.size() - 1);
+      for (std::size_t i = 1; i < times.size(); ++i)
+        intervals[i - 1] = times[i] - times[i - 1];
+      auto middle = intervals.begin() + intervals.size() / 2;
+      std::nth_element(intervals.begin(), middle, intervals.end());
+      auto [h, w] = getImageSize();
+      if (h > 0)
+        line_period = std::max(0.0, *middle) / h;
+    }
+  }
+  m_line_period = line_period;
+  return line_period;
+}
+
+std::vector<double> SITiffIO::getLineTimes(unsigned int frame) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  auto frame_index = getFrameIndex();
+  const auto &index = *frame_index;
+  if (frame < 1 || frame > index.size()) {
+    throw std::invalid_argument("Invalid frame");
+  }
+  const double line_period = getLinePeriod();
+  auto [h, w] = getImageSize();
+  std::vector<double> times(h);
+  const double start = index.timestamps[frame - 1];
+  for (unsigned int r = 0; r < h; ++r)
+    times[r] = start + (r + 0.5) * line_period;
+  return times;
+}
+
+ResampledBehaviour SITiffIO::resampleBehaviour(std::span<const double> times,
+                                               ResampleMode mode) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  if (LogLoader == nullptr && RotaryLoader == nullptr) {
+    throw std::invalid_argument("No log or rotary encoder file loaded");
+  }
+  const auto start = getEpochTime();
+  ResampledBehaviour result;
+  if (LogLoader) {
+    Resampler resampler(secondsSince(LogLoader->getPTimes(), start), times,
+                        mode, getNThreads());
+    result.x = resampler(LogLoader->getX());
+    result.z = resampler(LogLoader->getZ());
+    result.raw_x = resampler(LogLoader->getRawX());
+    result.raw_z = resampler(LogLoader->getRawZ());
+    if (RotaryLoader == nullptr)
+      result.theta = resampler(unwrapAngles(LogLoader->getTheta()));
+  }
+  if (RotaryLoader) {
+    Resampler resampler(secondsSince(RotaryLoader->getPTimes(), start), times,
+                        mode, getNThreads());
+    result.theta = resampler(unwrapAngles(RotaryLoader->getTheta()));
+  }
+  return result;
+}
+
+py::dict SITiffIO::resample(
+    py::array_t<double, py::array::c_style | py::array::forcecast> times,
+    ResampleMode mode) {
+  const std::span<const double> grid(times.data(), times.size());
+  ResampledBehaviour result;
+  {
+    py::gil_scoped_release release;
+    result = resampleBehaviour(grid, mode);
+  }
+  py::dict data;
+  if (LogLoader) {
+    data["x"] = toNumpy(std::move(result.x));
+    data["z"] = toNumpy(std::move(result.z));
+    data["raw_x"] = toNumpy(std::move(result.raw_x));
+    data["raw_z"] = toNumpy(std::move(result.raw_z));
+  }
+  data["theta"] = toNumpy(std::move(result.theta));
+  return data;
+}
+
+} // namespace twophoton
@@ -0,0 +1,354 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+namespace twophoton {
+
+std::tuple<arma::Mat<float>, arma::Mat<int16_t>>
+SITiffIO::project(unsigned int channel, unsigned int first,
+                  unsigned int last) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const std::size_t n = std::size_t(h) * w;
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int nthreads = std::min(getNThreads(), n_frames);
+  auto readers = openReaders(nthreads);
+  // each thread accumulates its own block of frames; these are then summed
+  std::vector<std::vector<double>> sums(nthreads);
+  std::vector<std::vector<int16_t>> maxs(nthreads);
+  std::vector<unsigned int> counts(nthreads, 0);
+  parallelFor(
+      n_frames,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        auto &sum = sums[t];
+        auto &mx = maxs[t];
+        sum.assign(n, 0.0);
+        mx.assign(n, std::numeric_limits<int16_t>::min());
+        for (std::size_t i = begin; i < end; ++i) {
+          const unsigned int frame = first + i;
+          auto F = reader.readframe((frame - 1) * m_nchans + channel - 1);
+          if (F.n_elem != n)
+            break;
+          const int16_t *p = F.memptr();
+          for (std::size_t j = 0; j < n; ++j) {
+            sum[j] += p[j];
+            mx[j] = std::max(mx[j], p[j]);
+          }
+          ++counts[t];
+        }
+      },
+      nthreads);
+
+  std::vector<double> total_sum(n, 0.0);
+  arma::Mat<int16_t> max(h, w);
+  std::fill(max.memptr(), max.memptr() + n,
+            std::numeric_limits<int16_t>::min());
+  unsigned int total = 0;
+  for (unsigned int t = 0; t < nthreads; ++t) {
+    if (sums[t].empty())
+      continue;
+    total += counts[t];
+    int16_t *mx = max.memptr();
+    for (std::size_t j = 0; j < n; ++j) {
+      total_sum[j] += sums[t][j];
+      mx[j] = std::max(mx[j], maxs[t][j]);
+    }
+  }
+  arma::Mat<float> mean(h, w, arma::fill::zeros);
+  if (total > 0) {
+    float *m = mean.memptr();
+    for (std::size_t j = 0; j < n; ++j)
+      m[j] = static_cast<float>(total_sum[j] / total);
+  }
+  return std::make_tuple(mean, max);
+}
+
+// Hands an image to numpy without copying it. Its buffer is row-major
+// (see SITiffReader::readframe) so it is a C-order (height, width) array
+template <typename T> static py::array_t<T> imageToNumpy(arma::Mat<T> &&img) {
+  const std::vector<py::ssize_t> shape{py::ssize_t(img.n_rows),
+                                       py::ssize_t(img.n_cols)};
+  auto owner = new arma::Mat<T>(std::move(img));
+  py::capsule base(owner,
+                   [](void *p) { delete static_cast<arma::Mat<T> *>(p); });
+  return py::array_t<T>(shape, owner->memptr(), base);
+}
+
+std::tuple<py::array_t<float>, py::array_t<int16_t>>
+SITiffIO::getProjection(unsigned int channel, unsigned int first,
+                        unsigned int last) {
+  arma::Mat<float> mean;
+  arma::Mat<int16_t> max;
+  {
+    py::gil_scoped_release release;
+    std::tie(mean, max) = project(channel, first, last);
+  }
+  return std::make_tuple(imageToNumpy(std::move(mean)),
+                         imageToNumpy(std::move(max)));
+}
+
+void RoiMasks::check(std::size_t n_pixels) const {
+  if (indptr.empty() || indptr.front() != 0) {
+    throw std::invalid_argument("indptr has to start with 0");
+  }
+  if (!std::is_sorted(indptr.begin(), indptr.end())) {
+    throw std::invalid_argument("indptr has to be non-decreasing");
+  }
+  if (indptr.back() != indices.size() || indices.size() != weights.size()) {
+    throw std::invalid_argument(
+        "indptr has to end at the number of indices and weights");
+  }
+  for (const auto i : indices) {
+    if (i >= n_pixels) {
+      throw std::invalid_argument("A mask has a pixel outside the frame");
+    }
+  }
+}
+
+void RoiMasks::sort() {
+  std::vector<std::size_t> order;
+  std::vector<uint32_t> idx;
+  std::vector<float> w;
+  for (std::size_t r = 0; r < size(); ++r) {
+    const std::size_t begin = indptr[r], end = indptr[r + 1];
+    if (std::is_sorted(indices.begin() + begin, indices.begin() + end))
+      continue;
+    order.resize(end - begin);
+    std::iota(order.begin(), order.end(), begin);
+    std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+      return indices[a] < indices[b];
+    });
+    idx.resize(order.size());
+    w.resize(order.size());
+    for (std::size_t k = 0; k < order.size(); ++k) {
+      idx[k] = indices[order[k]];
+      w[k] = weights[order[k]];
+    }
+    std::copy(idx.begin(), idx.end(), indices.begin() + begin);
+    std::copy(w.begin(), w.end(), weights.begin() + begin);
+  }
+}
+
+arma::Mat<float> SITiffIO::extractTraces(RoiMasks masks, unsigned int channel,
+                                         unsigned int first,
+                                         unsigned int last) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const std::size_t n = std::size_t(h) * w;
+  masks.check(n);
+  masks.sort();
+  const std::size_t n_rois = masks.size();
+  // dividing by the total weight is folded into the weights
+  for (std::size_t r = 0; r < n_rois; ++r) {
+    const auto begin = masks.weights.begin() + masks.indptr[r];
+    const auto end = masks.weights.begin() + masks.indptr[r + 1];
+    const double total = std::accumulate(begin, end, 0.0);
+    if (total != 0)
+      std::for_each(begin, end, [total](float &v) { v = float(v / total); });
+  }
+
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int nthreads = std::min(getNThreads(), n_frames);
+  auto readers = openReaders(nthreads);
+  // column-major so each frame's traces are one contiguous column
+  arma::Mat<float> traces(n_rois, n_frames, arma::fill::zeros);
+  std::vector<uint8_t> read(n_frames, 0);
+  const uint32_t *indptr = masks.indptr.data();
+  const uint32_t *indices = masks.indices.data();
+  const float *weights = masks.weights.data();
+  parallelFor(
+      n_frames,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        for (std::size_t i = begin; i < end; ++i) {
+          auto F = reader.readframe((first + i - 1) * m_nchans + channel - 1);
+          if (F.n_elem != n)
+            break;
+          const int16_t *p = F.memptr();
+          float *out = traces.colptr(i);
+          for (std::size_t r = 0; r < n_rois; ++r) {
+            float sum = 0;
+            for (uint32_t k = indptr[r]; k < indptr[r + 1]; ++k)
+              sum += weights[k] * p[indices[k]];
+            out[r] = sum;
+          }
+          read[i] = 1;
+        }
+      },
+      nthreads);
+  const auto count = std::find(read.begin(), read.end(), 0) - read.begin();
+  if (count < n_frames)
+    traces.resize(n_rois, count);
+  return traces;
+}
+
+py::array_t<float> SITiffIO::getTraces(
+    IndexArray indptr, IndexArray indices,
+    py::array_t<float, py::array::c_style | py::array::forcecast> weights,
+    unsigned int channel, unsigned int first, unsigned int last) {
+  auto toIndex = [](const IndexArray &a, const char *name) {
+    std::vector<uint32_t> out(a.size());
+    const int64_t *p = a.data();
+    for (std::size_t i = 0; i < out.size(); ++i) {
+      if (p[i] < 0 || p[i] > std::numeric_limits<uint32_t>::max()) {
+        throw std::invalid_argument(std::string(name) +
+                                    " has a value out of range");
+      }
+      out[i] = uint32_t(p[i]);
+    }
+    return out;
+  };
+  RoiMasks masks;
+  masks.indptr = toIndex(indptr, "indptr");
+  masks.indices = toIndex(indices, "indices");
+  masks.weights.assign(weights.data(), weights.data() + weights.size());
+  arma::Mat<float> traces;
+  {
+    py::gil_scoped_release release;
+    traces = extractTraces(std::move(masks), channel, first, last);
+  }
+  return carma::mat_to_arr(traces, true);
+}
+
+LocalCorrelation::LocalCorrelation(unsigned int h, unsigned int w,
+                                   unsigned int neighbours)
+    : m_h(h), m_w(w) {
+  if (neighbours == 4)
+    m_directions = {{0, 1}, {1, 0}};
+  else if (neighbours == 8)
+    m_directions = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+  else
+    throw std::invalid_argument("There can be 4 or 8 neighbours");
+  const std::size_t n = std::size_t(h) * w;
+  m_sum.assign(n, 0);
+  m_sum_sq.assign(n, 0);
+  m_cross.assign(m_directions.size(), std::vector<int64_t>(n, 0));
+}
+
+void LocalCorrelation::add(std::span<const int16_t *const> frames,
+                           unsigned int nthreads) {
+  if (frames.empty())
+    return;
+  const std::size_t w = m_w;
+  parallelFor(
+      m_h,
+      [&](unsigned int, std::size_t begin, std::size_t end) {
+        // a row's sums stay in cache while every frame is added to them
+        for (std::size_t y = begin; y < end; ++y) {
+          int64_t *sum = m_sum.data() + y * w;
+          int64_t *sum_sq = m_sum_sq.data() + y * w;
+          for (const int16_t *frame : frames) {
+            const int16_t *row = frame + y * w;
+            for (std::size_t x = 0; x < w; ++x) {
+              sum[x] += row[x];
+              sum_sq[x] += int32_t(row[x]) * row[x];
+            }
+            for (std::size_t d = 0; d < m_directions.size(); ++d) {
+              const auto [dy, dx] = m_directions[d];
+              if (y + dy >= m_h)
+                continue;
+              // the pixels of the row that have a neighbour that way
+              const std::size_t x0 = dx < 0 ? 1 : 0;
+              const std::size_t x1 = dx > 0 ? w - 1 : w;
+              const int16_t *other = frame + (y + dy) * w + dx;
+              int64_t *cross = m_cross[d].data() + y * w;
+              for (std::size_t x = x0; x < x1; ++x)
+                cross[x] += int32_t(row[x]) * other[x];
+            }
+          }
+        }
+      },
+      nthreads);
+  m_count += frames.size();
+}
+
+arma::Mat<float> LocalCorrelation::image() const {
+  arma::Mat<float> img(m_h, m_w, arma::fill::zeros);
+  if (m_count < 2)
+    return img;
+  const double n = double(m_count);
+  // n^2 times the variance of each pixel
+  std::vector<double> var(m_sum.size());
+  for (std::size_t i = 0; i < var.size(); ++i)
+    var[i] = n * double(m_sum_sq[i]) - double(m_sum[i]) * double(m_sum[i]);
+  std::vector<double> total(m_sum.size(), 0.0);
+  std::vector<unsigned int> counts(m_sum.size(), 0);
+  for (std::size_t d = 0; d < m_directions.size(); ++d) {
+    const auto [dy, dx] = m_directions[d];
+    for (std::size_t y = 0; y + dy < m_h; ++y) {
+      for (std::size_t x = dx < 0 ? 1 : 0; x < (dx > 0 ? m_w - 1 : m_w);
+           ++x) {
+        const std::size_t p = y * m_w + x;
+        const std::size_t q = (y + dy) * m_w + x + dx;
+        // both ends of the pair get its correlation
+        ++counts[p];
+        ++counts[q];
+        if (var[p] <= 0 || var[q] <= 0)
+          continue;
+        const double cov = n * double(m_cross[d][p]) -
+                           double(m_sum[p]) * double(m_sum[q]);
+        const double r = cov / std::sqrt(var[p] * var[q]);
+        total[p] += r;
+        total[q] += r;
+      }
+    }
+  }
+  float *out = img.memptr();
+  for (std::size_t i = 0; i < total.size(); ++i)
+    out[i] = counts[i] ? float(total[i] / counts[i]) : 0.0f;
+  return img;
+}
+
+arma::Mat<float> SITiffIO::localCorrelation(unsigned int channel,
+                                            unsigned int first,
+                                            unsigned int last,
+                                            unsigned int neighbours) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  LocalCorrelation accumulator(h, w, neighbours);
+  const unsigned int nthreads = getNThreads();
+  // a batch of frames is read in parallel and then added in row bands
+  std::vector<const int16_t *> frames;
+  readBatches(channel, first, last, false,
+              [&](unsigned int, std::vector<SourceFrame> &batch) {
+                frames.clear();
+                for (const auto &F : batch)
+                  frames.push_back(F.img.memptr());
+                accumulator.add(frames, nthreads);
+              });
+  return accumulator.image();
+}
+
+py::array_t<float> SITiffIO::getLocalCorrelation(unsigned int channel,
+                                                 unsigned int first,
+                                                 unsigned int last,
+                                                 unsigned int neighbours) {
+  arma::Mat<float> img;
+  {
+    py::gil_scoped_release release;
+    img = localCorrelation(channel, first, last, neighbours);
+  }
+  return imageToNumpy(std::move(img));
+}
+
+} // namespace twophoton
@@ -0,0 +1,229 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+namespace twophoton {
+
+// what each exporting thread may hold in memory when chunk_frames is 0
+static constexpr std::size_t chunk_memory = std::size_t(256) << 20; // bytes
+
+// numpy / zarr dtype string for the int16 data scanimage saves
+static std::string int16DType() {
+  return std::endian::native == std::endian::little ? "<i2" : ">i2";
+}
+
+static bool writeFile(const fs::path &path, const void *data,
+                      std::size_t size) {
+  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  ofs.write(static_cast<const char *>(data), size);
+  return ofs.good();
+}
+
+static std::string escapeJSON(const std::string &s) {
+  std::string out;
+  for (auto c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+bool SITiffIO::exportZarr(const std::string &path, unsigned int channel,
+                          unsigned int first, unsigned int last,
+                          unsigned int chunk_frames, unsigned int chunk_height,
+                          unsigned int chunk_width, int compression_level) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+  // 0 means the chunk spans the whole of that dimension, except in time
+  // where every thread holds a time-chunk twice over (the frames and the
+  // chunk being compressed), so there 0 picks as many frames as fit in
+  // chunk_memory per thread
+  const std::size_t frame_bytes = std::size_t(h) * w * sizeof(int16_t);
+  const unsigned int ct =
+      chunk_frames != 0
+          ? chunk_frames
+          : static_cast<unsigned int>(std::clamp<std::size_t>(
+                chunk_memory / (2 * std::max<std::size_t>(frame_bytes, 1)), 1,
+                n_frames));
+  const unsigned int cy = chunk_height == 0 ? h : std::min(chunk_height, h);
+  const unsigned int cx = chunk_width == 0 ? w : std::min(chunk_width, w);
+  compression_level = std::clamp(compression_level, 0, 9);
+
+  fs::path root(path);
+  fs::create_directories(root);
+  std::ostringstream zarray;
+  zarray << "{\n"
+         << "    \"chunks\": [" << ct << ", " << cy << ", " << cx << "],\n"
+         << "    \"compressor\": ";
+  if (compression_level > 0)
+    zarray << "{\"id\": \"zlib\", \"level\": " << compression_level << "}";
+  else
+    zarray << "null";
+  zarray << ",\n"
+         << "    \"dtype\": \"" << int16DType() << "\",\n"
+         << "    \"fill_value\": 0,\n"
+         << "    \"filters\": null,\n"
+         << "    \"order\": \"C\",\n"
+         << "    \"shape\": [" << n_frames << ", " << h << ", " << w << "],\n"
+         << "    \"zarr_format\": 2\n"
+         << "}\n";
+  std::ostringstream zattrs;
+  zattrs << "{\n"
+         << "    \"channel\": " << channel << ",\n"
+         << "    \"first_frame\": " << first << ",\n"
+         << "    \"source\": \"" << escapeJSON(TiffReader->getfilename())
+         << "\"\n"
+         << "}\n";
+  if (!writeFile(root / ".zarray", zarray.str().data(), zarray.str().size()) ||
+      !writeFile(root / ".zattrs", zattrs.str().data(), zattrs.str().size()))
+    return false;
+
+  // each thread converts whole time-chunks so every chunk file is written
+  // by exactly one thread and only one time-chunk per thread is in memory
+  const unsigned int n_time_chunks = (n_frames + ct - 1) / ct;
+  const unsigned int n_y_chunks = (h + cy - 1) / cy;
+  const unsigned int n_x_chunks = (w + cx - 1) / cx;
+  const unsigned int nthreads = getNThreads();
+  auto readers = openReaders(std::min(nthreads, n_time_chunks));
+  std::atomic<bool> ok = true;
+  parallelFor(
+      n_time_chunks,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        const std::size_t frame_size = std::size_t(h) * w;
+        std::vector<int16_t> frames(std::size_t(ct) * frame_size);
+        std::vector<int16_t> chunk(std::size_t(ct) * cy * cx);
+        std::vector<Bytef> compressed;
+        for (std::size_t tc = begin; tc < end && ok; ++tc) {
+          // the edge chunks are stored full size, padded with fill_value
+          std::fill(frames.begin(), frames.end(), 0);
+          for (unsigned int i = 0; i < ct; ++i) {
+            const unsigned int frame = first + tc * ct + i;
+            if (frame > last)
+              break;
+            auto F = reader.readframe((frame - 1) * m_nchans + channel - 1);
+            if (F.n_elem != frame_size) {
+              ok = false;
+              return;
+            }
+            std::memcpy(frames.data() + i * frame_size, F.memptr(),
+                        frame_size * sizeof(int16_t));
+          }
+          for (unsigned int yc = 0; yc < n_y_chunks; ++yc) {
+            for (unsigned int xc = 0; xc < n_x_chunks; ++xc) {
+              std::fill(chunk.begin(), chunk.end(), 0);
+              const unsigned int y0 = yc * cy;
+              const unsigned int x0 = xc * cx;
+              const unsigned int ny = std::min(cy, h - y0);
+              const unsigned int nx = std::min(cx, w - x0);
+              for (unsigned int i = 0; i < ct; ++i)
+                for (unsigned int y = 0; y < ny; ++y)
+                  std::memcpy(chunk.data() + (std::size_t(i) * cy + y) * cx,
+                              frames.data() + i * frame_size +
+                                  std::size_t(y0 + y) * w + x0,
+                              nx * sizeof(int16_t));
+              const fs::path chunk_path =
+                  root / (std::to_string(tc) + "." + std::to_string(yc) +
+                          "." + std::to_string(xc));
+              const std::size_t nbytes = chunk.size() * sizeof(int16_t);
+              if (compression_level > 0) {
+                uLongf compressed_size = compressBound(nbytes);
+                compressed.resize(compressed_size);
+                if (compress2(compressed.data(), &compressed_size,
+                              reinterpret_cast<const Bytef *>(chunk.data()),
+                              nbytes, compression_level) != Z_OK ||
+                    !writeFile(chunk_path, compressed.data(),
+                               compressed_size)) {
+                  ok = false;
+                  return;
+                }
+              } else if (!writeFile(chunk_path, chunk.data(), nbytes)) {
+                ok = false;
+                return;
+              }
+            }
+          }
+        }
+      },
+      nthreads);
+  return ok;
+}
+
+bool SITiffIO::exportNpy(const std::string &path, unsigned int channel,
+                         unsigned int first, unsigned int last) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+
+  // version 1.0 of the .npy format; the header is padded so the data
+  // starts on a 64 byte boundary which keeps np.load(mmap_mode="r") happy
+  std::ostringstream dict;
+  dict << "{'descr': '" << int16DType() << "', 'fortran_order': False, "
+       << "'shape': (" << n_frames << ", " << h << ", " << w << "), }";
+  std::string header = dict.str();
+  const std::size_t preamble = 10; // magic, version and header length
+  header.append(64 - (preamble + header.size() + 1) % 64, ' ');
+  header += '\n';
+  const uint16_t header_len = static_cast<uint16_t>(header.size());
+  {
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    ofs.write("\x93NUMPY\x01\x00", 8);
+    const char len[2] = {char(header_len & 0xff), char(header_len >> 8)};
+    ofs.write(len, 2);
+    ofs.write(header.data(), header.size());
+    if (!ofs.good())
+      return false;
+  }
+  const std::size_t frame_bytes = std::size_t(h) * w * sizeof(int16_t);
+  const std::size_t data_offset = preamble + header.size();
+  fs::resize_file(path, data_offset + frame_bytes * n_frames);
+
+  // each thread writes a contiguous run of frames at its own offset
+  const unsigned int nthreads = getNThreads();
+  auto readers = openReaders(std::min(nthreads, n_frames));
+  std::atomic<bool> ok = true;
+  parallelFor(
+      n_frames,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
+        fs.seekp(data_offset + begin * frame_bytes);
+        for (std::size_t i = begin; i < end && ok; ++i) {
+          const unsigned int frame = first + i;
+          auto F = reader.readframe((frame - 1) * m_nchans + channel - 1);
+          if (F.n_elem * sizeof(int16_t) != frame_bytes) {
+            ok = false;
+            return;
+          }
+          fs.write(reinterpret_cast<const char *>(F.memptr()), frame_bytes);
+          if (!fs.good())
+            ok = false;
+        }
+      },
+      nthreads);
+  return ok;
+}
+
+} // namespace twophoton
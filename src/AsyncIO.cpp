@@ -0,0 +1,182 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+
+namespace twophoton {
+
+// enough for a few rigs' worth of requests in flight at once; each request
+// still reads its frames with all of getNThreads()
+static constexpr unsigned int n_async_workers = 4;
+
+// A Python object that can be copied and destroyed on threads that don't
+// hold the GIL; it is released with the GIL held
+using PyRef = std::shared_ptr<py::object>;
+
+static PyRef hold(py::object obj) {
+  return PyRef(new py::object(std::move(obj)), [](py::object *p) {
+    py::gil_scoped_acquire gil;
+    delete p;
+  });
+}
+
+// The Python exception matching the C++ one in error (as pybind11 would
+// translate it if it was thrown from a bound function)
+static py::object toPyException(std::exception_ptr error) {
+  auto raise = [](PyObject *type, const char *what) {
+    return py::reinterpret_borrow<py::object>(type)(what);
+  };
+  try {
+    std::rethrow_exception(error);
+  } catch (const py::error_already_set &e) {
+    return e.value();
+  } catch (const py::index_error &e) {
+    return raise(PyExc_IndexError, e.what());
+  } catch (const std::out_of_range &e) {
+    return raise(PyExc_IndexError, e.what());
+  } catch (const std::invalid_argument &e) {
+    return raise(PyExc_ValueError, e.what());
+  } catch (const std::exception &e) {
+    return raise(PyExc_RuntimeError, e.what());
+  } catch (...) {
+    return raise(PyExc_RuntimeError, "Unknown error");
+  }
+}
+
+/*
+Runs work() on pool and returns a future of the running event loop that is
+completed with convert(result) - or the exception either threw - by a
+callback scheduled on the loop. work runs without the GIL and must not
+touch Python objects; convert runs with it
+*/
+template <typename Work, typename Convert>
+static py::object runAsync(WorkerPool &pool, Work work, Convert convert) {
+  auto loop = hold(py::module_::import("asyncio").attr("get_running_loop")());
+  auto future = hold(loop->attr("create_future")());
+  pool.submit([loop, future, work = std::move(work),
+               convert = std::move(convert)]() {
+    using Result = decltype(work());
+    std::optional<Result> result;
+    std::exception_ptr error = nullptr;
+    try {
+      result.emplace(work());
+    } catch (...) {
+      error = std::current_exception();
+    }
+    py::gil_scoped_acquire gil;
+    py::object value = py::none();
+    py::object exception = py::none();
+    try {
+      if (error)
+        std::rethrow_exception(error);
+      value = convert(std::move(*result));
+    } catch (...) {
+      exception = toPyException(std::current_exception());
+    }
+    auto complete = [future, value, exception]() {
+      // it may have been cancelled while the work was being done
+      if (future->attr("done")().cast<bool>())
+        return;
+      if (exception.is_none())
+        future->attr("set_result")(value);
+      else
+        future->attr("set_exception")(exception);
+    };
+    try {
+      loop->attr("call_soon_threadsafe")(py::cpp_function(complete));
+    } catch (const py::error_already_set &) {
+      // the loop was closed while the work was being done
+    }
+  });
+  return *future;
+}
+
+// Hands a block of frames over to numpy without copying it
+static py::array_t<int16_t> toNumpy(std::vector<int16_t> &&data,
+                                    std::vector<py::ssize_t> shape) {
+  auto owner = new std::vector<int16_t>(std::move(data));
+  py::capsule base(owner, [](void *p) {
+    delete static_cast<std::vector<int16_t> *>(p);
+  });
+  return py::array_t<int16_t>(shape, owner->data(), base);
+}
+
+namespace {
+struct FrameBlock {
+  std::vector<int16_t> data;
+  std::vector<py::ssize_t> shape;
+  std::vector<double> angles;
+};
+} // namespace
+
+// reads frames (0-indexed) of array into one (frames, height, width) block
+static FrameBlock readBlock(const SITiffArray &array,
+                            const std::vector<std::size_t> &frames) {
+  FrameBlock block;
+  block.shape = {py::ssize_t(frames.size()), py::ssize_t(array.height()),
+                 py::ssize_t(array.width())};
+  block.data.resize(frames.size() * array.height() * array.width());
+  array.read(frames, 0, array.height(), block.data.data());
+  return block;
+}
+
+WorkerPool &SITiffIO::asyncWorkers() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_async_workers == nullptr)
+    m_async_workers = std::make_unique<WorkerPool>(n_async_workers);
+  return *m_async_workers;
+}
+
+py::object SITiffIO::readFramesAsync(std::vector<unsigned int> frames,
+                                     unsigned int channel) {
+  auto work = [this, frames = std::move(frames), channel]() {
+    auto array = asArray(channel);
+    std::vector<std::size_t> positions(frames.size());
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+      if (frames[i] < 1 || frames[i] > array.nFrames()) {
+        throw std::invalid_argument("Invalid frame");
+      }
+      positions[i] = frames[i] - 1;
+    }
+    return readBlock(array, positions);
+  };
+  auto convert = [](FrameBlock &&block) -> py::object {
+    return toNumpy(std::move(block.data), std::move(block.shape));
+  };
+  return runAsync(asyncWorkers(), std::move(work), convert);
+}
+
+py::object SITiffIO::tailAsync(unsigned int n) {
+  auto work = [this, n]() {
+    auto array = asArray(0);
+    const std::size_t n_frames = array.nFrames();
+    if (n < 1 || n > n_frames) {
+      throw std::invalid_argument(
+          "n must be between 1 and the number of frames");
+    }
+    std::vector<std::size_t> frames(n);
+    std::iota(frames.begin(), frames.end(), n_frames - n);
+    auto block = readBlock(array, frames);
+    interpolateIndices((n_frames - n) * m_nchans);
+    block.angles = getTheta();
+    return block;
+  };
+  auto convert = [](FrameBlock &&block) -> py::object {
+    py::list angles;
+    for (auto angle : block.angles)
+      angles.append(angle);
+    return py::make_tuple(
+        toNumpy(std::move(block.data), std::move(block.shape)), angles);
+  };
+  return runAsync(asyncWorkers(), std::move(work), convert);
+}
+
+py::object SITiffIO::countDirectoriesAsync() {
+  auto work = [this]() { return countDirectories(); };
+  auto convert = [](unsigned int n) -> py::object { return py::int_(n); };
+  return runAsync(asyncWorkers(), std::move(work), convert);
+}
+
+} // namespace twophoton
@@ -0,0 +1,338 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace twophoton {
+
+static inline int16_t saturateToInt16(float v) {
+  return static_cast<int16_t>(std::clamp(std::round(v), -32768.0f, 32767.0f));
+}
+
+// Catmull-Rom weights for the four taps of the bicubic kernel
+static inline void cubicWeights(float t, float w[4]) {
+  const float t2 = t * t;
+  const float t3 = t2 * t;
+  w[0] = 0.5f * (-t3 + 2.0f * t2 - t);
+  w[1] = 0.5f * (3.0f * t3 - 5.0f * t2 + 2.0f);
+  w[2] = 0.5f * (-3.0f * t3 + 4.0f * t2 + t);
+  w[3] = 0.5f * (t3 - t2);
+}
+
+Derotator::Derotator(unsigned int h, unsigned int w, InterpolationType interp,
+                     double angle_step, std::size_t max_maps)
+    : m_h(h), m_w(w), m_padded_w(w + 2 * border), m_padded_h(h + 2 * border),
+      m_interp(interp), m_angle_step(angle_step), m_max_maps(max_maps) {
+  if (m_angle_step <= 0)
+    m_angle_step = deg2rad(0.1);
+  m_n_steps = std::max(1l, std::lround(2 * M_PI / m_angle_step));
+  if (m_max_maps == 0)
+    m_max_maps = 1;
+}
+
+void Derotator::mapPoint(double xs, double ys, int32_t &index, float &fx,
+                         float &fy) const {
+  if (xs <= -1 || ys <= -1 || xs >= m_w || ys >= m_h) {
+    // the top-left of the border so every tap of the kernel reads a zero
+    index = m_padded_w + 1;
+    fx = 0;
+    fy = 0;
+    return;
+  }
+  if (m_interp == InterpolationType::kNearest) {
+    const long xi = std::clamp(std::lround(xs), 0l, long(m_w) - 1);
+    const long yi = std::clamp(std::lround(ys), 0l, long(m_h) - 1);
+    index = (yi + border) * m_padded_w + xi + border;
+    fx = 0;
+    fy = 0;
+  } else {
+    const double x0 = std::floor(xs);
+    const double y0 = std::floor(ys);
+    index = (int32_t(y0) + border) * m_padded_w + int32_t(x0) + border;
+    fx = float(xs - x0);
+    fy = float(ys - y0);
+  }
+}
+
+std::shared_ptr<const RotationMap> Derotator::buildMap(double angle) const {
+  auto map = std::make_shared<RotationMap>();
+  const std::size_t n = std::size_t(m_h) * m_w;
+  map->index.resize(n);
+  map->fx.resize(n);
+  map->fy.resize(n);
+  const double c = std::cos(angle);
+  const double s = std::sin(angle);
+  const double cx = (m_w - 1) / 2.0;
+  const double cy = (m_h - 1) / 2.0;
+  std::size_t i = 0;
+  for (unsigned int y = 0; y < m_h; ++y) {
+    const double dy = y - cy;
+    for (unsigned int x = 0; x < m_w; ++x, ++i) {
+      const double dx = x - cx;
+      mapPoint(cx + c * dx - s * dy, cy + s * dx + c * dy, map->index[i],
+               map->fx[i], map->fy[i]);
+    }
+  }
+  return map;
+}
+
+std::shared_ptr<const RotationMap> Derotator::getMap(double angle) {
+  angle = std::fmod(angle, 2 * M_PI);
+  if (angle < 0)
+    angle += 2 * M_PI;
+  const long key = std::lround(angle / m_angle_step) % m_n_steps;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto search = m_maps.find(key);
+    if (search != m_maps.end()) {
+      m_lru.splice(m_lru.begin(), m_lru, search->second.second);
+      return search->second.first;
+    }
+  }
+  // build outside the lock so other threads can carry on with cached maps
+  auto map = buildMap(key * m_angle_step);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto search = m_maps.find(key);
+  if (search != m_maps.end())
+    return search->second.first;
+  m_lru.push_front(key);
+  m_maps.emplace(key, std::make_pair(map, m_lru.begin()));
+  while (m_maps.size() > m_max_maps) {
+    m_maps.erase(m_lru.back());
+    m_lru.pop_back();
+  }
+  return map;
+}
+
+void Derotator::pad(const int16_t *src, std::vector<float> &padded) const {
+  padded.assign(std::size_t(m_padded_w) * m_padded_h, 0.0f);
+  for (unsigned int y = 0; y < m_h; ++y) {
+    const int16_t *row = src + std::size_t(y) * m_w;
+    float *prow = padded.data() + std::size_t(y + border) * m_padded_w + border;
+    for (unsigned int x = 0; x < m_w; ++x)
+      prow[x] = row[x];
+  }
+}
+
+void Derotator::sample(const float *p, const int32_t *index, const float *fx,
+                       const float *fy, std::size_t n, int16_t *dst) const {
+  const std::size_t pw = m_padded_w;
+  // each loop is a gather followed by straight-line arithmetic on
+  // contiguous arrays so the compiler can vectorise them
+  switch (m_interp) {
+  case InterpolationType::kNearest:
+    for (std::size_t i = 0; i < n; ++i)
+      dst[i] = static_cast<int16_t>(p[index[i]]);
+    break;
+  case InterpolationType::kBilinear:
+    for (std::size_t i = 0; i < n; ++i) {
+      const float *q = p + index[i];
+      const float top = q[0] + fx[i] * (q[1] - q[0]);
+      const float bottom = q[pw] + fx[i] * (q[pw + 1] - q[pw]);
+      dst[i] = saturateToInt16(top + fy[i] * (bottom - top));
+    }
+    break;
+  case InterpolationType::kBicubic:
+    for (std::size_t i = 0; i < n; ++i) {
+      float wx[4], wy[4];
+      cubicWeights(fx[i], wx);
+      cubicWeights(fy[i], wy);
+      const float *q = p + index[i] - pw - 1;
+      float v = 0;
+      for (int r = 0; r < 4; ++r, q += pw)
+        v += wy[r] * (wx[0] * q[0] + wx[1] * q[1] + wx[2] * q[2] +
+                      wx[3] * q[3]);
+      dst[i] = saturateToInt16(v);
+    }
+    break;
+  }
+}
+
+void Derotator::derotate(const int16_t *src, int16_t *dst, double angle) {
+  auto map = getMap(angle);
+  // one scratch buffer per thread rather than one per call
+  thread_local std::vector<float> padded;
+  pad(src, padded);
+  sample(padded.data(), map->index.data(), map->fx.data(), map->fy.data(),
+         std::size_t(m_h) * m_w, dst);
+}
+
+void Derotator::derotate(const int16_t *src, int16_t *dst,
+                         std::span<const double> row_angles) {
+  if (row_angles.size() != m_h) {
+    throw std::invalid_argument("Expected one angle per row of the frame");
+  }
+  // a frame acquired while the bearing was (near enough) still is done
+  // with a single cached map
+  double lo = 0, hi = 0;
+  for (const double a : row_angles) {
+    const double d = std::remainder(a - row_angles[0], 2 * M_PI);
+    lo = std::min(lo, d);
+    hi = std::max(hi, d);
+  }
+  if (hi - lo < m_angle_step) {
+    derotate(src, dst, row_angles[0] + (lo + hi) / 2);
+    return;
+  }
+  thread_local std::vector<float> padded;
+  pad(src, padded);
+  // the per-row coordinate tables: the rotation of each row of the source
+  thread_local std::vector<float> row_cos, row_sin;
+  row_cos.resize(m_h);
+  row_sin.resize(m_h);
+  for (unsigned int r = 0; r < m_h; ++r) {
+    row_cos[r] = static_cast<float>(std::cos(row_angles[r]));
+    row_sin[r] = static_cast<float>(std::sin(row_angles[r]));
+  }
+  // the kernel positions for one row of the output
+  thread_local RotationMap row;
+  row.index.resize(m_w);
+  row.fx.resize(m_w);
+  row.fy.resize(m_w);
+  int32_t *index = row.index.data();
+  float *fx = row.fx.data();
+  float *fy = row.fy.data();
+  const float cx = (m_w - 1) / 2.0f;
+  const float cy = (m_h - 1) / 2.0f;
+  const int32_t w = m_w;
+  const int32_t h = m_h;
+  const int32_t pw = m_padded_w;
+  const int32_t outside = pw + 1;
+  // nearest neighbour rounds to the closest pixel, clamped to the frame, and
+  // has no fractional offsets; the other kernels use the pixel to the
+  // top-left of the point which can be in the border
+  const bool nearest = m_interp == InterpolationType::kNearest;
+  const float round = nearest ? 2.5f : 2.0f;
+  const float frac = nearest ? 0.0f : 1.0f;
+  const int32_t lowest = nearest ? 0 : -1;
+  // which source row an output pixel comes from depends on the angle it is
+  // rotated by; the angle of the middle row gives a good enough first guess
+  const float *rc = row_cos.data();
+  const float *rs = row_sin.data();
+  const float c0 = rc[m_h / 2];
+  const float s0 = rs[m_h / 2];
+  for (int32_t y = 0; y < h; ++y) {
+    const float dy = y - cy;
+    const float guess = cy + c0 * dy + 0.5f;
+    for (int32_t x = 0; x < w; ++x) {
+      const float dx = x - cx;
+      const int32_t r =
+          std::min(std::max(static_cast<int32_t>(guess + s0 * dx), 0), h - 1);
+      const float c = rc[r];
+      const float s = rs[r];
+      const float xs = cx + c * dx - s * dy;
+      const float ys = cy + s * dx + c * dy;
+      // shifted by 2 so truncating is a floor over all of the (-1, w) and
+      // (-1, h) ranges a point has to be in to be sampled
+      const int32_t xt = static_cast<int32_t>(xs + 2.0f);
+      const int32_t yt = static_cast<int32_t>(ys + 2.0f);
+      const bool inside =
+          (xt >= 1) & (xt <= w + 1) & (yt >= 1) & (yt <= h + 1);
+      const int32_t x0 = std::min(
+          std::max(static_cast<int32_t>(xs + round) - 2, lowest), w - 1);
+      const int32_t y0 = std::min(
+          std::max(static_cast<int32_t>(ys + round) - 2, lowest), h - 1);
+      index[x] = inside ? (y0 + int32_t(border)) * pw + x0 + border : outside;
+      fx[x] = inside ? (xs - x0) * frac : 0.0f;
+      fy[x] = inside ? (ys - y0) * frac : 0.0f;
+    }
+    sample(padded.data(), index, fx, fy, m_w, dst + std::size_t(y) * m_w);
+  }
+}
+
+arma::Mat<int16_t> Derotator::derotate(const arma::Mat<int16_t> &src,
+                                       double angle) {
+  // frames from SITiffReader::readframe hold the image row-major in memory
+  if (src.n_elem != std::size_t(m_h) * m_w)
+    return arma::Mat<int16_t>();
+  arma::Mat<int16_t> dst(src.n_rows, src.n_cols);
+  derotate(src.memptr(), dst.memptr(), angle);
+  return dst;
+}
+
+arma::Mat<int16_t> Derotator::derotate(const arma::Mat<int16_t> &src,
+                                       std::span<const double> row_angles) {
+  if (src.n_elem != std::size_t(m_h) * m_w)
+    return arma::Mat<int16_t>();
+  arma::Mat<int16_t> dst(src.n_rows, src.n_cols);
+  derotate(src.memptr(), dst.memptr(), row_angles);
+  return dst;
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+bool SITiffIO::derotate(const std::string &fname, unsigned int first,
+                        unsigned int last, InterpolationType interp,
+                        bool per_line) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  auto transforms = getAllTransforms();
+  if (!per_line && transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  if (per_line && LogLoader == nullptr && RotaryLoader == nullptr) {
+    throw std::invalid_argument("No log or rotary encoder file loaded");
+  }
+  checkFrameRange(first, last);
+  // the frames are only derotated to be written out
+  if (fname.empty())
+    return false;
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  // the angle for each frame (0-indexed) of the file
+  std::vector<double> angles(last, 0.0);
+  // or the angles of the bearing and the scanline times to interpolate
+  // them at for each row
+  std::vector<double> sample_times;
+  std::span<const double> theta;
+  std::shared_ptr<const FrameIndex> frame_index;
+  std::span<const double> frame_times;
+  double line_period = 0;
+  if (per_line) {
+    const auto start = getEpochTime();
+    if (RotaryLoader) {
+      sample_times = secondsSince(RotaryLoader->getPTimes(), start);
+      theta = RotaryLoader->getTheta();
+    } else {
+      sample_times = secondsSince(LogLoader->getPTimes(), start);
+      theta = LogLoader->getTheta();
+    }
+    frame_index = getFrameIndex();
+    frame_times = frame_index->timestamps;
+    line_period = getLinePeriod();
+  } else {
+    const auto &table = *transforms;
+    const auto &rotation = table.column(TransformType::kInitialRotation);
+    for (std::size_t row = 0; row < table.size(); ++row) {
+      if (table.frame_indices[row] < last &&
+          table.hasTransform(TransformType::kInitialRotation, row))
+        angles[table.frame_indices[row]] = rotation.values[row];
+    }
+  }
+
+  Derotator derotator(h, w, interp);
+  auto derotate = [&](unsigned int frame, const int16_t *src, int16_t *dst) {
+    if (!per_line) {
+      derotator.derotate(src, dst, angles[frame - 1]);
+      return;
+    }
+    std::vector<double> line_times(h);
+    for (unsigned int r = 0; r < h; ++r)
+      line_times[r] = frame_times[frame - 1] + (r + 0.5) * line_period;
+    auto row_angles =
+        interpolateAngle(theta, bracketTimes(sample_times, line_times));
+    derotator.derotate(src, dst, row_angles);
+  };
+  const unsigned int count =
+      correctFrames(channel2display, first, last, fname, derotate);
+  std::cout << "Written " << count << " derotated frames to " << fname
+            << std::endl;
+  return count > 0;
+}
+
+} // namespace twophoton
@@ -0,0 +1,342 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <tuple>
+
+namespace twophoton {
+
+// the largest update of the flow (pixels of the level) in one iteration so
+// a bad linearisation can't throw it far off
+static constexpr float max_step = 1.0f;
+
+// src (h x w) halved in each direction by averaging 2 x 2 blocks, the last
+// row/column being repeated when h/w is odd
+static void downsample(const float *src, unsigned int h, unsigned int w,
+                       std::vector<float> &dst) {
+  const unsigned int dh = (h + 1) / 2;
+  const unsigned int dw = (w + 1) / 2;
+  dst.resize(std::size_t(dh) * dw);
+  for (unsigned int y = 0; y < dh; ++y) {
+    const float *r0 = src + std::size_t(2 * y) * w;
+    const float *r1 = src + std::size_t(std::min(2 * y + 1, h - 1)) * w;
+    float *out = dst.data() + std::size_t(y) * dw;
+    for (unsigned int x = 0; x < w / 2; ++x)
+      out[x] = 0.25f * (r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1]);
+    if (w % 2)
+      out[dw - 1] = 0.5f * (r0[w - 1] + r1[w - 1]);
+  }
+}
+
+// the sum of in (h x w) over the (2r + 1)^2 square around each pixel,
+// clipped to the image: a running sum along the rows, then whole rows are
+// added and taken away going down
+static void boxSum(const float *in, unsigned int h, unsigned int w,
+                   unsigned int r, std::vector<float> &out,
+                   std::vector<float> &rows) {
+  rows.resize(std::size_t(h) * w);
+  for (unsigned int y = 0; y < h; ++y) {
+    const float *src = in + std::size_t(y) * w;
+    float *dst = rows.data() + std::size_t(y) * w;
+    float sum = 0;
+    for (unsigned int x = 0; x < std::min(r, w); ++x)
+      sum += src[x];
+    for (unsigned int x = 0; x < w; ++x) {
+      if (x + r < w)
+        sum += src[x + r];
+      dst[x] = sum;
+      if (x >= r)
+        sum -= src[x - r];
+    }
+  }
+  out.resize(std::size_t(h) * w);
+  std::vector<float> acc(w, 0.0f);
+  auto add = [&](unsigned int y, float sign) {
+    const float *row = rows.data() + std::size_t(y) * w;
+    for (unsigned int x = 0; x < w; ++x)
+      acc[x] += sign * row[x];
+  };
+  for (unsigned int y = 0; y < std::min(r, h); ++y)
+    add(y, 1.0f);
+  for (unsigned int y = 0; y < h; ++y) {
+    if (y + r < h)
+      add(y + r, 1.0f);
+    std::copy(acc.begin(), acc.end(), out.begin() + std::size_t(y) * w);
+    if (y >= r)
+      add(y - r, -1.0f);
+  }
+}
+
+// central differences inside the image, one-sided at its edges
+static void gradients(const float *img, unsigned int h, unsigned int w,
+                      std::vector<float> &gx, std::vector<float> &gy) {
+  gx.assign(std::size_t(h) * w, 0.0f);
+  gy.assign(std::size_t(h) * w, 0.0f);
+  for (unsigned int y = 0; y < h; ++y) {
+    const float *row = img + std::size_t(y) * w;
+    const float *up = img + std::size_t(y > 0 ? y - 1 : y) * w;
+    const float *down = img + std::size_t(y + 1 < h ? y + 1 : y) * w;
+    const float sy = (y > 0 && y + 1 < h) ? 0.5f : 1.0f;
+    float *ox = gx.data() + std::size_t(y) * w;
+    float *oy = gy.data() + std::size_t(y) * w;
+    for (unsigned int x = 0; x < w; ++x)
+      oy[x] = sy * (down[x] - up[x]);
+    if (w < 2)
+      continue;
+    for (unsigned int x = 1; x + 1 < w; ++x)
+      ox[x] = 0.5f * (row[x + 1] - row[x - 1]);
+    ox[0] = row[1] - row[0];
+    ox[w - 1] = row[w - 1] - row[w - 2];
+  }
+}
+
+OpticalFlow::OpticalFlow(const float *reference, unsigned int h,
+                         unsigned int w, unsigned int levels,
+                         unsigned int window, unsigned int iterations)
+    : m_h(h), m_w(w), m_radius(window / 2), m_iterations(iterations) {
+  if (h == 0 || w == 0) {
+    throw std::invalid_argument("The reference image is empty");
+  }
+  if (levels == 0) {
+    throw std::invalid_argument("There has to be at least one level");
+  }
+  std::vector<float> gxx, gxy, gyy, sxx, sxy, syy, scratch;
+  for (unsigned int l = 0; l < levels; ++l) {
+    Level level;
+    if (l == 0) {
+      level.h = h;
+      level.w = w;
+      level.reference.assign(reference, reference + std::size_t(h) * w);
+    } else {
+      const auto &finer = m_levels.back();
+      // nothing is gained from levels smaller than the window
+      if (finer.h / 2 <= 2 * m_radius || finer.w / 2 <= 2 * m_radius)
+        break;
+      level.h = (finer.h + 1) / 2;
+      level.w = (finer.w + 1) / 2;
+      downsample(finer.reference.data(), finer.h, finer.w, level.reference);
+    }
+    const std::size_t n = std::size_t(level.h) * level.w;
+    gradients(level.reference.data(), level.h, level.w, level.gx, level.gy);
+    gxx.resize(n);
+    gxy.resize(n);
+    gyy.resize(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      gxx[i] = level.gx[i] * level.gx[i];
+      gxy[i] = level.gx[i] * level.gy[i];
+      gyy[i] = level.gy[i] * level.gy[i];
+    }
+    boxSum(gxx.data(), level.h, level.w, m_radius, sxx, scratch);
+    boxSum(gxy.data(), level.h, level.w, m_radius, sxy, scratch);
+    boxSum(gyy.data(), level.h, level.w, m_radius, syy, scratch);
+    level.a.assign(n, 0.0f);
+    level.b.assign(n, 0.0f);
+    level.c.assign(n, 0.0f);
+    for (std::size_t i = 0; i < n; ++i) {
+      const double det = double(sxx[i]) * syy[i] - double(sxy[i]) * sxy[i];
+      const double trace = double(sxx[i]) + syy[i];
+      // flat or edge-only windows (the aperture problem) are left alone
+      if (trace <= 0 || det <= 1e-4 * trace * trace)
+        continue;
+      level.a[i] = float(syy[i] / det);
+      level.b[i] = float(-sxy[i] / det);
+      level.c[i] = float(sxx[i] / det);
+    }
+    m_levels.push_back(std::move(level));
+  }
+}
+
+OpticalFlow::OpticalFlow(const arma::Mat<float> &reference,
+                         unsigned int levels, unsigned int window,
+                         unsigned int iterations)
+    : OpticalFlow(reference.memptr(), reference.n_rows, reference.n_cols,
+                  levels, window, iterations) {}
+
+void OpticalFlow::flow(const int16_t *frame, std::vector<float> &u,
+                       std::vector<float> &v) const {
+  // scratch kept per thread so frames can be done in parallel
+  thread_local std::vector<std::vector<float>> pyramid;
+  thread_local std::vector<float> warped, bx, by, sum_x, sum_y, scratch,
+      coarse_u, coarse_v;
+  const std::size_t n_levels = m_levels.size();
+  pyramid.resize(n_levels);
+  pyramid[0].assign(frame, frame + std::size_t(m_h) * m_w);
+  for (std::size_t l = 1; l < n_levels; ++l)
+    downsample(pyramid[l - 1].data(), m_levels[l - 1].h, m_levels[l - 1].w,
+               pyramid[l]);
+
+  for (std::size_t l = n_levels; l-- > 0;) {
+    const auto &level = m_levels[l];
+    const unsigned int h = level.h;
+    const unsigned int w = level.w;
+    const std::size_t n = std::size_t(h) * w;
+    if (l == n_levels - 1) {
+      u.assign(n, 0.0f);
+      v.assign(n, 0.0f);
+    } else {
+      // twice the flow of the coarser level's pixel
+      const unsigned int cw = m_levels[l + 1].w;
+      coarse_u.swap(u);
+      coarse_v.swap(v);
+      u.resize(n);
+      v.resize(n);
+      for (unsigned int y = 0; y < h; ++y) {
+        const std::size_t crow = std::size_t(y / 2) * cw;
+        for (unsigned int x = 0; x < w; ++x) {
+          u[std::size_t(y) * w + x] = 2 * coarse_u[crow + x / 2];
+          v[std::size_t(y) * w + x] = 2 * coarse_v[crow + x / 2];
+        }
+      }
+    }
+    const float *img = pyramid[l].data();
+    warped.resize(n);
+    bx.resize(n);
+    by.resize(n);
+    for (unsigned int it = 0; it < m_iterations; ++it) {
+      // the frame sampled where the flow says each reference pixel went,
+      // clamped to the edges so they don't look like motion
+      for (unsigned int y = 0; y < h; ++y) {
+        for (unsigned int x = 0; x < w; ++x) {
+          const std::size_t i = std::size_t(y) * w + x;
+          const float sx = std::clamp(x + u[i], 0.0f, float(w - 1));
+          const float sy = std::clamp(y + v[i], 0.0f, float(h - 1));
+          const unsigned int x0 = std::min(unsigned(sx), w - 1);
+          const unsigned int y0 = std::min(unsigned(sy), h - 1);
+          const unsigned int x1 = std::min(x0 + 1, w - 1);
+          const unsigned int y1 = std::min(y0 + 1, h - 1);
+          const float fx = sx - x0;
+          const float fy = sy - y0;
+          const float *r0 = img + std::size_t(y0) * w;
+          const float *r1 = img + std::size_t(y1) * w;
+          const float top = r0[x0] + fx * (r0[x1] - r0[x0]);
+          const float bottom = r1[x0] + fx * (r1[x1] - r1[x0]);
+          warped[i] = top + fy * (bottom - top);
+        }
+      }
+      for (std::size_t i = 0; i < n; ++i) {
+        const float e = warped[i] - level.reference[i];
+        bx[i] = level.gx[i] * e;
+        by[i] = level.gy[i] * e;
+      }
+      boxSum(bx.data(), h, w, m_radius, sum_x, scratch);
+      boxSum(by.data(), h, w, m_radius, sum_y, scratch);
+      for (std::size_t i = 0; i < n; ++i) {
+        const float du = -(level.a[i] * sum_x[i] + level.b[i] * sum_y[i]);
+        const float dv = -(level.b[i] * sum_x[i] + level.c[i] * sum_y[i]);
+        u[i] += std::clamp(du, -max_step, max_step);
+        v[i] += std::clamp(dv, -max_step, max_step);
+      }
+    }
+  }
+}
+
+std::pair<double, double>
+OpticalFlowFields::store(std::size_t k, const std::vector<float> &u,
+                         const std::vector<float> &v, unsigned int h,
+                         unsigned int w) {
+  thread_local std::vector<double> cell_u, cell_v, cell_n;
+  cell_u.assign(std::size_t(rows) * cols, 0.0);
+  cell_v.assign(cell_u.size(), 0.0);
+  cell_n.assign(cell_u.size(), 0.0);
+  for (unsigned int y = 0; y < h; ++y) {
+    const std::size_t row = std::size_t(y / step) * cols;
+    for (unsigned int x = 0; x < w; ++x) {
+      const std::size_t i = std::size_t(y) * w + x;
+      cell_u[row + x / step] += u[i];
+      cell_v[row + x / step] += v[i];
+      cell_n[row + x / step] += 1;
+    }
+  }
+  int16_t *out = values.data() + k * 2 * cell_u.size();
+  double total = 0, largest = 0;
+  for (std::size_t c = 0; c < cell_u.size(); ++c) {
+    const double cu = cell_u[c] / cell_n[c];
+    const double cv = cell_v[c] / cell_n[c];
+    for (int j = 0; j < 2; ++j) {
+      const double q = std::round((j ? cv : cu) / quantum);
+      out[2 * c + j] = static_cast<int16_t>(std::clamp(q, -32768.0, 32767.0));
+    }
+    const double speed = std::sqrt(cu * cu + cv * cv);
+    total += speed;
+    largest = std::max(largest, speed);
+  }
+  return {total / cell_u.size(), largest};
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+unsigned int SITiffIO::estimateOpticalFlow(unsigned int channel,
+                                           unsigned int first,
+                                           unsigned int last,
+                                           unsigned int step,
+                                           unsigned int n_reference,
+                                           unsigned int levels,
+                                           unsigned int window) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  if (getAllTransforms() == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  if (step == 0) {
+    throw std::invalid_argument("The step has to be at least 1");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int n_ref = std::clamp(n_reference, 1u, n_frames);
+  const auto reference =
+      registrationReference(channel, first, first + n_ref - 1, 0);
+  OpticalFlow optical_flow(reference, levels, window);
+
+  auto fields = std::make_shared<OpticalFlowFields>();
+  fields->first = first;
+  fields->step = step;
+  fields->rows = (h + step - 1) / step;
+  fields->cols = (w + step - 1) / step;
+  const std::size_t field_size = 2 * std::size_t(fields->rows) * fields->cols;
+  fields->values.assign(field_size * n_frames, 0);
+  // (mean, largest) flow of each frame
+  std::vector<double> summary(2 * std::size_t(n_frames), 0.0);
+  auto estimate = [&](unsigned int frame, const int16_t *src, int16_t *) {
+    thread_local std::vector<float> u, v;
+    optical_flow.flow(src, u, v);
+    const std::size_t k = frame - first;
+    std::tie(summary[2 * k], summary[2 * k + 1]) = fields->store(k, u, v, h, w);
+  };
+  const unsigned int count = correctFrames(channel, first, last, "", estimate);
+  fields->n_frames = count;
+  fields->values.resize(field_size * count);
+
+  updateTransforms([&](TransformTable &table) {
+    table.setFrameTransforms(TransformType::kOpticalFlow, first, count, 1, 2,
+                             summary);
+  });
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_optical_flow = std::move(fields);
+  }
+  std::cout << "Estimated the optical flow of " << count << " frames"
+            << std::endl;
+  return count;
+}
+
+py::array_t<float> SITiffIO::getOpticalFlow() const {
+  auto fields = getOpticalFlowFields();
+  if (fields == nullptr)
+    return py::array_t<float>(std::vector<py::ssize_t>{0, 0, 0, 2});
+  py::array_t<float> flow(std::vector<py::ssize_t>{
+      py::ssize_t(fields->n_frames), py::ssize_t(fields->rows),
+      py::ssize_t(fields->cols), 2});
+  float *dst = flow.mutable_data();
+  for (std::size_t i = 0; i < fields->values.size(); ++i)
+    dst[i] = fields->values[i] * OpticalFlowFields::quantum;
+  return flow;
+}
+
+} // namespace twophoton
@@ -0,0 +1,1030 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace twophoton {
+
+using cfloat = std::complex<float>;
+
+// the width (pixels) of the Gaussian the correlation surface is smoothed
+// with so its peak is broad enough to fit a parabola to
+static constexpr double smooth_sigma = 1.0;
+
+// std::complex's operator* checks for infs and NaNs, which is slow
+static inline cfloat cmul(cfloat a, cfloat b) {
+  return {a.real() * b.real() - a.imag() * b.imag(),
+          a.real() * b.imag() + a.imag() * b.real()};
+}
+
+static inline float magnitude(cfloat a) {
+  return std::sqrt(a.real() * a.real() + a.imag() * a.imag());
+}
+
+static std::size_t nextPow2(std::size_t n) {
+  std::size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+FFTPlan::FFTPlan(std::size_t n) : m_n(n) {
+  if (n == 0 || (n & (n - 1)) != 0) {
+    throw std::invalid_argument("The FFT length has to be a power of two");
+  }
+  unsigned int bits = 0;
+  while ((std::size_t(1) << bits) < n)
+    ++bits;
+  m_bitrev.resize(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    uint32_t r = 0;
+    for (unsigned int b = 0; b < bits; ++b)
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    m_bitrev[i] = r;
+  }
+  // the twiddles of each stage one after the other so the butterflies
+  // read them in order, for both directions
+  m_twiddles.reserve(n > 1 ? n - 1 : 0);
+  for (std::size_t half = 1; half < n; half <<= 1) {
+    for (std::size_t k = 0; k < half; ++k) {
+      const double a = -M_PI * double(k) / double(half);
+      m_twiddles.emplace_back(float(std::cos(a)), float(std::sin(a)));
+    }
+  }
+  m_inverse_twiddles.resize(m_twiddles.size());
+  std::transform(m_twiddles.begin(), m_twiddles.end(),
+                 m_inverse_twiddles.begin(),
+                 [](cfloat tw) { return std::conj(tw); });
+}
+
+std::shared_ptr<const FFTPlan> FFTPlan::get(std::size_t n) {
+  static std::mutex mutex;
+  static std::unordered_map<std::size_t, std::shared_ptr<const FFTPlan>> plans;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &plan = plans[n];
+  if (plan == nullptr)
+    plan = std::make_shared<const FFTPlan>(n);
+  return plan;
+}
+
+void FFTPlan::transform(cfloat *data, bool inverse) const {
+  for (std::size_t i = 0; i < m_n; ++i) {
+    const std::size_t j = m_bitrev[i];
+    if (i < j)
+      std::swap(data[i], data[j]);
+  }
+  const cfloat *tw = inverse ? m_inverse_twiddles.data() : m_twiddles.data();
+  for (std::size_t half = 1; half < m_n; half <<= 1) {
+    for (std::size_t i = 0; i < m_n; i += 2 * half) {
+      cfloat *a = data + i;
+      cfloat *b = data + i + half;
+      for (std::size_t k = 0; k < half; ++k) {
+        const cfloat u = a[k];
+        const cfloat v = cmul(b[k], tw[k]);
+        a[k] = u + v;
+        b[k] = u - v;
+      }
+    }
+    tw += half;
+  }
+}
+
+// transforms rows first to last of a row-major array with cols columns
+static void fftRows(cfloat *data, std::size_t cols, std::size_t first,
+                    std::size_t last, bool inverse) {
+  auto plan = FFTPlan::get(cols);
+  for (std::size_t r = first; r < last; ++r) {
+    if (inverse)
+      plan->inverse(data + r * cols);
+    else
+      plan->forward(data + r * cols);
+  }
+}
+
+static void fftColumns(cfloat *data, std::size_t rows, std::size_t cols,
+                       bool inverse) {
+  auto plan = FFTPlan::get(rows);
+  // the columns are copied out a block at a time so they are contiguous
+  constexpr std::size_t block = 8;
+  thread_local std::vector<cfloat> column;
+  column.resize(block * rows);
+  for (std::size_t c0 = 0; c0 < cols; c0 += block) {
+    const std::size_t nc = std::min(block, cols - c0);
+    for (std::size_t r = 0; r < rows; ++r)
+      for (std::size_t c = 0; c < nc; ++c)
+        column[c * rows + r] = data[r * cols + c0 + c];
+    for (std::size_t c = 0; c < nc; ++c) {
+      if (inverse)
+        plan->inverse(column.data() + c * rows);
+      else
+        plan->forward(column.data() + c * rows);
+    }
+    for (std::size_t r = 0; r < rows; ++r)
+      for (std::size_t c = 0; c < nc; ++c)
+        data[r * cols + c0 + c] = column[c * rows + r];
+  }
+}
+
+void fft2d(cfloat *data, std::size_t rows, std::size_t cols, bool inverse) {
+  fftRows(data, cols, 0, rows, inverse);
+  fftColumns(data, rows, cols, inverse);
+}
+
+static std::vector<float> hannWindow(unsigned int n) {
+  std::vector<float> window(n, 1.0f);
+  if (n < 2)
+    return window;
+  for (unsigned int i = 0; i < n; ++i)
+    window[i] = float(0.5 - 0.5 * std::cos(2.0 * M_PI * i / (n - 1)));
+  return window;
+}
+
+// the frequency of bin k of an n point FFT in cycles per sample
+static inline double binFrequency(std::size_t k, std::size_t n) {
+  return (k < (n + 1) / 2 ? double(k) : double(k) - double(n)) / double(n);
+}
+
+/*
+The FFT of img (h x w, row-major) with its mean subtracted, multiplied by
+window(y, x) and zero-padded to ph x pw
+*/
+template <typename T, typename Window>
+static void windowedFFT(const T *img, unsigned int h, unsigned int w,
+                        std::size_t ph, std::size_t pw, Window window,
+                        std::vector<cfloat> &out) {
+  const std::size_t n = std::size_t(h) * w;
+  double sum = 0;
+  for (std::size_t i = 0; i < n; ++i)
+    sum += img[i];
+  const float mean = float(sum / n);
+  out.assign(ph * pw, cfloat(0));
+  auto plan = FFTPlan::get(pw);
+  // the rows are real so two are transformed at once as the real and
+  // imaginary parts of one complex row and then separated using the
+  // symmetry of the transform of a real signal. Rows past the bottom of
+  // the frame are all zero so are left alone
+  for (unsigned int y = 0; y < h; y += 2) {
+    cfloat *a = out.data() + y * pw;
+    cfloat *b = a + pw;
+    const T *src_a = img + std::size_t(y) * w;
+    const bool pair = y + 1 < h;
+    for (unsigned int x = 0; x < w; ++x) {
+      const float re = (float(src_a[x]) - mean) * window(y, x);
+      const float im =
+          pair ? (float(src_a[w + x]) - mean) * window(y + 1, x) : 0;
+      a[x] = cfloat(re, im);
+    }
+    plan->forward(a);
+    // A[k] = (Z[k] + Z*[N-k]) / 2 and B[k] = (Z[k] - Z*[N-k]) / 2i, done
+    // for k and N - k together so a can be overwritten in place
+    for (std::size_t k = 0; k <= pw / 2; ++k) {
+      const std::size_t nk = (pw - k) % pw;
+      const cfloat zk = a[k];
+      const cfloat znk = a[nk];
+      const cfloat ak = 0.5f * (zk + std::conj(znk));
+      const cfloat dk = 0.5f * (zk - std::conj(znk));
+      const cfloat bk(dk.imag(), -dk.real());
+      a[k] = ak;
+      a[nk] = std::conj(ak);
+      if (pair) {
+        b[k] = bk;
+        b[nk] = std::conj(bk);
+      }
+    }
+  }
+  fftColumns(out.data(), ph, pw, false);
+}
+
+PhaseCorrelator::PhaseCorrelator(const float *reference, unsigned int h,
+                                 unsigned int w, unsigned int max_shift,
+                                 bool window)
+    : m_h(h), m_w(w), m_ph(nextPow2(h)), m_pw(nextPow2(w)),
+      m_max_shift(max_shift),
+      m_window_y(window ? hannWindow(h) : std::vector<float>(h, 1.0f)),
+      m_window_x(window ? hannWindow(w) : std::vector<float>(w, 1.0f)) {
+  if (h == 0 || w == 0) {
+    throw std::invalid_argument("The reference image is empty");
+  }
+  if (m_max_shift == 0)
+    m_max_shift = std::min(h, w) / 4;
+  // shifts of half the padded frame or more wrap round
+  const std::size_t half = std::min(m_ph, m_pw) / 2;
+  m_max_shift = std::min<std::size_t>(m_max_shift, half > 0 ? half - 1 : 0);
+  windowedFFT(reference, m_h, m_w, m_ph, m_pw, separable(), m_reference);
+  const double s = 2.0 * M_PI * M_PI * smooth_sigma * smooth_sigma;
+  for (std::size_t ky = 0; ky < m_ph; ++ky) {
+    const double fy = binFrequency(ky, m_ph);
+    for (std::size_t kx = 0; kx < m_pw; ++kx) {
+      const double fx = binFrequency(kx, m_pw);
+      auto &R = m_reference[ky * m_pw + kx];
+      const float mag = magnitude(R);
+      const float g = float(std::exp(-s * (fx * fx + fy * fy)));
+      R = mag > 0 ? std::conj(R) * (g / mag) : cfloat(0);
+    }
+  }
+}
+
+PhaseCorrelator::PhaseCorrelator(const arma::Mat<float> &reference,
+                                 unsigned int max_shift, bool window)
+    : PhaseCorrelator(reference.memptr(), reference.n_rows, reference.n_cols,
+                      max_shift, window) {}
+
+// the offset of the vertex of the parabola through (-1, a), (0, b), (1, c)
+static double parabolicPeak(double a, double b, double c) {
+  const double denom = a - 2 * b + c;
+  if (denom >= 0)
+    return 0;
+  return std::clamp(0.5 * (a - c) / denom, -0.5, 0.5);
+}
+
+template <typename T>
+std::pair<double, double> PhaseCorrelator::shiftOf(const T *frame) const {
+  thread_local std::vector<cfloat> spectrum;
+  windowedFFT(frame, m_h, m_w, m_ph, m_pw, separable(), spectrum);
+  for (std::size_t i = 0; i < spectrum.size(); ++i) {
+    const float mag = magnitude(spectrum[i]);
+    spectrum[i] = mag > 0 ? cmul(spectrum[i] / mag, m_reference[i]) : cfloat(0);
+  }
+  // only the rows within the largest shift (and the neighbours of the
+  // peak) of the origin are needed from the inverse
+  const long ms = m_max_shift;
+  fftColumns(spectrum.data(), m_ph, m_pw, true);
+  fftRows(spectrum.data(), m_pw, 0, std::min<std::size_t>(ms + 2, m_ph),
+          true);
+  if (std::size_t(ms + 2) < m_ph)
+    fftRows(spectrum.data(), m_pw, std::max<long>(m_ph - ms - 1, ms + 2),
+            m_ph, true);
+  // the correlation at shift (dx, dy), wrapped round the padded frame
+  auto at = [&](long dy, long dx) {
+    const std::size_t y = (dy + long(m_ph)) % long(m_ph);
+    const std::size_t x = (dx + long(m_pw)) % long(m_pw);
+    return double(spectrum[y * m_pw + x].real());
+  };
+  long best_x = 0, best_y = 0;
+  double best = -std::numeric_limits<double>::infinity();
+  for (long dy = -ms; dy <= ms; ++dy) {
+    for (long dx = -ms; dx <= ms; ++dx) {
+      const double c = at(dy, dx);
+      if (c > best) {
+        best = c;
+        best_x = dx;
+        best_y = dy;
+      }
+    }
+  }
+  const double ox =
+      parabolicPeak(at(best_y, best_x - 1), best, at(best_y, best_x + 1));
+  const double oy =
+      parabolicPeak(at(best_y - 1, best_x), best, at(best_y + 1, best_x));
+  return {best_x + ox, best_y + oy};
+}
+
+std::pair<double, double> PhaseCorrelator::shift(const int16_t *frame) const {
+  return shiftOf(frame);
+}
+
+std::pair<double, double> PhaseCorrelator::shift(const float *frame) const {
+  return shiftOf(frame);
+}
+
+LogPolarEstimator::LogPolarEstimator(const float *reference, unsigned int h,
+                                     unsigned int w, unsigned int n_angles,
+                                     unsigned int n_radii)
+    : m_h(h), m_w(w), m_ph(nextPow2(h)), m_pw(nextPow2(w)),
+      m_n_angles(nextPow2(std::max(n_angles, 4u))),
+      m_n_radii(nextPow2(std::max(n_radii, 4u))) {
+  if (h < 4 || w < 4) {
+    throw std::invalid_argument("The reference image is too small");
+  }
+  // a Hann window of the distance from the centre so the window (and the
+  // corners of rotated frames, which are cut off by it) looks the same at
+  // every angle; a separable one puts a cross in the spectrum that
+  // doesn't rotate with the frame
+  m_window.resize(std::size_t(h) * w);
+  const double cy = (h - 1) / 2.0;
+  const double cx = (w - 1) / 2.0;
+  const double radius = std::min(h, w) / 2.0;
+  for (unsigned int y = 0; y < h; ++y) {
+    for (unsigned int x = 0; x < w; ++x) {
+      const double r = std::hypot(y - cy, x - cx) / radius;
+      m_window[std::size_t(y) * w + x] =
+          r < 1 ? float(0.5 + 0.5 * std::cos(M_PI * r)) : 0.0f;
+    }
+  }
+  // radii in cycles per pixel from a couple of bins out to just inside
+  // the Nyquist frequency
+  const double r_min = 2.0 / std::min(m_ph, m_pw);
+  const double r_max = 0.5 - 1.0 / std::min(m_ph, m_pw);
+  m_log_step = std::log(r_max / r_min) / (m_n_radii - 1);
+  const std::size_t n = std::size_t(m_n_angles) * m_n_radii;
+  m_taps.resize(n);
+  m_fx.resize(n);
+  m_fy.resize(n);
+  m_filter.resize(n);
+  // the index of bin (ky, kx) with negative frequencies counted back from
+  // the end of each axis
+  auto bin = [&](long ky, long kx) {
+    const std::size_t y = (ky + long(m_ph)) % long(m_ph);
+    const std::size_t x = (kx + long(m_pw)) % long(m_pw);
+    return uint32_t(y * m_pw + x);
+  };
+  std::size_t i = 0;
+  for (unsigned int a = 0; a < m_n_angles; ++a) {
+    // the spectrum is symmetric so half a turn covers all of it
+    const double theta = M_PI * a / m_n_angles;
+    const double c = std::cos(theta);
+    const double s = std::sin(theta);
+    for (unsigned int r = 0; r < m_n_radii; ++r, ++i) {
+      const double rho = r_min * std::exp(r * m_log_step);
+      const double ky = rho * s * m_ph;
+      const double kx = rho * c * m_pw;
+      const double y0 = std::floor(ky);
+      const double x0 = std::floor(kx);
+      const long yi = long(y0);
+      const long xi = long(x0);
+      m_taps[i] = {bin(yi, xi), bin(yi, xi + 1), bin(yi + 1, xi),
+                   bin(yi + 1, xi + 1)};
+      m_fy[i] = float(ky - y0);
+      m_fx[i] = float(kx - x0);
+      // Reddy and Chatterji's high-pass filter
+      const double X = std::cos(M_PI * rho * s) * std::cos(M_PI * rho * c);
+      m_filter[i] = float((1 - X) * (2 - X));
+    }
+  }
+  std::vector<float> reference_lp;
+  logPolar(reference, reference_lp);
+  // the angles wrap round so the log-polar images aren't windowed
+  m_correlator = std::make_unique<PhaseCorrelator>(
+      reference_lp.data(), m_n_angles, m_n_radii, m_n_angles / 4, false);
+}
+
+LogPolarEstimator::LogPolarEstimator(const arma::Mat<float> &reference,
+                                     unsigned int n_angles,
+                                     unsigned int n_radii)
+    : LogPolarEstimator(reference.memptr(), reference.n_rows,
+                        reference.n_cols, n_angles, n_radii) {}
+
+// The magnitudes are compressed with a log, otherwise the whitening in
+// the phase correlation boosts the weak bins far from the origin, where
+// the grid the spectrum is sampled on (which doesn't rotate) shows
+// through, until they pull small rotations to zero
+template <typename T>
+void LogPolarEstimator::logPolar(const T *img, std::vector<float> &out) const {
+  thread_local std::vector<cfloat> spectrum;
+  windowedFFT(img, m_h, m_w, m_ph, m_pw,
+              [this](unsigned int y, unsigned int x) {
+                return m_window[std::size_t(y) * m_w + x];
+              },
+              spectrum);
+  const cfloat *S = spectrum.data();
+  out.resize(m_taps.size());
+  for (std::size_t i = 0; i < m_taps.size(); ++i) {
+    const auto &t = m_taps[i];
+    const float fx = m_fx[i];
+    const float top = magnitude(S[t[0]]) +
+                      fx * (magnitude(S[t[1]]) - magnitude(S[t[0]]));
+    const float bottom = magnitude(S[t[2]]) +
+                         fx * (magnitude(S[t[3]]) - magnitude(S[t[2]]));
+    out[i] = std::log1p(m_filter[i] * (top + m_fy[i] * (bottom - top)));
+  }
+}
+
+std::pair<double, double>
+LogPolarEstimator::estimate(const int16_t *frame) const {
+  thread_local std::vector<float> frame_lp;
+  logPolar(frame, frame_lp);
+  // rows are angles and columns log radii; magnifying the frame shrinks
+  // its spectrum
+  auto [dr, da] = m_correlator->shift(frame_lp.data());
+  return {M_PI * da / m_n_angles, std::exp(-dr * m_log_step)};
+}
+
+void translateFrame(const int16_t *src, int16_t *dst, unsigned int h,
+                    unsigned int w, double dx, double dy) {
+  // every pixel samples src at the same fractional offset
+  const double sx = std::floor(-dx);
+  const double sy = std::floor(-dy);
+  const long ix = long(sx);
+  const long iy = long(sy);
+  const float fx = float(-dx - sx);
+  const float fy = float(-dy - sy);
+  auto pixel = [&](long y, long x) -> float {
+    if (y < 0 || x < 0 || y >= long(h) || x >= long(w))
+      return 0;
+    return src[y * long(w) + x];
+  };
+  for (long y = 0; y < long(h); ++y) {
+    const long y0 = y + iy;
+    for (long x = 0; x < long(w); ++x) {
+      const long x0 = x + ix;
+      const float top =
+          pixel(y0, x0) + fx * (pixel(y0, x0 + 1) - pixel(y0, x0));
+      const float bottom =
+          pixel(y0 + 1, x0) + fx * (pixel(y0 + 1, x0 + 1) - pixel(y0 + 1, x0));
+      const float v = std::round(top + fy * (bottom - top));
+      dst[y * long(w) + x] =
+          static_cast<int16_t>(std::clamp(v, -32768.0f, 32767.0f));
+    }
+  }
+}
+
+// the first row (column) of each of the patches along a side of n pixels
+static std::vector<unsigned int> patchStarts(unsigned int n,
+                                             unsigned int patch,
+                                             double overlap) {
+  if (patch >= n)
+    return {0};
+  const unsigned int stride =
+      std::max(1u, unsigned(std::lround(patch * (1.0 - overlap))));
+  std::vector<unsigned int> starts((n - patch + stride - 1) / stride + 1);
+  for (std::size_t i = 0; i < starts.size(); ++i)
+    starts[i] = std::min<unsigned int>(i * stride, n - patch);
+  return starts;
+}
+
+// for each of n pixels the patch whose centre is at or before it and how
+// far it is towards the centre of the next one
+static void patchWeights(unsigned int n, unsigned int patch,
+                         const std::vector<unsigned int> &starts,
+                         std::vector<unsigned int> &index,
+                         std::vector<float> &weight) {
+  index.assign(n, 0);
+  weight.assign(n, 0.0f);
+  const double half = 0.5 * (patch - 1);
+  std::size_t i = 0;
+  for (unsigned int p = 0; p < n; ++p) {
+    while (i + 1 < starts.size() && starts[i + 1] + half <= p)
+      ++i;
+    index[p] = i;
+    if (i + 1 < starts.size()) {
+      const double c0 = starts[i] + half;
+      const double c1 = starts[i + 1] + half;
+      weight[p] = float(std::clamp((p - c0) / (c1 - c0), 0.0, 1.0));
+    }
+  }
+}
+
+PiecewiseRegistration::PiecewiseRegistration(const float *reference,
+                                             unsigned int h, unsigned int w,
+                                             unsigned int patch_size,
+                                             double overlap,
+                                             unsigned int max_shift)
+    : m_h(h), m_w(w), m_ph(std::min(patch_size, h)),
+      m_pw(std::min(patch_size, w)) {
+  if (h == 0 || w == 0) {
+    throw std::invalid_argument("The reference image is empty");
+  }
+  if (patch_size == 0) {
+    throw std::invalid_argument("The patch size has to be at least 1");
+  }
+  if (overlap < 0 || overlap >= 1) {
+    throw std::invalid_argument("The overlap has to be in [0, 1)");
+  }
+  m_ys = patchStarts(h, m_ph, overlap);
+  m_xs = patchStarts(w, m_pw, overlap);
+  patchWeights(h, m_ph, m_ys, m_row_patch, m_row_weight);
+  patchWeights(w, m_pw, m_xs, m_col_patch, m_col_weight);
+  if (max_shift == 0)
+    max_shift = std::max(1u, std::min(m_ph, m_pw) / 4);
+  std::vector<float> patch(std::size_t(m_ph) * m_pw);
+  m_correlators.reserve(nPatches());
+  for (auto y0 : m_ys) {
+    for (auto x0 : m_xs) {
+      for (unsigned int y = 0; y < m_ph; ++y)
+        std::copy_n(reference + std::size_t(y0 + y) * w + x0, m_pw,
+                    patch.data() + std::size_t(y) * m_pw);
+      m_correlators.emplace_back(patch.data(), m_ph, m_pw, max_shift);
+    }
+  }
+}
+
+PiecewiseRegistration::PiecewiseRegistration(
+    const arma::Mat<float> &reference, unsigned int patch_size,
+    double overlap, unsigned int max_shift)
+    : PiecewiseRegistration(reference.memptr(), reference.n_rows,
+                            reference.n_cols, patch_size, overlap,
+                            max_shift) {}
+
+std::vector<double>
+PiecewiseRegistration::shifts(const int16_t *frame) const {
+  thread_local std::vector<float> patch;
+  patch.resize(std::size_t(m_ph) * m_pw);
+  const std::size_t n = nPatches();
+  std::vector<double> raw(2 * n);
+  std::size_t k = 0;
+  for (auto y0 : m_ys) {
+    for (auto x0 : m_xs) {
+      for (unsigned int y = 0; y < m_ph; ++y) {
+        const int16_t *src = frame + std::size_t(y0 + y) * m_w + x0;
+        std::copy_n(src, m_pw, patch.data() + std::size_t(y) * m_pw);
+      }
+      auto [dx, dy] = m_correlators[k].shift(patch.data());
+      raw[k] = dx;
+      raw[n + k] = dy;
+      ++k;
+    }
+  }
+  // each shift becomes the median of it and its neighbours in the grid
+  const long rows = m_ys.size();
+  const long cols = m_xs.size();
+  std::vector<double> smoothed(2 * n);
+  std::vector<double> window;
+  window.reserve(9);
+  for (std::size_t c = 0; c < 2; ++c) {
+    const double *in = raw.data() + c * n;
+    for (long i = 0; i < rows; ++i) {
+      for (long j = 0; j < cols; ++j) {
+        window.clear();
+        for (long y = std::max(0l, i - 1); y <= std::min(rows - 1, i + 1); ++y)
+          for (long x = std::max(0l, j - 1); x <= std::min(cols - 1, j + 1);
+               ++x)
+            window.push_back(in[y * cols + x]);
+        auto mid = window.begin() + window.size() / 2;
+        std::nth_element(window.begin(), mid, window.end());
+        double median = *mid;
+        if (window.size() % 2 == 0)
+          median = 0.5 * (median + *std::max_element(window.begin(), mid));
+        smoothed[c * n + i * cols + j] = median;
+      }
+    }
+  }
+  return smoothed;
+}
+
+void PiecewiseRegistration::warp(const int16_t *src, int16_t *dst,
+                                 std::span<const double> shifts) const {
+  const std::size_t n = nPatches();
+  if (shifts.size() != 2 * n) {
+    throw std::invalid_argument("There have to be 2 shifts per patch");
+  }
+  const std::size_t cols = m_xs.size();
+  const std::size_t rows = m_ys.size();
+  // the shifts of the patch columns interpolated down to the current row,
+  // then across it to every pixel
+  thread_local std::vector<float> row_dx, row_dy, dx, dy;
+  row_dx.resize(cols);
+  row_dy.resize(cols);
+  dx.resize(m_w);
+  dy.resize(m_w);
+  auto pixel = [&](long y, long x) -> float {
+    if (y < 0 || x < 0 || y >= long(m_h) || x >= long(m_w))
+      return 0;
+    return src[y * long(m_w) + x];
+  };
+  for (unsigned int y = 0; y < m_h; ++y) {
+    const std::size_t i0 = m_row_patch[y];
+    const std::size_t i1 = std::min(i0 + 1, rows - 1);
+    const float wy = m_row_weight[y];
+    for (std::size_t j = 0; j < cols; ++j) {
+      const double x0 = shifts[i0 * cols + j], x1 = shifts[i1 * cols + j];
+      const double y0 = shifts[n + i0 * cols + j],
+                   y1 = shifts[n + i1 * cols + j];
+      row_dx[j] = float(x0 + wy * (x1 - x0));
+      row_dy[j] = float(y0 + wy * (y1 - y0));
+    }
+    for (unsigned int x = 0; x < m_w; ++x) {
+      const std::size_t j0 = m_col_patch[x];
+      const std::size_t j1 = std::min(j0 + 1, cols - 1);
+      const float wx = m_col_weight[x];
+      dx[x] = row_dx[j0] + wx * (row_dx[j1] - row_dx[j0]);
+      dy[x] = row_dy[j0] + wx * (row_dy[j1] - row_dy[j0]);
+    }
+    int16_t *out = dst + std::size_t(y) * m_w;
+    for (unsigned int x = 0; x < m_w; ++x) {
+      const float sx = x + dx[x];
+      const float sy = y + dy[x];
+      const float fx0 = std::floor(sx);
+      const float fy0 = std::floor(sy);
+      const long x0 = long(fx0);
+      const long y0 = long(fy0);
+      const float fx = sx - fx0;
+      const float fy = sy - fy0;
+      const float top =
+          pixel(y0, x0) + fx * (pixel(y0, x0 + 1) - pixel(y0, x0));
+      const float bottom =
+          pixel(y0 + 1, x0) + fx * (pixel(y0 + 1, x0 + 1) - pixel(y0 + 1, x0));
+      const float v = std::round(top + fy * (bottom - top));
+      out[x] = static_cast<int16_t>(std::clamp(v, -32768.0f, 32767.0f));
+    }
+  }
+}
+
+TemplateTracker::TemplateTracker(const float *tmpl, unsigned int th,
+                                 unsigned int tw, unsigned int h,
+                                 unsigned int w, double x, double y,
+                                 unsigned int search)
+    : m_th(th), m_tw(tw), m_h(h), m_w(w), m_search(search), m_x0(x), m_y0(y),
+      m_x(x), m_y(y), m_template(tmpl, tmpl + std::size_t(th) * tw) {
+  if (th == 0 || tw == 0) {
+    throw std::invalid_argument("The template is empty");
+  }
+  if (x < 0 || y < 0 || x + tw > w || y + th > h) {
+    throw std::invalid_argument("The template has to fit inside the frame");
+  }
+  double mean = 0;
+  for (const float v : m_template)
+    mean += v;
+  mean /= m_template.size();
+  double norm = 0;
+  for (auto &v : m_template) {
+    v = float(v - mean);
+    norm += double(v) * v;
+  }
+  if (norm <= 0) {
+    throw std::invalid_argument("The template has no contrast");
+  }
+  const float scale = float(1.0 / std::sqrt(norm));
+  for (auto &v : m_template)
+    v *= scale;
+}
+
+TemplateTracker::TemplateTracker(const arma::Mat<float> &tmpl, unsigned int h,
+                                 unsigned int w, double x, double y,
+                                 unsigned int search)
+    : TemplateTracker(tmpl.memptr(), tmpl.n_rows, tmpl.n_cols, h, w, x, y,
+                      search) {}
+
+std::pair<double, double> TemplateTracker::track(const int16_t *frame) {
+  // the top-left corners looked at, kept so the template is inside the
+  // frame
+  const long r = m_search;
+  const long cx = std::lround(m_x);
+  const long cy = std::lround(m_y);
+  const long x_lo = std::max(0l, cx - r);
+  const long x_hi = std::min(long(m_w - m_tw), cx + r);
+  const long y_lo = std::max(0l, cy - r);
+  const long y_hi = std::min(long(m_h - m_th), cy + r);
+  const std::size_t nx = x_hi - x_lo + 1;
+  const std::size_t ny = y_hi - y_lo + 1;
+  const std::size_t rw = nx + m_tw - 1;
+  const std::size_t rh = ny + m_th - 1;
+  m_region.resize(rh * rw);
+  for (std::size_t y = 0; y < rh; ++y) {
+    const int16_t *src = frame + (y_lo + y) * std::size_t(m_w) + x_lo;
+    std::copy_n(src, rw, m_region.data() + y * rw);
+  }
+  // sum(template * region) at every candidate: each template pixel adds
+  // itself times a run of the region onto a row of the surface
+  m_corr.assign(ny * nx, 0.0f);
+  for (std::size_t dy = 0; dy < ny; ++dy) {
+    float *c = m_corr.data() + dy * nx;
+    for (std::size_t ty = 0; ty < m_th; ++ty) {
+      const float *t = m_template.data() + ty * m_tw;
+      const float *row = m_region.data() + (dy + ty) * rw;
+      for (std::size_t tx = 0; tx < m_tw; ++tx) {
+        const float v = t[tx];
+        const float *q = row + tx;
+        for (std::size_t dx = 0; dx < nx; ++dx)
+          c[dx] += v * q[dx];
+      }
+    }
+  }
+  // summed-area tables of the region for the mean and energy under the
+  // template at each candidate
+  m_sum.assign((rh + 1) * (rw + 1), 0.0);
+  m_sum_sq.assign((rh + 1) * (rw + 1), 0.0);
+  for (std::size_t y = 0; y < rh; ++y) {
+    double row_sum = 0, row_sq = 0;
+    for (std::size_t x = 0; x < rw; ++x) {
+      const double v = m_region[y * rw + x];
+      row_sum += v;
+      row_sq += v * v;
+      const std::size_t i = (y + 1) * (rw + 1) + x + 1;
+      m_sum[i] = m_sum[i - rw - 1] + row_sum;
+      m_sum_sq[i] = m_sum_sq[i - rw - 1] + row_sq;
+    }
+  }
+  auto box = [&](const std::vector<double> &S, std::size_t y, std::size_t x) {
+    const std::size_t s = rw + 1;
+    return S[(y + m_th) * s + x + m_tw] - S[y * s + x + m_tw] -
+           S[(y + m_th) * s + x] + S[y * s + x];
+  };
+  const double n = double(m_th) * m_tw;
+  std::size_t best = 0;
+  for (std::size_t dy = 0; dy < ny; ++dy) {
+    for (std::size_t dx = 0; dx < nx; ++dx) {
+      const double sum = box(m_sum, dy, dx);
+      const double var = box(m_sum_sq, dy, dx) - sum * sum / n;
+      // the template has zero mean so the frame's mean doesn't matter to
+      // the numerator
+      float &c = m_corr[dy * nx + dx];
+      c = var > 1e-6 ? float(c / std::sqrt(var)) : 0.0f;
+      if (c > m_corr[best])
+        best = dy * nx + dx;
+    }
+  }
+  const std::size_t by = best / nx;
+  const std::size_t bx = best % nx;
+  auto at = [&](std::size_t y, std::size_t x) {
+    return double(m_corr[y * nx + x]);
+  };
+  double ox = 0, oy = 0;
+  if (bx > 0 && bx + 1 < nx)
+    ox = parabolicPeak(at(by, bx - 1), at(by, bx), at(by, bx + 1));
+  if (by > 0 && by + 1 < ny)
+    oy = parabolicPeak(at(by - 1, bx), at(by, bx), at(by + 1, bx));
+  m_x = x_lo + bx + ox;
+  m_y = y_lo + by + oy;
+  m_score = at(by, bx);
+  return {m_x - m_x0, m_y - m_y0};
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+arma::Mat<float> SITiffIO::registrationReference(unsigned int channel,
+                                                 unsigned int first,
+                                                 unsigned int last,
+                                                 unsigned int max_shift) {
+  auto mean = std::get<0>(project(channel, first, last));
+  PhaseCorrelator correlator(mean, max_shift);
+  const unsigned int h = mean.n_rows;
+  const unsigned int w = mean.n_cols;
+  const std::size_t n = mean.n_elem;
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int nthreads = std::min(getNThreads(), n_frames);
+  auto readers = openReaders(nthreads);
+  // each thread sums its own block of the registered frames
+  std::vector<std::vector<double>> sums(nthreads);
+  std::vector<unsigned int> counts(nthreads, 0);
+  parallelFor(
+      n_frames,
+      [&](unsigned int t, std::size_t begin, std::size_t end) {
+        auto &reader = *readers[t];
+        auto &sum = sums[t];
+        sum.assign(n, 0.0);
+        std::vector<int16_t> aligned(n);
+        for (std::size_t i = begin; i < end; ++i) {
+          const unsigned int frame = first + i;
+          auto F = reader.readframe((frame - 1) * m_nchans + channel - 1);
+          if (F.n_elem != n)
+            break;
+          auto [dx, dy] = correlator.shift(F.memptr());
+          translateFrame(F.memptr(), aligned.data(), h, w, -dx, -dy);
+          for (std::size_t j = 0; j < n; ++j)
+            sum[j] += aligned[j];
+          ++counts[t];
+        }
+      },
+      nthreads);
+  unsigned int total = 0;
+  std::vector<double> total_sum(n, 0.0);
+  for (unsigned int t = 0; t < nthreads; ++t) {
+    if (sums[t].empty())
+      continue;
+    total += counts[t];
+    for (std::size_t j = 0; j < n; ++j)
+      total_sum[j] += sums[t][j];
+  }
+  if (total == 0)
+    return mean;
+  arma::Mat<float> reference(h, w);
+  float *r = reference.memptr();
+  for (std::size_t j = 0; j < n; ++j)
+    r[j] = static_cast<float>(total_sum[j] / total);
+  return reference;
+}
+
+unsigned int SITiffIO::registerTranslation(unsigned int channel,
+                                           unsigned int first,
+                                           unsigned int last,
+                                           const std::string &fname,
+                                           unsigned int n_reference,
+                                           unsigned int max_shift,
+                                           bool rotation) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  if (getAllTransforms() == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int n_ref = std::clamp(n_reference, 1u, n_frames);
+  const auto reference =
+      registrationReference(channel, first, first + n_ref - 1, max_shift);
+  PhaseCorrelator correlator(reference, max_shift);
+  std::unique_ptr<LogPolarEstimator> estimator;
+  std::unique_ptr<Derotator> derotator;
+  if (rotation) {
+    estimator = std::make_unique<LogPolarEstimator>(reference);
+    derotator = std::make_unique<Derotator>(h, w);
+  }
+
+  // (x, y) and (angle, scale) for each frame of the range
+  std::vector<double> shifts(2 * std::size_t(n_frames), 0.0);
+  std::vector<double> rotations(rotation ? 2 * std::size_t(n_frames) : 0);
+  auto correct = [&](unsigned int frame, const int16_t *src, int16_t *dst) {
+    thread_local std::vector<int16_t> derotated;
+    const std::size_t j = 2 * std::size_t(frame - first);
+    if (rotation) {
+      auto [angle, scale] = estimator->estimate(src);
+      rotations[j] = angle;
+      rotations[j + 1] = scale;
+      derotated.resize(std::size_t(h) * w);
+      derotator->derotate(src, derotated.data(), angle);
+      src = derotated.data();
+    }
+    auto [dx, dy] = correlator.shift(src);
+    shifts[j] = dx;
+    shifts[j + 1] = dy;
+    if (dst)
+      translateFrame(src, dst, h, w, -dx, -dy);
+  };
+  const unsigned int count = correctFrames(channel, first, last, fname, correct);
+
+  updateTransforms([&](TransformTable &table) {
+    table.setFrameTransforms(TransformType::kHaimanFFTTranslation, first,
+                             count, 1, 2, shifts);
+    if (rotation) {
+      table.setFrameTransforms(TransformType::kLogPolarRotation, first,
+                               count, 1, 2, rotations);
+    }
+  });
+  std::cout << "Registered " << count << " frames" << std::endl;
+  return count;
+}
+
+// the n_rows x n_cols matrices of T for frames first to first + n - 1
+// (1-indexed) one after the other and whether each frame has one
+static std::vector<double> getFrameTransforms(const TransformTable &table,
+                                              TransformType T,
+                                              unsigned int first,
+                                              unsigned int n,
+                                              std::vector<uint8_t> &present) {
+  const auto &column = table.column(T);
+  const std::size_t stride = column.stride();
+  present.assign(n, 0);
+  std::vector<double> values(n * stride, 0.0);
+  if (column.empty())
+    return values;
+  for (std::size_t row = 0; row < table.size(); ++row) {
+    const unsigned int frame = table.frame_indices[row] + 1;
+    if (frame < first || frame >= first + n || !column.present[row])
+      continue;
+    std::copy_n(column.values.begin() + row * stride, stride,
+                values.begin() + (frame - first) * stride);
+    present[frame - first] = 1;
+  }
+  return values;
+}
+
+unsigned int SITiffIO::registerPiecewise(unsigned int channel,
+                                         unsigned int first, unsigned int last,
+                                         const std::string &fname,
+                                         unsigned int patch_size,
+                                         double overlap,
+                                         unsigned int n_reference,
+                                         unsigned int max_shift) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int n_ref = std::clamp(n_reference, 1u, n_frames);
+  // the reference is made from the rigidly registered frames so it is
+  // as sharp as the patches it is compared with
+  const auto reference =
+      registrationReference(channel, first, first + n_ref - 1, 0);
+  PiecewiseRegistration registration(reference, patch_size, overlap,
+                                     max_shift);
+
+  std::vector<uint8_t> has_rotation, has_translation;
+  const auto rotations =
+      getFrameTransforms(*transforms, TransformType::kLogPolarRotation, first,
+                         n_frames, has_rotation);
+  const auto translations =
+      getFrameTransforms(*transforms, TransformType::kHaimanFFTTranslation,
+                         first, n_frames, has_translation);
+  std::unique_ptr<Derotator> derotator;
+  if (std::find(has_rotation.begin(), has_rotation.end(), 1) !=
+      has_rotation.end())
+    derotator = std::make_unique<Derotator>(h, w);
+
+  const std::size_t n_patches = registration.nPatches();
+  std::vector<double> shifts(2 * n_patches * n_frames, 0.0);
+  auto correct = [&](unsigned int frame, const int16_t *src, int16_t *dst) {
+    thread_local std::vector<int16_t> derotated, translated;
+    const std::size_t i = frame - first;
+    if (has_rotation[i]) {
+      derotated.resize(std::size_t(h) * w);
+      derotator->derotate(src, derotated.data(), rotations[2 * i]);
+      src = derotated.data();
+    }
+    if (has_translation[i]) {
+      translated.resize(std::size_t(h) * w);
+      translateFrame(src, translated.data(), h, w, -translations[2 * i],
+                     -translations[2 * i + 1]);
+      src = translated.data();
+    }
+    auto patch_shifts = registration.shifts(src);
+    std::copy(patch_shifts.begin(), patch_shifts.end(),
+              shifts.begin() + i * 2 * n_patches);
+    if (dst)
+      registration.warp(src, dst, patch_shifts);
+  };
+  const unsigned int count = correctFrames(channel, first, last, fname, correct);
+
+  updateTransforms([&](TransformTable &table) {
+    table.setFrameTransforms(TransformType::kHaimanPieceWiseMapping, first,
+                             count, n_patches, 2, shifts);
+  });
+  std::cout << "Registered " << count << " frames in " << n_patches
+            << " patches" << std::endl;
+  return count;
+}
+
+unsigned int
+SITiffIO::trackTemplates(const std::vector<std::array<unsigned int, 4>> &boxes,
+                         unsigned int channel, unsigned int first,
+                         unsigned int last, unsigned int search,
+                         unsigned int n_reference) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  if (getAllTransforms() == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  if (boxes.empty()) {
+    throw std::invalid_argument("There has to be at least one template");
+  }
+  channel = checkChannel(channel);
+  checkFrameRange(first, last);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int n_frames = last - first + 1;
+  const unsigned int n_ref = std::clamp(n_reference, 1u, n_frames);
+  const auto reference = std::get<0>(project(channel, first, first + n_ref - 1));
+  std::vector<TemplateTracker> trackers;
+  trackers.reserve(boxes.size());
+  std::vector<float> tmpl;
+  for (const auto &[x, y, bw, bh] : boxes) {
+    if (bw == 0 || bh == 0 || x + bw > w || y + bh > h) {
+      throw std::invalid_argument("The boxes have to fit inside the frame");
+    }
+    tmpl.resize(std::size_t(bw) * bh);
+    for (unsigned int r = 0; r < bh; ++r)
+      std::copy_n(reference.memptr() + std::size_t(y + r) * w + x, bw,
+                  tmpl.data() + std::size_t(r) * bw);
+    trackers.emplace_back(tmpl.data(), bh, bw, h, w, x, y, search);
+  }
+
+  const unsigned int nthreads = getNThreads();
+  const std::size_t n_boxes = boxes.size();
+  // (x, y) of every box for each frame, as kMultiTrackerTranslation
+  // matrices (column-major)
+  std::vector<double> shifts(2 * n_boxes * n_frames, 0.0);
+  std::vector<double> mean_shifts(2 * std::size_t(n_frames), 0.0);
+  auto track = [&](unsigned int start, std::vector<SourceFrame> &batch) {
+    // each template has to see the frames in order, so the parallelism is
+    // across the templates
+    parallelFor(
+        n_boxes,
+        [&](unsigned int, std::size_t begin, std::size_t end) {
+          for (std::size_t b = begin; b < end; ++b) {
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+              auto [dx, dy] = trackers[b].track(batch[i].img.memptr());
+              double *M = shifts.data() + (start - first + i) * 2 * n_boxes;
+              M[b] = dx;
+              M[n_boxes + b] = dy;
+            }
+          }
+        },
+        std::min<std::size_t>(nthreads, n_boxes));
+  };
+  const unsigned int count = readBatches(channel, first, last, false, track);
+  for (std::size_t i = 0; i < count; ++i) {
+    const double *M = shifts.data() + i * 2 * n_boxes;
+    for (std::size_t b = 0; b < n_boxes; ++b) {
+      mean_shifts[2 * i] += M[b] / n_boxes;
+      mean_shifts[2 * i + 1] += M[n_boxes + b] / n_boxes;
+    }
+  }
+
+  updateTransforms([&](TransformTable &table) {
+    table.setFrameTransforms(TransformType::kMultiTrackerTranslation, first,
+                             count, n_boxes, 2, shifts);
+    table.setFrameTransforms(TransformType::kTrackerTranslation, first, count,
+                             1, 2, mean_shifts);
+  });
+  std::cout << "Tracked " << n_boxes << " templates through " << count
+            << " frames" << std::endl;
+  return count;
+}
+
+} // namespace twophoton
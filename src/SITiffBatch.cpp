@@ -0,0 +1,359 @@
+/*
+sitiffbatch - runs the ScanImageTiffIO processing pipeline over every
+session found in a directory tree.
+
+A session is a ScanImage .tif file plus, optionally, the VR log file and
+rotary encoder file recorded alongside it in the same directory. The log
+and rotary files are told apart by their contents so they can be named
+anything. For each session the pipeline:
+
+  1. indexes the tiff file (counts frames/ channels)
+  2. aligns the frames to the log/ rotary data (SITiffIO::interpolateIndices)
+     and writes a per-frame table as csv
+  3. optionally splits the channels into separate tiff files
+  4. optionally exports each channel to a zlib compressed Zarr store
+  5. optionally writes mean and max projections of each channel
+
+Sessions run concurrently on a worker pool and share the threads and the
+memory budget between them.
+*/
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace twophoton;
+
+struct BatchOptions {
+  fs::path input;
+  fs::path output;
+  unsigned int jobs = 0;
+  unsigned int threads = 0;
+  std::size_t max_memory = std::size_t(4) << 30; // bytes
+  bool split = false;
+  int zarr_level = -1; // < 0 means don't export
+  bool project = false;
+};
+
+struct Session {
+  fs::path tiff;
+  fs::path log;
+  fs::path rotary;
+};
+
+static std::mutex print_mutex;
+
+static void report(const Session &session, const std::string &msg) {
+  std::lock_guard<std::mutex> lock(print_mutex);
+  std::cerr << "[" << session.tiff.filename().string() << "] " << msg
+            << std::endl;
+}
+
+static void usage() {
+  std::cerr
+      << "Usage: sitiffbatch [options] <directory>\n"
+         "\n"
+         "Processes every ScanImage .tif file (and the log/ rotary encoder\n"
+         "files next to it) found below <directory>.\n"
+         "\n"
+         "Options:\n"
+         "  -o, --output DIR       where to write the results (default:\n"
+         "                         <directory>_processed). The layout of the\n"
+         "                         input tree is mirrored\n"
+         "  -j, --jobs N           number of sessions to process at once\n"
+         "                         (default: threads / 4)\n"
+         "  -t, --threads N        total number of worker threads (default:\n"
+         "                         all hardware threads)\n"
+         "  -m, --max-memory MB    memory budget shared by all sessions\n"
+         "                         (default: 4096)\n"
+         "  --split                write each channel to its own tiff file\n"
+         "  --zarr [LEVEL]         export each channel to a Zarr store\n"
+         "                         compressed with zlib at LEVEL (default 1)\n"
+         "  --project              write mean and max projections\n"
+         "  -h, --help             show this message\n";
+}
+
+static bool parseArgs(int argc, char **argv, BatchOptions &opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto next = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::invalid_argument("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "-h" || arg == "--help")
+      return false;
+    else if (arg == "-o" || arg == "--output")
+      opts.output = next();
+    else if (arg == "-j" || arg == "--jobs")
+      opts.jobs = std::stoul(next());
+    else if (arg == "-t" || arg == "--threads")
+      opts.threads = std::stoul(next());
+    else if (arg == "-m" || arg == "--max-memory")
+      opts.max_memory = std::stoull(next()) << 20;
+    else if (arg == "--split")
+      opts.split = true;
+    else if (arg == "--zarr") {
+      opts.zarr_level = 1;
+      if (i + 1 < argc && std::isdigit(argv[i + 1][0]))
+        opts.zarr_level = std::stoi(argv[++i]);
+    } else if (arg == "--project")
+      opts.project = true;
+    else if (!arg.empty() && arg[0] == '-')
+      throw std::invalid_argument("Unknown option " + arg);
+    else
+      opts.input = arg;
+  }
+  return !opts.input.empty();
+}
+
+// Works out whether a text file is a VR log file or a rotary encoder file
+// from the first few kilobytes of it
+enum class TextFileType { kUnknown, kLog, kRotary };
+
+static TextFileType sniffTextFile(const fs::path &path) {
+  std::ifstream ifs(path, std::ios::binary);
+  std::string head(16384, '\0');
+  ifs.read(head.data(), head.size());
+  head.resize(ifs.gcount());
+  if (head.find(mouse_move_token) != std::string::npos)
+    return TextFileType::kLog;
+  if (head.find(rot_token) != std::string::npos)
+    return TextFileType::kRotary;
+  return TextFileType::kUnknown;
+}
+
+static std::size_t commonPrefix(const std::string &a, const std::string &b) {
+  auto mismatch = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+  return mismatch.first - a.begin();
+}
+
+// of the candidates, the one whose name shares the longest prefix with tiff
+static fs::path bestMatch(const fs::path &tiff,
+                          const std::vector<fs::path> &candidates) {
+  fs::path best;
+  std::size_t best_len = 0;
+  for (const auto &c : candidates) {
+    auto len = commonPrefix(tiff.stem().string(), c.stem().string());
+    if (best.empty() || len > best_len) {
+      best = c;
+      best_len = len;
+    }
+  }
+  return best;
+}
+
+static std::vector<Session> findSessions(const fs::path &root,
+                                         const fs::path &skip) {
+  std::map<fs::path, std::vector<fs::path>> tiffs, logs, rotaries;
+  for (auto it = fs::recursive_directory_iterator(root);
+       it != fs::recursive_directory_iterator(); ++it) {
+    // don't pick up our own output if it lives inside the input tree
+    if (it->is_directory() && fs::equivalent(it->path(), skip)) {
+      it.disable_recursion_pending();
+      continue;
+    }
+    if (!it->is_regular_file())
+      continue;
+    auto ext = it->path().extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    auto dir = it->path().parent_path();
+    if (ext == ".tif" || ext == ".tiff")
+      tiffs[dir].push_back(it->path());
+    else if (ext == ".txt" || ext == ".log") {
+      auto type = sniffTextFile(it->path());
+      if (type == TextFileType::kLog)
+        logs[dir].push_back(it->path());
+      else if (type == TextFileType::kRotary)
+        rotaries[dir].push_back(it->path());
+    }
+  }
+  std::vector<Session> sessions;
+  for (const auto &[dir, files] : tiffs) {
+    for (const auto &tiff : files) {
+      Session s;
+      s.tiff = tiff;
+      if (logs.count(dir))
+        s.log = bestMatch(tiff, logs[dir]);
+      if (rotaries.count(dir))
+        s.rotary = bestMatch(tiff, rotaries[dir]);
+      sessions.push_back(s);
+    }
+  }
+  return sessions;
+}
+
+static bool writeFrameTable(const SITiffIO &io, const fs::path &path) {
+  auto table = io.getAllTransforms();
+  if (table == nullptr)
+    return false;
+  std::ofstream ofs(path);
+  ofs << "frame,timestamp,x,z,theta\n";
+  for (std::size_t i = 0; i < table->size(); ++i)
+    ofs << table->frame_numbers[i] << "," << table->timestamps[i] << ","
+        << table->x[i] << "," << table->z[i] << "," << table->theta[i]
+        << "\n";
+  return ofs.good();
+}
+
+static bool writeProjections(SITiffIO &io, unsigned int channel,
+                             const fs::path &path) {
+  auto [mean, max] = io.project(channel);
+  arma::Mat<int16_t> mean16(mean.n_rows, mean.n_cols);
+  for (std::size_t i = 0; i < mean.n_elem; ++i)
+    mean16.memptr()[i] = static_cast<int16_t>(std::lround(mean.memptr()[i]));
+  SITiffWriter writer;
+  if (!writer.open(path.string()))
+    return false;
+  // a failed write closes the file itself
+  for (auto *img : {&mean16, &max}) {
+    if (!writer.write(*img, {}))
+      return false;
+  }
+  writer.close();
+  return true;
+}
+
+static bool processSession(const Session &session, const BatchOptions &opts,
+                           unsigned int threads, std::size_t memory) {
+  auto out_dir =
+      opts.output / fs::relative(session.tiff.parent_path(), opts.input);
+  fs::create_directories(out_dir);
+  const std::string stem = session.tiff.stem().string();
+
+  SITiffIO io;
+  io.setNThreads(threads);
+  if (!io.openTiff(session.tiff.string(), "r")) {
+    report(session, "could not open the tiff file");
+    return false;
+  }
+  const unsigned int nchans = std::get<0>(io.getNChannels());
+  const unsigned int nframes = io.countDirectories();
+  report(session, "indexed " + std::to_string(nframes) + " frames, " +
+                      std::to_string(nchans) + " channel(s)");
+
+  if (!session.log.empty() || !session.rotary.empty()) {
+    if (!session.log.empty())
+      io.openLog(session.log.string());
+    if (!session.rotary.empty())
+      io.openRotary(session.rotary.string());
+    io.interpolateIndices(0);
+    if (!writeFrameTable(io, out_dir / (stem + "_frames.csv"))) {
+      report(session, "could not write the frame table");
+      return false;
+    }
+    report(session, "aligned to the behavioural data");
+  }
+
+  if (opts.split) {
+    try {
+      io.splitChannels((out_dir / session.tiff.filename()).string());
+    } catch (const std::runtime_error &e) {
+      report(session, std::string("could not split the channels: ") +
+                          e.what());
+      return false;
+    }
+    report(session, "split the channels");
+  }
+
+  if (opts.zarr_level >= 0) {
+    auto [h, w] = io.getImageSize();
+    // keep the time-chunks of all the threads within the memory budget;
+    // each thread holds a time-chunk and a copy of it rearranged into chunks
+    const std::size_t frame_bytes = std::size_t(h) * w * sizeof(int16_t);
+    const unsigned int chunk_frames = std::clamp<std::size_t>(
+        memory / (2 * threads * std::max<std::size_t>(frame_bytes, 1)), 1, 64);
+    for (unsigned int c = 1; c <= nchans; ++c) {
+      if (!io.exportZarr(
+              (out_dir / (stem + "_chan" + std::to_string(c) + ".zarr"))
+                  .string(),
+              c, 1, 0, chunk_frames, 0, 0, opts.zarr_level)) {
+        report(session, "could not export channel " + std::to_string(c) +
+                            " to zarr");
+        return false;
+      }
+    }
+    report(session, "exported to zarr");
+  }
+
+  if (opts.project) {
+    for (unsigned int c = 1; c <= nchans; ++c) {
+      if (!writeProjections(io, c,
+                            out_dir / (stem + "_chan" + std::to_string(c) +
+                                       "_projections.tif"))) {
+        report(session, "could not write the projections of channel " +
+                            std::to_string(c));
+        return false;
+      }
+    }
+    report(session, "wrote the projections");
+  }
+  io.closeReaderTiff();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  BatchOptions opts;
+  try {
+    if (!parseArgs(argc, argv, opts)) {
+      usage();
+      return 1;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    usage();
+    return 1;
+  }
+  if (!fs::is_directory(opts.input)) {
+    std::cerr << opts.input << " is not a directory" << std::endl;
+    return 1;
+  }
+  opts.input = fs::canonical(opts.input);
+  if (opts.output.empty())
+    opts.output = opts.input.string() + "_processed";
+  fs::create_directories(opts.output);
+
+  if (opts.threads == 0)
+    opts.threads = std::max(1u, std::thread::hardware_concurrency());
+  if (opts.jobs == 0)
+    opts.jobs = std::max(1u, opts.threads / 4);
+  opts.jobs = std::min(opts.jobs, opts.threads);
+  // the threads and memory are split evenly between the concurrent sessions
+  const unsigned int threads_per_session = opts.threads / opts.jobs;
+  const std::size_t memory_per_session = opts.max_memory / opts.jobs;
+
+  auto sessions = findSessions(opts.input, opts.output);
+  std::cerr << "Found " << sessions.size() << " session(s) in "
+            << opts.input.string() << std::endl;
+
+  WorkerPool pool(opts.jobs);
+  std::vector<std::future<bool>> results;
+  for (const auto &session : sessions) {
+    results.push_back(pool.submit([&, session]() {
+      try {
+        return processSession(session, opts, threads_per_session,
+                              memory_per_session);
+      } catch (const std::exception &e) {
+        report(session, std::string("failed: ") + e.what());
+        return false;
+      }
+    }));
+  }
+  unsigned int failed = 0;
+  for (auto &result : results)
+    failed += result.get() ? 0 : 1;
+  std::cerr << "Processed " << sessions.size() - failed << " of "
+            << sessions.size() << " session(s)" << std::endl;
+  return failed == 0 ? 0 : 1;
+}
@@ -2,10 +2,13 @@
 #include "../include/ScanImageTiff_version.h"
 #include "carma_bits/converters.h"
 #include "tiffio.h"
+#include <array>
 #include <cstdint>
 #include <filesystem>
+#include <future>
 #include <limits>
 #include <memory>
+#include <numeric>
 #include <stdexcept>
 #include <stdio.h>
 #include <string>
@@ -56,6 +59,7 @@ void SITiffHeader::versionCheck(TIFF *m_tif) {
         channelNames = "SI.hChannels.channelName =";
         frameString = "frameNumbers =";
         frameTimeStamp = "frameTimestamps_sec =";
+        linePeriod = "SI.hRoiManager.linePeriod =";
       }
 
       uint32_t length;
@@ -111,6 +115,20 @@ std::string SITiffHeader::getSoftwareTag(TIFF *m_tif, unsigned int dirnum) {
   return std::string();
 }
 
+double SITiffHeader::getLinePeriod(TIFF *m_tif) {
+  if (m_tif == nullptr || linePeriod.empty())
+    return 0;
+  if (TIFFSetDirectory(m_tif, 0) != 1)
+    return 0;
+  char *swTag;
+  if (TIFFGetField(m_tif, TIFFTAG_SOFTWARE, &swTag) != 1)
+    return 0;
+  auto value = grabStr(swTag, linePeriod);
+  if (value.empty())
+    return 0;
+  return std::strtod(value.c_str(), nullptr);
+}
+
 std::string SITiffHeader::getImageDescTag(TIFF *m_tif, unsigned int dirnum) {
   if (m_tif) {
     if (TIFFSetDirectory(m_tif, dirnum) == 1) {
@@ -293,6 +311,7 @@ SITiffReader::~SITiffReader() {
     delete headerdata;
 }
 bool SITiffReader::open() {
+  std::lock_guard<std::mutex> lock(m_mutex);
   m_tif = TIFFOpen(m_filename.c_str(), "r");
   if (m_tif) {
     headerdata = new SITiffHeader{this};
@@ -306,6 +325,7 @@ bool SITiffReader::open() {
 }
 
 bool SITiffReader::readheader() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
   if (m_tif) {
     std::string softwareTag = headerdata->getSoftwareTag(m_tif);
     return true;
@@ -314,6 +334,7 @@ bool SITiffReader::readheader() const {
 }
 
 std::vector<double> SITiffReader::getAllTimeStamps() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
   if (m_tif) {
     std::cout << "Starting scraping timestamps..." << std::endl;
     if (TIFFSetDirectory(m_tif, 0) == 1) {
@@ -331,12 +352,17 @@ std::vector<double> SITiffReader::getAllTimeStamps() const {
 void SITiffReader::getFrameNumAndTimeStamp(const unsigned int dirnum,
                                            unsigned int &framenum,
                                            double &timestamp) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
   if (m_tif) {
     // strings to grab from the header
     const std::string frameNumberString = headerdata->getFrameNumberString();
     const std::string frameTimeStampString =
         headerdata->getFrameTimeStampString();
-    std::string imdescTag = headerdata->getImageDescTag(m_tif, dirnum);
+    if (!seekDirectory(dirnum))
+      return;
+    char *tag;
+    std::string imdescTag =
+        TIFFGetField(m_tif, TIFFTAG_IMAGEDESCRIPTION, &tag) == 1 ? tag : "";
     std::string frameN;
     std::string ts;
     frameN = grabStr(imdescTag, frameNumberString);
@@ -347,6 +373,7 @@ void SITiffReader::getFrameNumAndTimeStamp(const unsigned int dirnum,
 }
 
 arma::Mat<int16_t> SITiffReader::readframe(int framedir) {
+  std::lock_guard<std::mutex> lock(m_mutex);
   if (m_tif) {
     int framenum = framedir;
     /*
@@ -359,7 +386,7 @@ arma::Mat<int16_t> SITiffReader::readframe(int framedir) {
     NB This differs from the 1-based indexing for framenumbers that ScanImage
     uses (fucking Matlab)
     */
-    if (TIFFSetDirectory(m_tif, framenum) == 0)
+    if (!seekDirectory(framenum))
       return arma::Mat<int16_t>();
     else {
       uint32_t w = 0, h = 0;
@@ -398,13 +425,16 @@ arma::Mat<int16_t> SITiffReader::readframe(int framedir) {
           int tileidx = 0;
 
           // ********* return frame created here ***********
+          // the rows are laid out one after another (row-major) in the
+          // h x w matrix's buffer, the order the numpy side expects
           arma::Mat<int16_t> frame(h, w, arma::fill::zeros);
           tdata_t buf = _TIFFmalloc(TIFFScanlineSize(m_tif));
           uint32 row;
           auto slsz = TIFFScanlineSize(m_tif);
           for (row = 0; row < h; row++) {
             TIFFReadScanline(m_tif, buf, row);
-            std::memcpy(frame.colptr(row), (int16_t *)buf, slsz);
+            std::memcpy(frame.memptr() + std::size_t(row) * w, (int16_t *)buf,
+                        slsz);
           }
           _TIFFfree(buf);
           return std::move(frame);
@@ -415,17 +445,160 @@ arma::Mat<int16_t> SITiffReader::readframe(int framedir) {
   return arma::Mat<int16_t>();
 }
 
+bool SITiffReader::readRows(unsigned int dirnum, unsigned int row_begin,
+                            unsigned int row_end, int16_t *dst) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_tif || !seekDirectory(dirnum))
+    return false;
+  uint32_t w = 0, h = 0;
+  if (!TIFFGetField(m_tif, TIFFTAG_IMAGEWIDTH, &w) ||
+      !TIFFGetField(m_tif, TIFFTAG_IMAGELENGTH, &h))
+    return false;
+  if (w != m_imagewidth || row_begin > row_end || row_end > h ||
+      TIFFScanlineSize(m_tif) != tmsize_t(w * sizeof(int16_t)))
+    return false;
+  // the scanlines are decoded straight into dst
+  for (uint32_t row = row_begin; row < row_end; ++row) {
+    int16_t *line = dst + std::size_t(row - row_begin) * w;
+    if (TIFFReadScanline(m_tif, line, row) < 0)
+      return false;
+  }
+  return true;
+}
+
+int SITiffReader::countDirectories() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::error_code ec;
+  auto file_size = fs::file_size(m_filename, ec);
+  if (m_ndirs > 0 && !ec && file_size == m_ndirs_file_size)
+    return m_ndirs;
+  m_ndirs = headerdata->countDirectories(m_tif);
+  m_ndirs_file_size = ec ? 0 : file_size;
+  return m_ndirs;
+}
+
+bool SITiffReader::seekDirectory(unsigned int dirnum) const {
+  auto current = TIFFCurrentDirectory(m_tif);
+  if (dirnum == current)
+    return true;
+  // a short hop forward (e.g. skipping the other channels) is cheaper
+  // done by reading the next directories than with TIFFSetDirectory
+  if (dirnum > current && dirnum - current <= 8) {
+    while (TIFFCurrentDirectory(m_tif) < dirnum) {
+      if (TIFFReadDirectory(m_tif) != 1)
+        return false;
+    }
+    return true;
+  }
+  return TIFFSetDirectory(m_tif, dirnum) == 1;
+}
+
+bool SITiffReader::readRawDirectory(unsigned int dirnum, RawDirectory &dir) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_tif)
+    return false;
+  if (!seekDirectory(dirnum))
+    return false;
+  // scanimage only ever writes strips
+  if (TIFFIsTiled(m_tif))
+    return false;
+  if (!TIFFGetField(m_tif, TIFFTAG_IMAGEWIDTH, &dir.width) ||
+      !TIFFGetField(m_tif, TIFFTAG_IMAGELENGTH, &dir.length))
+    return false;
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_ROWSPERSTRIP, &dir.rowsperstrip);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_BITSPERSAMPLE, &dir.bitspersample);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_SAMPLESPERPIXEL, &dir.samplesperpixel);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_COMPRESSION, &dir.compression);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_PLANARCONFIG, &dir.planarconfig);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_SAMPLEFORMAT, &dir.sampleformat);
+  TIFFGetFieldDefaulted(m_tif, TIFFTAG_RESOLUTIONUNIT, &dir.resolutionunit);
+  if (!TIFFGetField(m_tif, TIFFTAG_PHOTOMETRIC, &dir.photometric))
+    dir.photometric = PHOTOMETRIC_MINISBLACK;
+  if (!TIFFGetField(m_tif, TIFFTAG_XRESOLUTION, &dir.xresolution))
+    dir.xresolution = 0;
+  if (!TIFFGetField(m_tif, TIFFTAG_YRESOLUTION, &dir.yresolution))
+    dir.yresolution = 0;
+  dir.predictor = 1;
+  if (dir.compression != COMPRESSION_NONE)
+    TIFFGetField(m_tif, TIFFTAG_PREDICTOR, &dir.predictor);
+
+  char *tag;
+  dir.swTag = TIFFGetField(m_tif, TIFFTAG_SOFTWARE, &tag) == 1 ? tag : "";
+  dir.imDescTag =
+      TIFFGetField(m_tif, TIFFTAG_IMAGEDESCRIPTION, &tag) == 1 ? tag : "";
+  dir.artistTag = TIFFGetField(m_tif, TIFFTAG_ARTIST, &tag) == 1 ? tag : "";
+
+  uint64_t *bytecounts = nullptr;
+  if (!TIFFGetField(m_tif, TIFFTAG_STRIPBYTECOUNTS, &bytecounts))
+    return false;
+  auto nstrips = TIFFNumberOfStrips(m_tif);
+  dir.strip_sizes.assign(bytecounts, bytecounts + nstrips);
+  dir.strip_data.resize(std::accumulate(dir.strip_sizes.cbegin(),
+                                        dir.strip_sizes.cend(), uint64_t{0}));
+  uint64_t offset = 0;
+  for (uint32_t strip = 0; strip < nstrips; ++strip) {
+    auto size = static_cast<tmsize_t>(dir.strip_sizes[strip]);
+    if (TIFFReadRawStrip(m_tif, strip, dir.strip_data.data() + offset,
+                         size) != size)
+      return false;
+    offset += size;
+  }
+  return true;
+}
+
+bool SITiffReader::readTags(unsigned int dirnum, std::string &swTag,
+                            std::string &imDescTag) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_tif || !seekDirectory(dirnum))
+    return false;
+  char *tag;
+  swTag = TIFFGetField(m_tif, TIFFTAG_SOFTWARE, &tag) == 1 ? tag : "";
+  imDescTag = TIFFGetField(m_tif, TIFFTAG_IMAGEDESCRIPTION, &tag) == 1 ? tag : "";
+  return true;
+}
+
 bool SITiffReader::close() {
+  std::lock_guard<std::mutex> lock(m_mutex);
   if (m_tif) {
     TIFFClose(m_tif);
     m_tif = NULL;
     isopened = false;
+    m_ndirs = -1;
     if (headerdata)
       delete headerdata;
+    headerdata = nullptr;
     return true;
   }
   return false;
 }
+
+/* -----------------------------------------------------------
+class SITiffReaderPool
+------------------------------------------------------------*/
+SITiffReaderPool::Lease SITiffReaderPool::acquire() {
+  std::unique_ptr<SITiffReader> reader;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_idle.empty()) {
+      reader = std::move(m_idle.back());
+      m_idle.pop_back();
+    }
+  }
+  if (!reader) {
+    reader = std::make_unique<SITiffReader>(m_filename);
+    if (!reader->open()) {
+      throw std::runtime_error("Could not open " + m_filename);
+    }
+  }
+  auto self = shared_from_this();
+  return Lease(reader.release(),
+               [self](SITiffReader *r) { self->release(r); });
+}
+
+void SITiffReaderPool::release(SITiffReader *reader) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_idle.emplace_back(reader);
+}
 // ######################################################################
 // ################## Tiff encoder class ################################
 // ######################################################################
@@ -493,12 +666,14 @@ bool SITiffWriter::writeLibTiff(arma::Mat<int16_t> &img,
       !TIFFSetField(pTiffHandle, TIFFTAG_SAMPLEFORMAT, sampleformat) ||
       !TIFFSetField(pTiffHandle, TIFFTAG_ORIENTATION, orientation)) {
     TIFFClose(pTiffHandle);
+    opened = false;
     return false;
   }
 
   if (compression != COMPRESSION_NONE &&
       !TIFFSetField(pTiffHandle, TIFFTAG_PREDICTOR, predictor)) {
     TIFFClose(pTiffHandle);
+    opened = false;
     return false;
   }
 
@@ -506,6 +681,7 @@ bool SITiffWriter::writeLibTiff(arma::Mat<int16_t> &img,
 
   if (!data) {
     TIFFClose(pTiffHandle);
+    opened = false;
     return false;
   }
   size_t scanlineSize = TIFFScanlineSize(pTiffHandle);
@@ -513,7 +689,8 @@ bool SITiffWriter::writeLibTiff(arma::Mat<int16_t> &img,
   tdata_t buf = _TIFFmalloc(scanlineSize);
 
   for (int y = 0; y < height; ++y) {
-    std::memcpy((int16_t *)buf, img.colptr(y), scanlineSize);
+    std::memcpy((int16_t *)buf, img.memptr() + std::size_t(y) * width,
+                scanlineSize);
     int writeResult = TIFFWriteScanline(pTiffHandle, buf, y, 0);
     if (writeResult != 1) {
       TIFFClose(pTiffHandle);
@@ -568,6 +745,66 @@ std::string SITiffWriter::modifyChannel(std::string &src_str,
   return whole_target;
 }
 
+std::string
+SITiffWriter::modifyChannel(std::string &src_str,
+                            const std::vector<unsigned int> &chans2keep) {
+  if (chans2keep.size() == 1)
+    return modifyChannel(src_str, chans2keep.front());
+  // more than one channel is saved as a matlab style array i.e. [1;3]
+  std::string chans = "[";
+  for (unsigned int i = 0; i < chans2keep.size(); ++i) {
+    if (i > 0)
+      chans += ";";
+    chans += std::to_string(chans2keep[i]);
+  }
+  chans += "]";
+  std::string target = "SI.hChannels.channelSave = ";
+  std::string whole_target = target + grabStr(src_str, target);
+  auto loc = src_str.find(target);
+  if (loc != std::string::npos) {
+    src_str.replace(loc, whole_target.size(), target + chans);
+  }
+  return whole_target;
+}
+
+bool SITiffWriter::writeRawDirectory(RawDirectory &dir) {
+  if (!(isOpened()) || !m_tif)
+    return false;
+  if (!TIFFSetField(m_tif, TIFFTAG_IMAGEWIDTH, dir.width) ||
+      !TIFFSetField(m_tif, TIFFTAG_IMAGELENGTH, dir.length) ||
+      !TIFFSetField(m_tif, TIFFTAG_BITSPERSAMPLE, dir.bitspersample) ||
+      !TIFFSetField(m_tif, TIFFTAG_SAMPLESPERPIXEL, dir.samplesperpixel) ||
+      !TIFFSetField(m_tif, TIFFTAG_COMPRESSION, dir.compression) ||
+      !TIFFSetField(m_tif, TIFFTAG_PHOTOMETRIC, dir.photometric) ||
+      !TIFFSetField(m_tif, TIFFTAG_PLANARCONFIG, dir.planarconfig) ||
+      !TIFFSetField(m_tif, TIFFTAG_ROWSPERSTRIP, dir.rowsperstrip) ||
+      !TIFFSetField(m_tif, TIFFTAG_SAMPLEFORMAT, dir.sampleformat))
+    return false;
+  if (dir.compression != COMPRESSION_NONE)
+    TIFFSetField(m_tif, TIFFTAG_PREDICTOR, dir.predictor);
+  if (dir.xresolution > 0 && dir.yresolution > 0) {
+    TIFFSetField(m_tif, TIFFTAG_RESOLUTIONUNIT, dir.resolutionunit);
+    TIFFSetField(m_tif, TIFFTAG_XRESOLUTION, dir.xresolution);
+    TIFFSetField(m_tif, TIFFTAG_YRESOLUTION, dir.yresolution);
+  }
+  if (!dir.swTag.empty())
+    TIFFSetField(m_tif, TIFFTAG_SOFTWARE, dir.swTag.c_str());
+  if (!dir.imDescTag.empty())
+    TIFFSetField(m_tif, TIFFTAG_IMAGEDESCRIPTION, dir.imDescTag.c_str());
+  if (!dir.artistTag.empty())
+    TIFFSetField(m_tif, TIFFTAG_ARTIST, dir.artistTag.c_str());
+
+  uint64_t offset = 0;
+  for (uint32_t strip = 0; strip < dir.strip_sizes.size(); ++strip) {
+    auto size = static_cast<tmsize_t>(dir.strip_sizes[strip]);
+    if (TIFFWriteRawStrip(m_tif, strip, dir.strip_data.data() + offset,
+                          size) != size)
+      return false;
+    offset += size;
+  }
+  return TIFFWriteDirectory(m_tif) == 1;
+}
+
 bool SITiffWriter::write(arma::Mat<int16_t> &img,
                          const std::vector<int> &params) {
   return writeLibTiff(img, params);
@@ -584,6 +821,8 @@ bool SITiffWriter::open(std::string outputPath) {
     // IMPORTANT: Note the "w8" option here - this is what allows writing to the
     // bigTIFF format possible ('normal' tiff would be just "w")
     m_tif = TIFFOpen(outputPath.c_str(), "w8");
+    if (m_tif == nullptr)
+      return false;
     m_filename = outputPath;
     opened = true;
   }
@@ -608,7 +847,14 @@ void SITiffWriter::operator<<(arma::Mat<int16_t> &frame) {
 /  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
  ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
 
-SITiffIO::~SITiffIO() {}
+SITiffIO::~SITiffIO() {
+  // queued async calls are finished first; they take the GIL to hand over
+  // their results so it mustn't be held while waiting for them
+  if (m_async_workers && PyGILState_Check()) {
+    py::gil_scoped_release release;
+    m_async_workers.reset();
+  }
+}
 
 bool SITiffIO::openTiff(const std::string &fname, const std::string mode) {
 
@@ -616,6 +862,9 @@ bool SITiffIO::openTiff(const std::string &fname, const std::string mode) {
     if (TiffReader)
       TiffReader.reset();
     TiffReader = std::make_shared<SITiffReader>(fname);
+    m_readers = std::make_shared<SITiffReaderPool>(fname);
+    m_frame_index = nullptr;
+    m_line_period = 0;
     if (TiffReader->open()) {
       TiffReader->getSWTag(0); // ensures num channels are read
       auto chans = TiffReader->getSavedChans();
@@ -642,6 +891,7 @@ bool SITiffIO::closeReaderTiff() {
   if (TiffReader->isOpen()) {
     TiffReader->close();
     // TiffReader = nullptr;
+    m_readers = nullptr;
     return true;
   }
   return false;
@@ -670,10 +920,14 @@ bool SITiffIO::openRotary(std::string fname) {
 }
 
 py::array_t<int16_t> SITiffIO::readFrame(int frame_num) {
-  if (TiffReader != nullptr) {
+  if (TiffReader != nullptr && m_readers != nullptr) {
     int dir_to_read = (frame_num * m_nchans - (m_nchans - channel2display)) - 1;
-    auto F = TiffReader->readframe(dir_to_read);
-    std::cout << "got readframe result" << std::endl;
+    arma::Mat<int16_t> F;
+    {
+      // decode with a reader of our own so other threads can read too
+      py::gil_scoped_release release;
+      F = m_readers->acquire()->readframe(dir_to_read);
+    }
     return carma::mat_to_arr(F, true);
   }
   return py::array_t<int16_t>();
@@ -699,26 +953,24 @@ void SITiffIO::writeFrame(py::array_t<int16_t> frame,
 
 std::tuple<double, double, double>
 SITiffIO::getPos(const unsigned int i) const {
-  auto search = m_all_transforms->find(i);
-  if (search != m_all_transforms->end()) {
-    auto transform_container = search->second;
-    double x, z, r;
-    transform_container.getPosData(x, z, r);
-    return std::make_tuple(x, z, r);
+  if (auto transforms = getAllTransforms()) {
+    const auto &table = *transforms;
+    auto row = table.find(i);
+    if (row < table.size())
+      return std::make_tuple(table.x[row], table.z[row], table.theta[row]);
   }
   return std::make_tuple(0, 0, 0);
 }
 
 std::tuple<double, double>
 SITiffIO::getTrackerTranslation(const unsigned int i) const {
-  auto search = m_all_transforms->find(i);
-  if (search != m_all_transforms->end()) {
-    auto transform_container = search->second;
-    auto T =
-        transform_container.getTransform(TransformType::kTrackerTranslation);
-    double x_move = T.at(0, 0);
-    double y_move = T.at(0, 1);
-    return std::make_tuple(x_move, y_move);
+  if (auto transforms = getAllTransforms()) {
+    const auto &table = *transforms;
+    auto row = table.find(i);
+    if (table.hasTransform(TransformType::kTrackerTranslation, row)) {
+      auto T = table.getTransform(TransformType::kTrackerTranslation, row);
+      return std::make_tuple(T.at(0, 0), T.at(0, 1));
+    }
   }
   return std::make_tuple(0, 0);
 }
@@ -726,15 +978,17 @@ SITiffIO::getTrackerTranslation(const unsigned int i) const {
 std::tuple<std::vector<double>, std::vector<double>>
 SITiffIO::getAllTrackerTranslation() const {
   std::vector<double> _x, _y;
-  if (!m_all_transforms)
+  auto transforms = getAllTransforms();
+  if (!transforms)
     return std::make_tuple(_x, _y);
-  for (auto const &T : *m_all_transforms) {
-    auto transform_container = T.second;
-    if (transform_container.hasTransform(TransformType::kTrackerTranslation)) {
-      auto M =
-          transform_container.getTransform(TransformType::kTrackerTranslation);
-      _x.push_back(M.at(0, 0));
-      _y.push_back(M.at(0, 1));
+  const auto &table = *transforms;
+  const auto &column = table.column(TransformType::kTrackerTranslation);
+  for (std::size_t row = 0; row < table.size(); ++row) {
+    if (table.hasTransform(TransformType::kTrackerTranslation, row)) {
+      // the matrices are column-major so (0, 1) is n_rows along
+      const double *M = column.values.data() + row * column.stride();
+      _x.push_back(M[0]);
+      _y.push_back(M[column.n_rows]);
     }
   }
   return std::make_tuple(_x, _y);
@@ -761,148 +1015,105 @@ void SITiffIO::interpolateIndices(const int &startFrame = 0) {
     std::cout << "WARNING: Rotary file is not loaded" << std::endl;
   }
 
-  int endFrame = TiffReader->countDirectories();
-  endFrame /= m_nchans;
+  auto frame_index = getFrameIndex();
+  const auto &index = *frame_index;
+  const std::size_t endFrame = index.size();
   std::cout << "Counted " << endFrame << " frames" << std::endl;
-  TiffReader->readheader(); // to get the number of channels...
-  auto nchans = TiffReader->getSavedChans().size();
-
-  double tiff_ts = 0, x = 0, orig_x = 0, z = 0, orig_z = 0, r = 0;
-  unsigned int frame_num = 0;
-  int logfile_idx = 0, rotary_idx = 0;
-  TransformContainer tc{};
-
-  if (m_all_transforms == nullptr)
-    m_all_transforms =
-        std::make_shared<std::map<unsigned int, TransformContainer>>();
-  else
-    m_all_transforms->clear();
+  const std::size_t first = std::min<std::size_t>(startFrame / m_nchans, endFrame);
+  const std::size_t n = endFrame - first;
+  std::span<const double> frame_times =
+      std::span<const double>(index.timestamps).subspan(first);
 
+  // resample the behavioural data at the frame times, all in seconds
+  // from the start of the acquisition
   auto tiff_acquisition_start = getEpochTime();
-
-  for (int i = startFrame; i < endFrame * nchans; i += nchans) {
-    TiffReader->getFrameNumAndTimeStamp(i, frame_num, tiff_ts);
-    auto chrono_time = tiff_ts * 1000000 * 1us;
-    auto int_chrono =
-        std::chrono::duration_cast<std::chrono::microseconds>(chrono_time);
-    auto frame_time = tiff_acquisition_start + int_chrono;
-    if (LogLoader) {
-      logfile_idx = findNearestIdx(LogLoader->getPTimes(), frame_time);
-      x = LogLoader->getXTranslation(logfile_idx);
-      orig_x = LogLoader->getRawXTranslation(logfile_idx);
-      z = LogLoader->getZTranslation(logfile_idx);
-      orig_z = LogLoader->getRawZTranslation(logfile_idx);
-      r = LogLoader->getRadianRotation(logfile_idx);
-    }
-    if (RotaryLoader) {
-      rotary_idx = findNearestIdx(RotaryLoader->getPTimes(), frame_time);
-      r = RotaryLoader->getRadianRotation(rotary_idx);
-    }
-    tc.m_framenumber = (int)(i / nchans);
-    tc.m_timestamp = tiff_ts;
-    tc.setPosData(x, z, r);
-    tc.setOrigPosData(orig_x, orig_z, r);
-    arma::mat A(1, 1);
-    A = {r};
-    tc.addTransform(TransformType::kInitialRotation, A);
-    auto transform_map = m_all_transforms.get();
-    transform_map->emplace(frame_num, tc);
+  std::vector<double> x(n, 0.0), orig_x(n, 0.0), z(n, 0.0), orig_z(n, 0.0);
+  std::vector<double> r(n, 0.0);
+  if (LogLoader) {
+    auto bracket = bracketTimes(
+        secondsSince(LogLoader->getPTimes(), tiff_acquisition_start),
+        frame_times);
+    x = interpolateLinear(LogLoader->getX(), bracket);
+    orig_x = interpolateLinear(LogLoader->getRawX(), bracket);
+    z = interpolateLinear(LogLoader->getZ(), bracket);
+    orig_z = interpolateLinear(LogLoader->getRawZ(), bracket);
+    r = interpolateAngle(LogLoader->getTheta(), bracket);
   }
+  if (RotaryLoader) {
+    auto bracket = bracketTimes(
+        secondsSince(RotaryLoader->getPTimes(), tiff_acquisition_start),
+        frame_times);
+    r = interpolateAngle(RotaryLoader->getTheta(), bracket);
+  }
+
+  // a new table rather than clearing the old one so numpy views of it
+  // stay valid
+  auto table = std::make_shared<TransformTable>();
+  table->frame_numbers.assign(index.frame_numbers.begin() + first,
+                              index.frame_numbers.end());
+  table->frame_indices.resize(n);
+  for (std::size_t i = 0; i < n; ++i)
+    table->frame_indices[i] = first + i;
+  table->timestamps.assign(frame_times.begin(), frame_times.end());
+  table->theta = r;
+  table->x = std::move(x);
+  table->z = std::move(z);
+  table->raw_x = std::move(orig_x);
+  table->raw_z = std::move(orig_z);
+  table->setTransforms(TransformType::kInitialRotation, 1, 1, std::move(r));
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_all_transforms = std::move(table);
 }
 
 std::vector<double> SITiffIO::getTiffTimeStamps() const {
-  // m_all_transforms is populated in interpolateIndices() above
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      result.push_back(tc.m_timestamp);
-    }
-  }
-  return result;
+  // the table is populated in interpolateIndices() above
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->timestamps;
 }
 
 std::vector<double> SITiffIO::getX() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    double x, z, t;
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      tc.getPosData(x, z, t);
-      result.push_back(x);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->x;
 }
 
 std::vector<double> SITiffIO::getZ() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    double x, z, t;
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      tc.getPosData(x, z, t);
-      result.push_back(z);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->z;
 }
 
 std::vector<double> SITiffIO::getRawX() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    double x, z, t;
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      tc.getOrigPosData(x, z, t);
-      result.push_back(x);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->raw_x;
 }
 
 std::vector<double> SITiffIO::getRawZ() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    double x, z, t;
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      tc.getOrigPosData(x, z, t);
-      result.push_back(z);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->raw_z;
 }
 
 std::vector<double> SITiffIO::getTheta() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    double x, z, t;
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto tc = it->second;
-      tc.getPosData(x, z, t);
-      result.push_back(t);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  return transforms->theta;
 }
 
 std::vector<double> SITiffIO::getFrameNumbers() const {
-  std::vector<double> result;
-  if (m_all_transforms != nullptr) {
-    for (auto it = m_all_transforms->cbegin(); it != m_all_transforms->cend();
-         ++it) {
-      auto f = it->first;
-      result.push_back(f);
-    }
-  }
-  return result;
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr)
+    return std::vector<double>();
+  const auto &frames = transforms->frame_numbers;
+  return std::vector<double>(frames.begin(), frames.end());
 }
 
 std::string SITiffIO::getSWTag(const int &n) const {
@@ -914,11 +1125,68 @@ std::string SITiffIO::getImageDescTag(const int &n) const {
 }
 
 std::vector<ptime> SITiffIO::getLogFileTimes() const {
-  return LogLoader->getPTimes();
+  auto times = LogLoader->getPTimes();
+  return std::vector<ptime>(times.begin(), times.end());
 }
 
 std::vector<ptime> SITiffIO::getRotaryTimes() const {
-  return RotaryLoader->getPTimes();
+  auto times = RotaryLoader->getPTimes();
+  return std::vector<ptime>(times.begin(), times.end());
+}
+
+// A read-only numpy array over column rather than a copy of it. The array
+// holds a reference to owner so the memory stays valid while it exists
+template <typename T>
+static py::array_t<T> columnView(std::span<const T> column,
+                                 std::shared_ptr<const void> owner) {
+  py::capsule base(new std::shared_ptr<const void>(std::move(owner)),
+                   [](void *p) {
+                     delete static_cast<std::shared_ptr<const void> *>(p);
+                   });
+  py::array_t<T> view(column.size(), column.data(), base);
+  view.attr("setflags")(false);
+  return view;
+}
+
+py::dict SITiffIO::getLogData() const {
+  if (LogLoader == nullptr) {
+    throw std::invalid_argument("No log file loaded");
+  }
+  py::dict data;
+  data["time"] = columnView(LogLoader->getTimes(), LogLoader);
+  data["x"] = columnView(LogLoader->getX(), LogLoader);
+  data["z"] = columnView(LogLoader->getZ(), LogLoader);
+  data["raw_x"] = columnView(LogLoader->getRawX(), LogLoader);
+  data["raw_z"] = columnView(LogLoader->getRawZ(), LogLoader);
+  data["theta"] = columnView(LogLoader->getTheta(), LogLoader);
+  return data;
+}
+
+py::dict SITiffIO::getRotaryData() const {
+  if (RotaryLoader == nullptr) {
+    throw std::invalid_argument("No rotary encoder file loaded");
+  }
+  py::dict data;
+  data["time"] = columnView(RotaryLoader->getTimes(), RotaryLoader);
+  data["theta"] = columnView(RotaryLoader->getTheta(), RotaryLoader);
+  return data;
+}
+
+py::dict SITiffIO::getFrameTable() const {
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  const auto &table = *transforms;
+  py::dict data;
+  data["frame"] = columnView<unsigned int>(table.frame_numbers, transforms);
+  data["timestamp"] = columnView<double>(table.timestamps, transforms);
+  data["x"] = columnView<double>(table.x, transforms);
+  data["z"] = columnView<double>(table.z, transforms);
+  data["raw_x"] = columnView<double>(table.raw_x, transforms);
+  data["raw_z"] = columnView<double>(table.raw_z, transforms);
+  data["theta"] = columnView<double>(table.theta, transforms);
+  return data;
 }
 
 ptime SITiffIO::getLogFileTriggerTime() const {
@@ -935,6 +1203,13 @@ ptime SITiffIO::getEpochTime() const { return TiffReader->getEpochTime(); }
 
 std::tuple<unsigned int> SITiffIO::getNChannels() const { return m_nchans; }
 
+std::tuple<unsigned int, unsigned int> SITiffIO::getImageSize() const {
+  unsigned int h = 0, w = 0;
+  if (TiffReader != nullptr)
+    TiffReader->getImageSize(h, w);
+  return std::make_tuple(h, w);
+}
+
 std::pair<int, int> SITiffIO::getChannelLUT() {
   if (TiffReader == nullptr) {
     std::cout << "Tiff not opened/available" << std::endl;
@@ -962,15 +1237,20 @@ SITiffIO::tail(const int &n) {
   unsigned int w, h;
   TiffReader->getImageSize(h, w);
   arma::Cube<int16_t> result(n, h, w);
-  int row_count = 0;
-  for (size_t i = n_frames - n; i < n_frames; i++) {
-    int dir_to_read = (i * m_nchans - (m_nchans - channel2display)) - 1;
-    auto F = TiffReader->readframe(dir_to_read);
-    result.row(row_count) = F;
-    ++row_count;
-  }
-  interpolateIndices(n_frames - n);
-  auto angles = getTheta();
+  std::vector<double> angles;
+  {
+    py::gil_scoped_release release;
+    auto reader = m_readers->acquire();
+    int row_count = 0;
+    for (size_t i = n_frames - n; i < n_frames; i++) {
+      int dir_to_read = (i * m_nchans - (m_nchans - channel2display)) - 1;
+      auto F = reader->readframe(dir_to_read);
+      result.row(row_count) = F;
+      ++row_count;
+    }
+    interpolateIndices(n_frames - n);
+    angles = getTheta();
+  }
   return std::make_tuple(carma::cube_to_arr(result), angles);
 }
 
@@ -978,7 +1258,12 @@ void SITiffIO::saveTiffTail(const int &n = 1000, std::string fname = "") {
   // saves the last n frames of the tiff file currently
   // open for reading
   if (TiffReader == nullptr) {
-    std::invalid_argument("No file open for reading!");
+    throw std::invalid_argument("No file open for reading!");
+  }
+  int n_frames = countDirectories();
+  if ((n_frames - n) <= 0) {
+    throw std::invalid_argument(
+        "n minus the total number of frames must be > 0");
   }
   std::string new_name = "";
   if (!TiffWriter) {
@@ -992,25 +1277,287 @@ void SITiffIO::saveTiffTail(const int &n = 1000, std::string fname = "") {
     }
     TiffWriter->open(new_name);
   }
-  auto n_frames = TiffReader->countDirectories();
-  if ((n_frames - n) <= 0) {
-    std::invalid_argument("n minus the total number of frames must be > 0");
+  auto count =
+      copyDirectories(*TiffWriter, n_frames - n + 1, n_frames, {channel2display});
+  TiffWriter.reset();
+  std::cout << "Written " << count << " frames to " << new_name << std::endl;
+}
+
+bool SITiffIO::saveFrames(const std::string &fname, unsigned int first,
+                          unsigned int last,
+                          std::vector<unsigned int> channels) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
   }
-  std::string sw_tag, im_tag;
-  int count = 0;
-  for (size_t i = n_frames - n; i < n_frames; ++i) {
-    auto this_dir = (i * m_nchans - (m_nchans - channel2display));
-    sw_tag = TiffReader->getSWTag(this_dir);
-    im_tag = TiffReader->getImDescTag(this_dir);
-    auto this_frame = TiffReader->readframe(this_dir);
-    TiffWriter->writeSIHdr(sw_tag, im_tag);
-    TiffWriter->writeHdr(this_frame);
-    *TiffWriter << this_frame;
+  SITiffWriter writer;
+  if (!writer.open(fname))
+    return false;
+  auto count = copyDirectories(writer, first, last, channels);
+  writer.close();
+  std::cout << "Written " << count << " directories to " << fname << std::endl;
+  return count > 0;
+}
+
+void SITiffIO::checkFrameRange(unsigned int &first, unsigned int &last) {
+  unsigned int n_frames = countDirectories();
+  if (last == 0 || last > n_frames)
+    last = n_frames;
+  if (first < 1 || first > last) {
+    throw std::invalid_argument("Invalid frame range");
+  }
+}
+
+unsigned int SITiffIO::getNThreads() const {
+  if (m_nthreads == 0)
+    return std::max(1u, std::thread::hardware_concurrency());
+  return m_nthreads;
+}
+
+std::vector<SITiffReaderPool::Lease>
+SITiffIO::openReaders(unsigned int n) const {
+  if (m_readers == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  std::vector<SITiffReaderPool::Lease> readers;
+  for (unsigned int i = 0; i < n; ++i)
+    readers.push_back(m_readers->acquire());
+  return readers;
+}
+
+unsigned int SITiffIO::checkChannel(unsigned int channel) const {
+  if (channel == 0)
+    channel = channel2display;
+  if (channel < 1 || channel > m_nchans) {
+    throw std::invalid_argument("Invalid channel");
+  }
+  return channel;
+}
+
+unsigned int SITiffIO::savedChannelId(unsigned int channel) const {
+  auto saved = TiffReader->getSavedChans();
+  auto search = saved.find(channel - 1);
+  return search != saved.end() ? search->second : channel;
+}
+
+unsigned int SITiffIO::copyDirectories(SITiffWriter &writer,
+                                       unsigned int first, unsigned int last,
+                                       std::vector<unsigned int> channels) {
+  checkFrameRange(first, last);
+  if (channels.empty()) {
+    for (unsigned int c = 1; c <= m_nchans; ++c)
+      channels.push_back(c);
+  }
+  std::sort(channels.begin(), channels.end());
+  channels.erase(std::unique(channels.begin(), channels.end()),
+                 channels.end());
+  if (channels.front() < 1 || channels.back() > m_nchans) {
+    throw std::invalid_argument("Invalid channel");
+  }
+  // the channel numbers as scanimage knows them so the channelSave
+  // entry in the header of the new file reflects what it contains
+  std::vector<unsigned int> channel_ids;
+  for (auto c : channels)
+    channel_ids.push_back(savedChannelId(c));
+  const bool subset = channels.size() < m_nchans;
+
+  // a reader of our own so the sequential reads aren't interleaved with
+  // seeks by other callers
+  auto reader = std::move(openReaders(1).front());
+  RawDirectory dir;
+  unsigned int count = 0;
+  for (unsigned int frame = first; frame <= last; ++frame) {
+    for (auto c : channels) {
+      unsigned int this_dir = (frame - 1) * m_nchans + (c - 1);
+      // the last frame can be truncated in files that are still
+      // being acquired
+      if (!reader->readRawDirectory(this_dir, dir))
+        return count;
+      if (subset)
+        writer.modifyChannel(dir.swTag, channel_ids);
+      if (!writer.writeRawDirectory(dir))
+        return count;
+      ++count;
+    }
+  }
+  return count;
+}
+
+unsigned int SITiffIO::readBatches(
+    unsigned int channel, unsigned int first, unsigned int last,
+    bool with_tags,
+    const std::function<void(unsigned int, std::vector<SourceFrame> &)>
+        &process) {
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  const unsigned int nthreads = getNThreads();
+  auto readers = openReaders(nthreads);
+  const unsigned int batch_size = 4 * nthreads;
+  std::vector<SourceFrame> batch;
+  std::vector<uint8_t> ok;
+  unsigned int count = 0;
+  for (unsigned int start = first; start <= last; start += batch_size) {
+    const unsigned int n = std::min(batch_size, last - start + 1);
+    batch.resize(n);
+    ok.assign(n, 0);
+    parallelFor(
+        n,
+        [&](unsigned int t, std::size_t begin, std::size_t end) {
+          auto &reader = *readers[t];
+          for (std::size_t i = begin; i < end; ++i) {
+            const unsigned int dir = (start + i - 1) * m_nchans + channel - 1;
+            auto &F = batch[i];
+            F.img = reader.readframe(dir);
+            ok[i] = F.img.n_elem == std::size_t(h) * w &&
+                    (!with_tags || reader.readTags(dir, F.swTag, F.imDescTag));
+          }
+        },
+        nthreads);
+    const unsigned int n_read = std::find(ok.begin(), ok.end(), 0) - ok.begin();
+    batch.resize(n_read);
+    if (n_read > 0)
+      process(start, batch);
+    count += n_read;
+    if (n_read < n)
+      break;
+  }
+  return count;
+}
+
+unsigned int SITiffIO::correctFrames(
+    unsigned int channel, unsigned int first, unsigned int last,
+    const std::string &fname,
+    const std::function<void(unsigned int, const int16_t *, int16_t *)>
+        &correct) {
+  const unsigned int nthreads = getNThreads();
+  const bool write = !fname.empty();
+  const unsigned int channel_id = savedChannelId(channel);
+  SITiffWriter writer;
+  if (write && !writer.open(fname))
+    return 0;
+
+  // one batch is written out while the next is being corrected
+  std::array<std::vector<SourceFrame>, 2> corrected;
+  std::future<void> pending;
+  unsigned int k = 0;
+  auto process = [&](unsigned int start, std::vector<SourceFrame> &batch) {
+    auto &out = corrected[k++ % 2];
+    if (write) {
+      // the writer may still be on the other buffer, never this one
+      out.resize(batch.size());
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        out[i].img.set_size(batch[i].img.n_rows, batch[i].img.n_cols);
+        out[i].swTag = std::move(batch[i].swTag);
+        out[i].imDescTag = std::move(batch[i].imDescTag);
+      }
+    }
+    parallelFor(
+        batch.size(),
+        [&](unsigned int, std::size_t begin, std::size_t end) {
+          for (std::size_t i = begin; i < end; ++i)
+            correct(start + i, batch[i].img.memptr(),
+                    write ? out[i].img.memptr() : nullptr);
+        },
+        nthreads);
+    if (!write)
+      return;
+    if (pending.valid())
+      pending.get();
+    pending = std::async(std::launch::async, [&writer, &out, channel_id]() {
+      for (auto &f : out) {
+        // the output only holds the one channel
+        writer.modifyChannel(f.swTag, channel_id);
+        writer.writeSIHdr(f.swTag, f.imDescTag);
+        writer.writeHdr(f.img);
+        writer << f.img;
+      }
+    });
+  };
+  const unsigned int count =
+      readBatches(channel, first, last, write, process);
+  if (pending.valid())
+    pending.get();
+  if (write)
+    writer.close();
+  return count;
+}
+
+std::vector<std::string> SITiffIO::splitChannels(std::string fname,
+                                                 unsigned int first,
+                                                 unsigned int last) {
+  if (TiffReader == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  checkFrameRange(first, last);
+  fs::path base = fname.empty() ? fs::path(TiffReader->getfilename()).filename()
+                                : fs::path(fname);
+  std::vector<unsigned int> channel_ids;
+  std::vector<std::string> names;
+  std::vector<std::unique_ptr<SITiffWriter>> writers;
+  for (unsigned int c = 0; c < m_nchans; ++c) {
+    channel_ids.push_back(savedChannelId(c + 1));
+    fs::path name = base;
+    name.replace_filename(base.stem().string() + "_chan" +
+                          std::to_string(channel_ids.back()) +
+                          base.extension().string());
+    names.push_back(name.string());
+    writers.push_back(std::make_unique<SITiffWriter>());
+    if (!writers.back()->open(names.back())) {
+      throw std::runtime_error("Could not open " + names.back());
+    }
+  }
+
+  // Two sets of directories are used so the next frame can be read while
+  // the channels of the previous one are being written out in parallel,
+  // each channel by its own worker for the whole run
+  std::vector<std::unique_ptr<WorkerPool>> workers;
+  for (unsigned int c = 0; c < m_nchans; ++c)
+    workers.push_back(std::make_unique<WorkerPool>(1));
+  std::array<std::vector<RawDirectory>, 2> dirs;
+  dirs[0].resize(m_nchans);
+  dirs[1].resize(m_nchans);
+  std::vector<std::future<bool>> pending;
+  auto finishWrites = [&pending]() {
+    bool ok = true;
+    for (auto &p : pending)
+      ok &= p.get();
+    pending.clear();
+    return ok;
+  };
+
+  auto reader = std::move(openReaders(1).front());
+  unsigned int count = 0;
+  bool written = true;
+  for (unsigned int frame = first; frame <= last; ++frame) {
+    auto &batch = dirs[frame % 2];
+    bool complete = true;
+    for (unsigned int c = 0; c < m_nchans && complete; ++c) {
+      complete =
+          reader->readRawDirectory((frame - 1) * m_nchans + c, batch[c]);
+      writers[c]->modifyChannel(batch[c].swTag, channel_ids[c]);
+    }
+    written = finishWrites();
+    if (!written || !complete)
+      break;
+    for (unsigned int c = 0; c < m_nchans; ++c) {
+      pending.push_back(
+          workers[c]->submit([&writer = *writers[c], &dir = batch[c]]() {
+            return writer.writeRawDirectory(dir);
+          }));
+    }
     ++count;
   }
-  TiffWriter.reset();
-  std::cout << "Written " << count << " frames to " << new_name << std::endl;
+  written = finishWrites() && written;
+  for (auto &writer : writers)
+    writer->close();
+  if (!written) {
+    throw std::runtime_error("Could not write the channels of frame " +
+                             std::to_string(first + count - 1));
+  }
+  std::cout << "Written " << count << " frames to each of " << m_nchans
+            << " files" << std::endl;
+  return names;
 }
+
 void SITiffIO::printVersion() {
   std::cout << getScanImageTiffVersionMajor() << "."
             << getScanImageTiffVersionMinor() << "."
@@ -8,6 +8,53 @@
 
 PYBIND11_MODULE(scanimagetiffio, m) {
 
+  py::enum_<twophoton::InterpolationType>(m, "InterpolationType")
+      .value("nearest", twophoton::InterpolationType::kNearest)
+      .value("bilinear", twophoton::InterpolationType::kBilinear)
+      .value("bicubic", twophoton::InterpolationType::kBicubic);
+
+  py::enum_<twophoton::ResampleMode>(m, "ResampleMode")
+      .value("nearest", twophoton::ResampleMode::kNearest)
+      .value("linear", twophoton::ResampleMode::kLinear)
+      .value("boxcar", twophoton::ResampleMode::kBoxcar);
+
+  py::enum_<twophoton::TransformType>(m, "TransformType")
+      .value("initial_rotation", twophoton::TransformType::kInitialRotation)
+      .value("tracker_translation",
+             twophoton::TransformType::kTrackerTranslation)
+      .value("multi_tracker_translation",
+             twophoton::TransformType::kMultiTrackerTranslation)
+      .value("log_polar_rotation", twophoton::TransformType::kLogPolarRotation)
+      .value("fft_translation", twophoton::TransformType::kHaimanFFTTranslation)
+      .value("optical_flow", twophoton::TransformType::kOpticalFlow)
+      .value("piecewise_mapping",
+             twophoton::TransformType::kHaimanPieceWiseMapping);
+
+  py::class_<twophoton::SITiffArray>(m, "SITiffArray")
+      .def_property_readonly("shape", &twophoton::SITiffArray::shape,
+                             "The shape of the array (frames, height, width).")
+      .def_property_readonly("dtype", &twophoton::SITiffArray::dtype,
+                             "The dtype of the array (int16).")
+      .def_property_readonly(
+          "ndim", [](const twophoton::SITiffArray &) { return 3; },
+          "The number of dimensions of the array (3).")
+      .def("__len__", &twophoton::SITiffArray::nFrames)
+      .def("__getitem__", &twophoton::SITiffArray::getItem,
+           "Read the part of the array selected by index.",
+           R"pbdoc(
+           Read the part of the array selected by index, with the same result as indexing a numpy array of the whole channel.
+
+           Ints, slices (with steps), ellipsis and integer or boolean arrays are supported on each axis. Only the frames and the band of rows the index selects are read, in parallel.
+
+           :param index: The index.
+           :return: A numpy array (or scalar).
+           :rtype: numpy.ndarray
+           )pbdoc",
+           py::arg("index"))
+      .def("__array__", &twophoton::SITiffArray::toNumpy,
+           "Read the whole array.", py::arg("dtype") = py::none(),
+           py::arg("copy") = py::none());
+
   py::class_<twophoton::SITiffIO>(m, "SITiffIO")
       .def(py::init<>())
       .def("open_tiff_file", &twophoton::SITiffIO::openTiff,
@@ -23,22 +70,31 @@ PYBIND11_MODULE(scanimagetiffio, m) {
       .def("open_rotary_file", &twophoton::SITiffIO::openRotary,
            "Open a rotary encoder log file that contains rotational angle data.")
       .def("count_directories", &twophoton::SITiffIO::countDirectories,
-           "Count the number of frames in the TIFF file.")
+           "Count the number of frames in the TIFF file.",
+           py::call_guard<py::gil_scoped_release>())
       .def("set_channel", &twophoton::SITiffIO::setChannel,
            "Set the channel to take frames from.",
            py::arg("channel"))
       .def("get_n_frames", &twophoton::SITiffIO::countDirectories,
-           "Count the number of frames in the TIFF file.")
+           "Count the number of frames in the TIFF file.",
+           py::call_guard<py::gil_scoped_release>())
       .def("get_n_channels", &twophoton::SITiffIO::getNChannels,
            "Get the number of channels available in this file.")
       .def("get_display_channel", &twophoton::SITiffIO::getDisplayChannel,
            "Get the channel that frames are currently being taken from.")
       .def("interp_times", &twophoton::SITiffIO::interpolateIndices,
            "Interpolate the indices of the TIFF frames to events (position and time) in the log file.",
-           py::arg("n") = 0)
+           py::arg("n") = 0,
+           py::call_guard<py::gil_scoped_release>())
       .def("get_pos", &twophoton::SITiffIO::getPos,
            "Get the position data for the current frame.",
            py::arg("frame"))
+      .def("get_tracker", &twophoton::SITiffIO::getTrackerTranslation,
+           "Get the x and y translation found by track_templates for a frame.",
+           py::arg("frame"))
+      .def("get_all_tracker", &twophoton::SITiffIO::getAllTrackerTranslation,
+           "Get the x and y translations found by track_templates for all "
+           "the tracked frames.")
       .def("get_frame", &twophoton::SITiffIO::readFrame,
            "Get the image data for the current frame.",
            py::arg("frame"))
@@ -63,6 +119,51 @@ PYBIND11_MODULE(scanimagetiffio, m) {
       .def("get_tiff_times", &twophoton::SITiffIO::getTiffTimeStamps,
            "Get the times from the TIFF file.",
            py::return_value_policy::reference_internal)
+      .def("get_transforms", &twophoton::SITiffIO::getTransformArray,
+           "Get one type of transform for every frame as a numpy array.",
+           R"pbdoc(
+           Get one type of transform for every frame without copying it.
+
+           :param transform: The type of transform.
+           :type transform: TransformType
+           :return: A read-only array of shape (frames, rows, cols) holding the transform matrix of each frame in the table filled out by interp_times(). Frames without the transform are zero
+           :rtype: numpy.ndarray
+           )pbdoc",
+           py::arg("transform"))
+      .def("get_frame_table", &twophoton::SITiffIO::getFrameTable,
+           "Get the per-frame positions and times as a dict of numpy arrays.",
+           R"pbdoc(
+           Get the per-frame table filled out by interp_times() in one call and without copying it.
+
+           :return: A dict of read-only arrays, one entry per frame: frame (the ScanImage frame number), timestamp, x, z, raw_x, raw_z and theta. Pass it to pandas.DataFrame for a dataframe
+           :rtype: dict
+           )pbdoc")
+      .def("save_transforms", &twophoton::SITiffIO::saveTransforms,
+           "Save the per-frame positions and transforms to a binary file.",
+           R"pbdoc(
+           Save the per-frame positions and transforms to a binary file.
+
+           interp_times() (or load_transforms()) has to be called first.
+
+           :param fname: The name of the file to write.
+           :type fname: str
+           :return: True if the file was written.
+           :rtype: bool
+           )pbdoc",
+           py::arg("fname"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("load_transforms", &twophoton::SITiffIO::loadTransforms,
+           "Load per-frame positions and transforms saved by save_transforms().",
+           R"pbdoc(
+           Load per-frame positions and transforms saved by save_transforms(), replacing any already calculated.
+
+           :param fname: The name of the file to read.
+           :type fname: str
+           :return: True if the file was loaded.
+           :rtype: bool
+           )pbdoc",
+           py::arg("fname"),
+           py::call_guard<py::gil_scoped_release>())
       .def("get_frame_numbers", &twophoton::SITiffIO::getFrameNumbers,
            "Get the frame numbers from the TIFF file.",
            py::return_value_policy::reference_internal)
@@ -75,6 +176,34 @@ PYBIND11_MODULE(scanimagetiffio, m) {
       .def("get_rotary_times", &twophoton::SITiffIO::getRotaryTimes,
            "Get the times from the log file.",
            py::return_value_policy::reference_internal)
+      .def("get_log_data", &twophoton::SITiffIO::getLogData,
+           "Get the per-sample columns of the log file as numpy arrays.",
+           R"pbdoc(
+           Get the per-sample data of the log file without copying it.
+
+           :return: A dict of read-only numpy arrays: time (seconds relative to the trigger), x, z, raw_x, raw_z and theta (radians). The arrays keep the loaded log file alive.
+           :rtype: dict
+           )pbdoc")
+      .def("resample", &twophoton::SITiffIO::resample,
+           "Resample the behavioural data onto a grid of times.",
+           R"pbdoc(
+           Resample the log and rotary encoder data onto an arbitrary grid of times.
+
+           :param times: Times in seconds from the start of the acquisition, sorted in ascending order
+           :param mode: ResampleMode.nearest, .linear (the default) or .boxcar (the mean of the samples in the bin around each time)
+           :return: A dict of numpy arrays: x, z, raw_x, raw_z (if a log file is loaded) and theta. theta is unwrapped (continuous radians) and comes from the rotary encoder file if one is loaded
+           :rtype: dict
+           )pbdoc",
+           py::arg("times"),
+           py::arg("mode") = twophoton::ResampleMode::kLinear)
+      .def("get_rotary_data", &twophoton::SITiffIO::getRotaryData,
+           "Get the per-sample columns of the rotary encoder file as numpy arrays.",
+           R"pbdoc(
+           Get the per-sample data of the rotary encoder file without copying it.
+
+           :return: A dict of read-only numpy arrays: time (seconds relative to the trigger) and theta (radians in [0, 2PI), converted from the degrees in the file). The arrays keep the loaded rotary encoder file alive.
+           :rtype: dict
+           )pbdoc")
       .def("get_logfile_trigger_time",
            &twophoton::SITiffIO::getLogFileTriggerTime,
            "Get the time the logfile registered microscope acquisition.")
@@ -83,12 +212,37 @@ PYBIND11_MODULE(scanimagetiffio, m) {
            "Get the time the rotary encoder registered acquisition.")
       .def("get_epoch_time", &twophoton::SITiffIO::getEpochTime,
            "Get the epoch time from the TIFF header.")
+      .def("get_line_period", &twophoton::SITiffIO::getLinePeriod,
+           "Get the time taken to scan one line of a frame in seconds.",
+           R"pbdoc(
+           Get the time taken to scan one line of a frame.
+
+           Read from the header (SI.hRoiManager.linePeriod) if it is there, otherwise estimated from the interval between frames.
+
+           :return: The line period in seconds.
+           :rtype: float
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("get_line_times", &twophoton::SITiffIO::getLineTimes,
+           "Get the acquisition time of each scanline of a frame.",
+           R"pbdoc(
+           Get the time each scanline of a frame was acquired.
+
+           :param frame: The frame (1-indexed).
+           :type frame: int
+           :return: The time of the middle of each row in seconds from the start of the acquisition.
+           :rtype: list
+           )pbdoc",
+           py::arg("frame"),
+           py::call_guard<py::gil_scoped_release>())
       .def("get_sw_tag", &twophoton::SITiffIO::getSWTag,
            "Get the software tag part of the header for frame n.",
-           py::arg("frame"))
+           py::arg("frame"),
+           py::call_guard<py::gil_scoped_release>())
       .def("get_image_description_tag", &twophoton::SITiffIO::getImageDescTag,
            "Get the image description part of the header for frame n.",
-           py::arg("frame"))
+           py::arg("frame"),
+           py::call_guard<py::gil_scoped_release>())
       .def("tail", &twophoton::SITiffIO::tail,
            "Get the last n frames from the file currently open for reading.",
            py::arg("n") = 1000,
@@ -111,5 +265,350 @@ PYBIND11_MODULE(scanimagetiffio, m) {
            :type n: int
            :param fname: The name of the file to save the last n_frame images to. This will default to the currently open file name with _tail appended just before the file type extension.
            :type fname: str
-           )pbdoc");
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("save_frames", &twophoton::SITiffIO::saveFrames,
+           "Copy a range of frames and channels to a new TIFF file without decoding them.",
+           py::arg("fname"), py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("channels") = std::vector<unsigned int>{},
+           R"pbdoc(
+           Copy a range of frames and channels of the TIFF file currently open for reading to a new file.
+
+           The image data is copied as raw strips along with the ScanImage headers so nothing is decoded and the copy runs at disk speed.
+
+           :param fname: The name of the file to write.
+           :type fname: str
+           :param first: The first frame to copy (1-indexed).
+           :type first: int
+           :param last: The last frame to copy (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param channels: The channels to copy (1-indexed). An empty list copies all saved channels.
+           :type channels: list[int]
+           :return: True if any directories were written.
+           :rtype: bool
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("split_channels", &twophoton::SITiffIO::splitChannels,
+           "Write each channel of the TIFF file currently open for reading to its own file.",
+           py::arg("fname") = "", py::arg("first") = 1, py::arg("last") = 0,
+           R"pbdoc(
+           Write each channel of the TIFF file currently open for reading to its own file in a single pass.
+
+           :param fname: The base name of the new files; each gets _chanN appended before the extension. Defaults to the name of the file open for reading.
+           :type fname: str
+           :param first: The first frame to copy (1-indexed).
+           :type first: int
+           :param last: The last frame to copy (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :return: The names of the files written.
+           :rtype: list[str]
+           :raises RuntimeError: If a file can't be opened or written to.
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("derotate", &twophoton::SITiffIO::derotate,
+           "Write a derotated copy of the display channel to a new TIFF file.",
+           py::arg("fname"), py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("interpolation") = twophoton::InterpolationType::kBilinear,
+           py::arg("per_line") = false,
+           R"pbdoc(
+           Write frames of the display channel to a new TIFF file with the rotation of the bearing removed.
+
+           Each frame is rotated about its centre by minus the angle calculated for it by interp_times(), which has to be called first. With per_line each row is instead rotated by the angle of the bearing when that scanline was acquired, which needs a log or rotary encoder file but not interp_times().
+
+           :param fname: The name of the file to write.
+           :type fname: str
+           :param first: The first frame to derotate (1-indexed).
+           :type first: int
+           :param last: The last frame to derotate (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param interpolation: How to resample the frames.
+           :type interpolation: InterpolationType
+           :param per_line: Derotate each scanline by its own angle (see get_line_times()).
+           :type per_line: bool
+           :return: True if any frames were written.
+           :rtype: bool
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("register_translation", &twophoton::SITiffIO::registerTranslation,
+           "Correct the translation of frames of a channel by phase correlation.",
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("fname") = "", py::arg("n_reference") = 500,
+           py::arg("max_shift") = 0, py::arg("rotation") = false,
+           R"pbdoc(
+           Find the rigid translation of frames of a channel by phase correlation against a reference image.
+
+           The reference is the mean projection of the first n_reference frames, sharpened by registering those frames to it and averaging them again. The (x, y) shift of each frame is stored as TransformType.fft_translation in the table made by interp_times(), which has to be called first. If fname is given the frames are also written there with the shifts undone.
+
+           With rotation the residual rotation and scale of each frame are also estimated in the same pass from the log-polar transforms of their FFT magnitude spectra and stored as TransformType.log_polar_rotation (angle in radians, scale). Each frame is derotated by its angle before its translation is found (and written).
+
+           :param channel: The channel to register (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to register (1-indexed).
+           :type first: int
+           :param last: The last frame to register (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param fname: The name of a TIFF file to write the corrected frames to. Empty means nothing is written.
+           :type fname: str
+           :param n_reference: The number of frames the reference is made from.
+           :type n_reference: int
+           :param max_shift: The largest shift looked for (pixels). 0 means a quarter of the frame.
+           :type max_shift: int
+           :param rotation: Also estimate and correct the residual rotation of each frame.
+           :type rotation: bool
+           :return: The number of frames registered.
+           :rtype: int
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("register_piecewise", &twophoton::SITiffIO::registerPiecewise,
+           "Correct the non-rigid motion of frames of a channel patch by patch.",
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("fname") = "", py::arg("patch_size") = 128,
+           py::arg("overlap") = 0.5, py::arg("n_reference") = 500,
+           py::arg("max_shift") = 0,
+           R"pbdoc(
+           Find the non-rigid motion of frames of a channel by splitting them into a grid of overlapping patches and finding the translation of each patch against the same patch of a reference image by phase correlation.
+
+           The reference is built as for register_translation. The shifts of the grid are median filtered so patches with too little in them follow their neighbours, and are stored as TransformType.piecewise_mapping, an (n_patches, 2) matrix of (x, y) shifts with the patches in row-major grid order, in the table made by interp_times(), which has to be called first. Any fft_translation and log_polar_rotation already found for a frame (by register_translation) are undone before its patches are compared. If fname is given the frames are also written there with the shifts undone, the shift at each pixel being interpolated between the centres of the patches.
+
+           :param channel: The channel to register (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to register (1-indexed).
+           :type first: int
+           :param last: The last frame to register (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param fname: The name of a TIFF file to write the corrected frames to. Empty means nothing is written.
+           :type fname: str
+           :param patch_size: The side of the (square) patches in pixels.
+           :type patch_size: int
+           :param overlap: The fraction of a patch shared with its neighbours, in [0, 1).
+           :type overlap: float
+           :param n_reference: The number of frames the reference is made from.
+           :type n_reference: int
+           :param max_shift: The largest shift looked for (pixels). 0 means a quarter of a patch.
+           :type max_shift: int
+           :return: The number of frames registered.
+           :rtype: int
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("track_templates", &twophoton::SITiffIO::trackTemplates,
+           "Track boxes of the image through frames by normalised cross-correlation.",
+           py::arg("boxes"), py::arg("channel") = 0, py::arg("first") = 1,
+           py::arg("last") = 0, py::arg("search") = 16,
+           py::arg("n_reference") = 10,
+           R"pbdoc(
+           Follow one or more templates through frames of a channel by normalised cross-correlation.
+
+           The templates are the boxes of the mean of the first n_reference frames of the range. Each is looked for in every frame within search pixels of where it was found in the one before, so drift is followed cheaply without registering whole frames. The templates are tracked in parallel. Their (x, y) translations are stored as TransformType.multi_tracker_translation (one row per box) and their mean as TransformType.tracker_translation (see get_tracker and get_all_tracker) in the table made by interp_times(), which has to be called first.
+
+           :param boxes: The templates as (x, y, width, height) boxes in pixels.
+           :type boxes: list
+           :param channel: The channel to track (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to track (1-indexed).
+           :type first: int
+           :param last: The last frame to track (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param search: How far (pixels) a template is looked for from where it was in the previous frame.
+           :type search: int
+           :param n_reference: The number of frames the templates are cut from the mean of.
+           :type n_reference: int
+           :return: The number of frames tracked.
+           :rtype: int
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("estimate_optical_flow", &twophoton::SITiffIO::estimateOpticalFlow,
+           "Estimate the dense optical flow of frames of a channel.",
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("step") = 16, py::arg("n_reference") = 500,
+           py::arg("levels") = 3, py::arg("window") = 11,
+           R"pbdoc(
+           Estimate the per-pixel motion of frames of a channel against a reference image by pyramidal Lucas-Kanade optical flow.
+
+           The reference is built as for register_translation. The flow of each frame is averaged over step x step pixel cells and kept quantised to 1/256 pixel (see get_optical_flow), and the mean and largest flow of each frame (pixels) are stored as TransformType.optical_flow in the table made by interp_times(), which has to be called first. Frames are done in parallel.
+
+           :param channel: The channel to use (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame (1-indexed).
+           :type first: int
+           :param last: The last frame (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param step: The side of the cells the flow is averaged over (pixels).
+           :type step: int
+           :param n_reference: The number of frames the reference is made from.
+           :type n_reference: int
+           :param levels: The number of levels of the image pyramids.
+           :type levels: int
+           :param window: The side of the window the flow is assumed constant over (pixels).
+           :type window: int
+           :return: The number of frames done.
+           :rtype: int
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("get_optical_flow", &twophoton::SITiffIO::getOpticalFlow,
+           "Get the flow fields found by estimate_optical_flow as a float32 "
+           "array of shape (frames, rows, cols, 2) holding (x, y) in pixels.")
+      .def("export_zarr", &twophoton::SITiffIO::exportZarr,
+           "Export frames of a channel to a Zarr v2 directory store.",
+           py::arg("path"), py::arg("channel") = 0, py::arg("first") = 1,
+           py::arg("last") = 0, py::arg("chunk_frames") = 64,
+           py::arg("chunk_height") = 0, py::arg("chunk_width") = 0,
+           py::arg("compression_level") = 0,
+           R"pbdoc(
+           Export frames of a channel to a chunked Zarr v2 directory store of shape (frames, height, width).
+
+           :param path: The directory to write the store to.
+           :type path: str
+           :param channel: The channel to export (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to export (1-indexed).
+           :type first: int
+           :param last: The last frame to export (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param chunk_frames: The number of frames per chunk. 0 means as many as fit in 256MB per thread.
+           :type chunk_frames: int
+           :param chunk_height: The height of each chunk. 0 means the height of the frames.
+           :type chunk_height: int
+           :param chunk_width: The width of each chunk. 0 means the width of the frames.
+           :type chunk_width: int
+           :param compression_level: The zlib compression level (1-9). 0 means no compression.
+           :type compression_level: int
+           :return: True on success.
+           :rtype: bool
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("export_npy", &twophoton::SITiffIO::exportNpy,
+           "Export frames of a channel to a memory-mappable .npy file.",
+           py::arg("path"), py::arg("channel") = 0, py::arg("first") = 1,
+           py::arg("last") = 0,
+           R"pbdoc(
+           Export frames of a channel to a .npy file of shape (frames, height, width) that can be opened with numpy.load(path, mmap_mode="r").
+
+           :param path: The name of the file to write.
+           :type path: str
+           :param channel: The channel to export (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to export (1-indexed).
+           :type first: int
+           :param last: The last frame to export (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :return: True on success.
+           :rtype: bool
+           )pbdoc",
+           py::call_guard<py::gil_scoped_release>())
+      .def("get_projection", &twophoton::SITiffIO::getProjection,
+           "Get the mean and max intensity projections of a channel.",
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           R"pbdoc(
+           Get the mean and max intensity projections of frames first to last of a channel.
+
+           :param channel: The channel to project (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame to include (1-indexed).
+           :type first: int
+           :param last: The last frame to include (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :return: The mean (float32) and max (int16) projections, each with shape (height, width).
+           :rtype: tuple
+           )pbdoc")
+      .def("get_traces", &twophoton::SITiffIO::getTraces,
+           "Get the fluorescence traces of ROIs given as sparse masks.",
+           py::arg("indptr"), py::arg("indices"), py::arg("weights"),
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           R"pbdoc(
+           Get the weighted mean fluorescence of each of a set of ROIs in frames first to last of a channel, in one parallel pass over the frames.
+
+           The masks are a sparse (rois, height * width) matrix in compressed sparse row form, e.g. the indptr, indices and data of a scipy.sparse.csr_matrix: the pixels of ROI i are indices[indptr[i]:indptr[i + 1]] (row-major indices into a frame) with the matching weights. An ROI whose weights add up to 0 gets the weighted sum instead of the mean. Stops at the first frame that can't be read.
+
+           :param indptr: Where the pixels of each ROI start in indices (n_rois + 1 values).
+           :type indptr: numpy.ndarray
+           :param indices: The pixels of the ROIs.
+           :type indices: numpy.ndarray
+           :param weights: The weight of each pixel.
+           :type weights: numpy.ndarray
+           :param channel: The channel (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame (1-indexed).
+           :type first: int
+           :param last: The last frame (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :return: The traces (float32) with shape (rois, frames).
+           :rtype: numpy.ndarray
+           )pbdoc")
+      .def("get_local_correlation", &twophoton::SITiffIO::getLocalCorrelation,
+           "Get the local correlation image of a channel.",
+           py::arg("channel") = 0, py::arg("first") = 1, py::arg("last") = 0,
+           py::arg("neighbours") = 8,
+           R"pbdoc(
+           Get the mean correlation through time of each pixel with its 4 or 8 neighbours over frames first to last of a channel.
+
+           The image is made in one pass over the frames keeping only running sums, so memory use doesn't depend on the number of frames.
+
+           :param channel: The channel (1-indexed). 0 means the display channel.
+           :type channel: int
+           :param first: The first frame (1-indexed).
+           :type first: int
+           :param last: The last frame (inclusive). 0 means the last frame in the file.
+           :type last: int
+           :param neighbours: 4 or 8.
+           :type neighbours: int
+           :return: The correlation image (float32) with shape (height, width).
+           :rtype: numpy.ndarray
+           )pbdoc")
+      .def("as_array", &twophoton::SITiffIO::asArray,
+           "Get a channel as a lazily read array of shape (frames, height, width).",
+           py::arg("channel") = 0,
+           R"pbdoc(
+           Get a channel of the file open for reading as an array-like object of shape (frames, height, width) that is read only when it is indexed.
+
+           Indexing it (e.g. a[100:200, 50:150], a[::10], a[[3, 7, 9], ..., 256]) reads just the frames and rows selected, in parallel, so the recording never has to fit in memory. numpy.asarray() reads all of it.
+
+           :param channel: The channel (1-indexed). 0 means the display channel.
+           :type channel: int
+           :return: The array.
+           :rtype: SITiffArray
+           )pbdoc")
+      .def("read_frames_async", &twophoton::SITiffIO::readFramesAsync,
+           "Read frames of a channel without blocking the asyncio event loop.",
+           py::arg("frames"), py::arg("channel") = 0,
+           R"pbdoc(
+           Read frames of a channel on a native worker thread, without blocking the event loop or holding the GIL. Has to be called from a coroutine (or the thread running the loop).
+
+           :param frames: The frames to read (1-indexed).
+           :type frames: list[int]
+           :param channel: The channel (1-indexed). 0 means the display channel.
+           :type channel: int
+           :return: A future of an ndarray of shape (len(frames), height, width). Await it.
+           :rtype: asyncio.Future
+           )pbdoc")
+      .def("tail_async", &twophoton::SITiffIO::tailAsync,
+           "Get the last n frames without blocking the asyncio event loop.",
+           py::arg("n") = 1000,
+           R"pbdoc(
+           Get the last n frames of the display channel and their rotation angles on a native worker thread, without blocking the event loop or holding the GIL. Has to be called from a coroutine (or the thread running the loop).
+
+           :param n: The number of frames to get.
+           :type n: int
+           :return: A future of a tuple of an ndarray of shape (n, height, width) and a list of the rotation angle of each frame. Await it.
+           :rtype: asyncio.Future
+           )pbdoc")
+      .def("count_directories_async",
+           &twophoton::SITiffIO::countDirectoriesAsync,
+           "Count the frames in the TIFF file without blocking the asyncio event loop.",
+           R"pbdoc(
+           Count the number of frames in the TIFF file on a native worker thread, without blocking the event loop or holding the GIL. Has to be called from a coroutine (or the thread running the loop).
+
+           :return: A future of the number of frames. Await it.
+           :rtype: asyncio.Future
+           )pbdoc")
+      .def("set_n_threads", &twophoton::SITiffIO::setNThreads,
+           "Set the number of threads used by the parallel functions.",
+           py::arg("n"),
+           R"pbdoc(
+           Set the number of threads used by derotate, register_translation, register_piecewise, track_templates, estimate_optical_flow, export_zarr, export_npy and get_projection.
+
+           :param n: The number of threads. 0 means all hardware threads.
+           :type n: int
+           )pbdoc")
+      .def("get_n_threads", &twophoton::SITiffIO::getNThreads,
+           "Get the number of threads used by the parallel functions.");
 }
\ No newline at end of file
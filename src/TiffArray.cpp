@@ -0,0 +1,218 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace twophoton {
+
+SITiffArray::SITiffArray(std::shared_ptr<SITiffReaderPool> readers,
+                         unsigned int nchans, unsigned int channel,
+                         std::size_t n_frames, unsigned int height,
+                         unsigned int width, unsigned int nthreads)
+    : m_readers(std::move(readers)), m_nchans(nchans), m_channel(channel),
+      m_n_frames(n_frames), m_height(height), m_width(width),
+      m_nthreads(std::max(1u, nthreads)) {}
+
+void SITiffArray::read(std::span<const std::size_t> frames,
+                       unsigned int row_begin, unsigned int row_end,
+                       int16_t *dst) const {
+  if (frames.empty() || row_begin >= row_end)
+    return;
+  const std::size_t block = std::size_t(row_end - row_begin) * m_width;
+  // each thread reads a contiguous run of the (ascending) frames so it
+  // steps forward through the file rather than seeking
+  const unsigned int nthreads =
+      std::min<std::size_t>(m_nthreads, frames.size());
+  parallelFor(
+      frames.size(),
+      [&](unsigned int, std::size_t begin, std::size_t end) {
+        auto reader = m_readers->acquire();
+        for (std::size_t i = begin; i < end; ++i) {
+          const unsigned int dir = frames[i] * m_nchans + m_channel - 1;
+          if (!reader->readRows(dir, row_begin, row_end, dst + i * block)) {
+            throw std::runtime_error("Could not read frame " +
+                                     std::to_string(frames[i] + 1));
+          }
+        }
+      },
+      nthreads);
+}
+
+py::tuple SITiffArray::shape() const {
+  return py::make_tuple(m_n_frames, m_height, m_width);
+}
+
+namespace {
+// What to read along one axis for an index, in ascending order, and the
+// index that gets the same result from the block that was read as the
+// original index would from the whole axis. When contiguous is set every
+// position between the first and last selected is read (used for the rows,
+// which are decoded as one band)
+struct AxisSelection {
+  std::vector<std::size_t> positions;
+  py::object post;
+};
+} // namespace
+
+static std::size_t wrapIndex(int64_t i, std::size_t n) {
+  const int64_t wrapped = i < 0 ? i + int64_t(n) : i;
+  if (wrapped < 0 || wrapped >= int64_t(n)) {
+    throw py::index_error("index " + std::to_string(i) +
+                          " is out of bounds for axis with size " +
+                          std::to_string(n));
+  }
+  return wrapped;
+}
+
+static AxisSelection selectAxis(const py::object &index, std::size_t n,
+                                bool contiguous) {
+  AxisSelection sel;
+  if (py::isinstance<py::slice>(index)) {
+    py::ssize_t start = 0, stop = 0, step = 0, len = 0;
+    if (!py::reinterpret_borrow<py::slice>(index).compute(n, &start, &stop,
+                                                           &step, &len))
+      throw py::error_already_set();
+    if (len == 0) {
+      sel.post = py::slice(0, 0, 1);
+      return sel;
+    }
+    const std::size_t last = start + (len - 1) * step;
+    const std::size_t lo = std::min<std::size_t>(start, last);
+    const std::size_t hi = std::max<std::size_t>(start, last) + 1;
+    if (contiguous) {
+      sel.positions.resize(hi - lo);
+      std::iota(sel.positions.begin(), sel.positions.end(), lo);
+      const py::ssize_t top = hi - lo - 1;
+      sel.post = step > 0 ? py::slice(0, hi - lo, step)
+                          : py::slice(top, std::nullopt, step);
+    } else {
+      for (py::ssize_t k = 0; k < len; ++k)
+        sel.positions.push_back(lo + k * std::abs(step));
+      sel.post = py::slice(std::nullopt, std::nullopt, step > 0 ? 1 : -1);
+    }
+    return sel;
+  }
+
+  // everything else goes through numpy: ints, numpy scalars, lists and
+  // integer or boolean arrays
+  auto np = py::module_::import("numpy");
+  py::array values = np.attr("asarray")(index);
+  const char kind = values.dtype().kind();
+  if (kind == 'b' && values.ndim() == 1) {
+    if (std::size_t(values.shape(0)) != n) {
+      throw py::index_error("boolean index did not match indexed array along "
+                            "axis; size of axis is " +
+                            std::to_string(n) + " but size of index is " +
+                            std::to_string(values.shape(0)));
+    }
+    values = np.attr("flatnonzero")(values);
+  } else if (kind != 'i' && kind != 'u') {
+    throw py::index_error("only integers, slices (`:`), ellipsis (`...`) and "
+                          "integer or boolean arrays are valid indices");
+  }
+  py::array_t<int64_t, py::array::c_style | py::array::forcecast> idx(values);
+  std::vector<std::size_t> wrapped(idx.size());
+  for (std::size_t i = 0; i < wrapped.size(); ++i)
+    wrapped[i] = wrapIndex(idx.data()[i], n);
+
+  std::vector<std::size_t> sorted = wrapped;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  std::size_t lo = 0;
+  if (contiguous && !sorted.empty()) {
+    lo = sorted.front();
+    sel.positions.resize(sorted.back() + 1 - lo);
+    std::iota(sel.positions.begin(), sel.positions.end(), lo);
+  } else {
+    sel.positions = sorted;
+  }
+  // where each of the indices ends up in the block, in the shape of index
+  py::array_t<int64_t> post(
+      std::vector<py::ssize_t>(idx.shape(), idx.shape() + idx.ndim()));
+  int64_t *p = post.mutable_data();
+  for (std::size_t i = 0; i < wrapped.size(); ++i) {
+    p[i] = contiguous ? wrapped[i] - lo
+                      : std::lower_bound(sorted.begin(), sorted.end(),
+                                         wrapped[i]) -
+                            sorted.begin();
+  }
+  if (idx.ndim() == 0)
+    sel.post = py::int_(p[0]);
+  else
+    sel.post = post;
+  return sel;
+}
+
+py::object SITiffArray::getItem(py::object index) const {
+  py::tuple key = py::isinstance<py::tuple>(index)
+                      ? py::reinterpret_borrow<py::tuple>(index)
+                      : py::make_tuple(index);
+  const py::object all = py::slice(std::nullopt, std::nullopt, std::nullopt);
+  // one index per axis with the ellipsis expanded and the rest filled in
+  std::vector<py::object> axes;
+  bool ellipsis = false;
+  for (auto item : key) {
+    if (item.is(py::ellipsis())) {
+      if (ellipsis) {
+        throw py::index_error("an index can only have a single ellipsis "
+                              "('...')");
+      }
+      ellipsis = true;
+      for (std::size_t i = key.size() - 1; i < 3; ++i)
+        axes.push_back(all);
+    } else {
+      axes.push_back(py::reinterpret_borrow<py::object>(item));
+    }
+  }
+  if (axes.size() > 3) {
+    throw py::index_error("too many indices for array: array is "
+                          "3-dimensional, but " +
+                          std::to_string(axes.size()) + " were indexed");
+  }
+  axes.resize(3, all);
+
+  auto frames = selectAxis(axes[0], m_n_frames, false);
+  auto rows = selectAxis(axes[1], m_height, true);
+  const unsigned int row_begin =
+      rows.positions.empty() ? 0 : rows.positions.front();
+  const unsigned int row_end =
+      rows.positions.empty() ? 0 : rows.positions.back() + 1;
+  py::array_t<int16_t> block(
+      {py::ssize_t(frames.positions.size()), py::ssize_t(row_end - row_begin),
+       py::ssize_t(m_width)});
+  int16_t *dst = block.mutable_data();
+  {
+    py::gil_scoped_release release;
+    read(frames.positions, row_begin, row_end, dst);
+  }
+  // the columns, and whatever of the rest of the index can't be done by
+  // reading less, are left to numpy
+  return block[py::make_tuple(frames.post, rows.post, axes[2])];
+}
+
+py::object SITiffArray::toNumpy(py::object dtype, py::object copy) const {
+  if (!copy.is_none() && !copy.cast<bool>()) {
+    throw py::value_error("An SITiffArray can't be converted to a numpy "
+                          "array without reading it");
+  }
+  py::object data = getItem(py::ellipsis());
+  if (!dtype.is_none())
+    return data.attr("astype")(dtype);
+  return data;
+}
+
+SITiffArray SITiffIO::asArray(unsigned int channel) {
+  if (TiffReader == nullptr || m_readers == nullptr) {
+    throw std::invalid_argument("No file open for reading!");
+  }
+  channel = checkChannel(channel);
+  unsigned int h, w;
+  TiffReader->getImageSize(h, w);
+  return SITiffArray(m_readers, m_nchans, channel, countDirectories(), h, w,
+                     getNThreads());
+}
+
+} // namespace twophoton
@@ -0,0 +1,339 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace twophoton {
+
+void TransformTable::resize(std::size_t n) {
+  frame_numbers.resize(n, 0);
+  frame_indices.resize(n, 0);
+  timestamps.resize(n, 0.0);
+  x.resize(n, 0.0);
+  z.resize(n, 0.0);
+  raw_x.resize(n, 0.0);
+  raw_z.resize(n, 0.0);
+  theta.resize(n, 0.0);
+  for (auto &column : m_columns) {
+    if (column.empty())
+      continue;
+    column.values.resize(n * column.stride(), 0.0);
+    column.present.resize(n, 0);
+  }
+}
+
+void TransformTable::clear() {
+  resize(0);
+  m_columns = {};
+}
+
+std::size_t TransformTable::find(unsigned int frame) const {
+  // the frame numbers go up through the file
+  auto it = std::lower_bound(frame_numbers.begin(), frame_numbers.end(), frame);
+  if (it != frame_numbers.end() && *it == frame)
+    return it - frame_numbers.begin();
+  return size();
+}
+
+bool TransformTable::hasTransform(TransformType T) const {
+  return !column(T).empty();
+}
+
+bool TransformTable::hasTransform(TransformType T, std::size_t row) const {
+  const auto &c = column(T);
+  return row < c.present.size() && c.present[row];
+}
+
+arma::mat TransformTable::getTransform(TransformType T,
+                                       std::size_t row) const {
+  if (!hasTransform(T, row))
+    return arma::mat();
+  const auto &c = column(T);
+  return arma::mat(c.values.data() + row * c.stride(), c.n_rows, c.n_cols);
+}
+
+TransformTable::Column &TransformTable::shapeColumn(TransformType T,
+                                                    unsigned int n_rows,
+                                                    unsigned int n_cols) {
+  auto &c = m_columns[std::size_t(T)];
+  if (c.empty()) {
+    c.n_rows = n_rows;
+    c.n_cols = n_cols;
+    c.values.assign(size() * c.stride(), 0.0);
+    c.present.assign(size(), 0);
+  } else if (c.n_rows != n_rows || c.n_cols != n_cols) {
+    throw std::invalid_argument("The transform is a different shape to the "
+                                "ones already in the table");
+  }
+  return c;
+}
+
+void TransformTable::setTransform(TransformType T, std::size_t row,
+                                  const arma::mat &M) {
+  if (row >= size()) {
+    throw std::out_of_range("No such row in the transform table");
+  }
+  if (M.n_elem == 0)
+    return;
+  auto &c = shapeColumn(T, M.n_rows, M.n_cols);
+  std::memcpy(c.values.data() + row * c.stride(), M.memptr(),
+              c.stride() * sizeof(double));
+  c.present[row] = 1;
+}
+
+void TransformTable::updateTransform(TransformType T, std::size_t row,
+                                     const arma::mat &M) {
+  if (T == TransformType::kTrackerTranslation && hasTransform(T, row)) {
+    setTransform(T, row, getTransform(T, row) + M);
+    return;
+  }
+  setTransform(T, row, M);
+}
+
+void TransformTable::setTransforms(TransformType T, unsigned int n_rows,
+                                   unsigned int n_cols,
+                                   std::vector<double> values) {
+  if (values.size() != size() * std::size_t(n_rows) * n_cols) {
+    throw std::invalid_argument(
+        "Expected one transform for each frame in the table");
+  }
+  auto &c = m_columns[std::size_t(T)];
+  c.n_rows = n_rows;
+  c.n_cols = n_cols;
+  c.values = std::move(values);
+  c.present.assign(size(), 1);
+}
+
+void TransformTable::setFrameTransforms(TransformType T, unsigned int first,
+                                        unsigned int count,
+                                        unsigned int n_rows,
+                                        unsigned int n_cols,
+                                        const std::vector<double> &values) {
+  const std::size_t stride = std::size_t(n_rows) * n_cols;
+  if (values.size() < count * stride) {
+    throw std::invalid_argument("Expected one transform for each frame");
+  }
+  if (stride == 0)
+    return;
+  for (std::size_t row = 0; row < size(); ++row) {
+    const unsigned int frame = frame_indices[row] + 1;
+    if (frame < first || frame >= first + count)
+      continue;
+    auto &c = shapeColumn(T, n_rows, n_cols);
+    std::memcpy(c.values.data() + row * stride,
+                values.data() + (frame - first) * stride,
+                stride * sizeof(double));
+    c.present[row] = 1;
+  }
+}
+
+TransformContainer TransformTable::getContainer(std::size_t row) const {
+  TransformContainer tc(frame_indices.at(row), timestamps.at(row));
+  tc.setPosData(x[row], z[row], theta[row]);
+  tc.setOrigPosData(raw_x[row], raw_z[row], theta[row]);
+  for (std::size_t t = 0; t < n_types; ++t) {
+    auto T = TransformType(t);
+    if (hasTransform(T, row))
+      tc.addTransform(T, getTransform(T, row));
+  }
+  return tc;
+}
+
+/*
+The layout of a transform file. Bump transform_file_version whenever it
+changes; older files are then refused rather than misread
+*/
+static constexpr uint32_t transform_file_version = 1;
+static constexpr char transform_file_magic[8] = {'S', 'I', 'T', 'R',
+                                                 'A', 'N', 'S', 'F'};
+
+struct TransformFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_columns; // the number of transform blocks after the frames
+  uint64_t n_frames;
+};
+
+struct TransformBlockHeader {
+  uint32_t type;
+  uint32_t n_rows;
+  uint32_t n_cols;
+  uint32_t padding;
+};
+
+static std::size_t padded(std::size_t bytes) { return (bytes + 7) / 8 * 8; }
+
+template <typename T>
+static void writeArray(std::ofstream &ofs, const std::vector<T> &values) {
+  const std::size_t bytes = values.size() * sizeof(T);
+  ofs.write(reinterpret_cast<const char *>(values.data()), bytes);
+  const char zeros[8] = {};
+  ofs.write(zeros, padded(bytes) - bytes);
+}
+
+// copies n values out of the mapping at offset, moving offset past them.
+// n comes from the file so it is checked against what is left of the file
+// before anything is multiplied by it
+template <typename T>
+static bool readArray(const MappedFile &file, std::size_t &offset,
+                      std::size_t n, std::vector<T> &values) {
+  if (offset > file.size() || n > (file.size() - offset) / sizeof(T))
+    return false;
+  const std::size_t bytes = n * sizeof(T);
+  if (padded(bytes) > file.size() - offset)
+    return false;
+  values.resize(n);
+  std::memcpy(values.data(), file.data() + offset, bytes);
+  offset += padded(bytes);
+  return true;
+}
+
+bool TransformTable::save(const std::string &fname) const {
+  TransformFileHeader hdr{};
+  std::memcpy(hdr.magic, transform_file_magic, sizeof(hdr.magic));
+  hdr.version = transform_file_version;
+  hdr.n_frames = size();
+  for (const auto &c : m_columns)
+    hdr.n_columns += c.empty() ? 0 : 1;
+  // written to a temporary and renamed so an existing file is only
+  // replaced by a complete one
+  fs::path tmp_path(fname);
+  tmp_path += "." + std::to_string(std::random_device{}()) + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!ofs.is_open())
+      return false;
+    ofs.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    writeArray(ofs, frame_numbers);
+    writeArray(ofs, frame_indices);
+    for (const auto *v : {&timestamps, &x, &z, &raw_x, &raw_z, &theta})
+      writeArray(ofs, *v);
+    for (std::size_t t = 0; t < n_types; ++t) {
+      const auto &c = m_columns[t];
+      if (c.empty())
+        continue;
+      TransformBlockHeader block{uint32_t(t), c.n_rows, c.n_cols, 0};
+      ofs.write(reinterpret_cast<const char *>(&block), sizeof(block));
+      writeArray(ofs, c.present);
+      writeArray(ofs, c.values);
+    }
+    ofs.close();
+    if (!ofs.good()) {
+      std::error_code ec;
+      fs::remove(tmp_path, ec);
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp_path, fname, ec);
+  if (ec) {
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+bool TransformTable::load(const std::string &fname) {
+  MappedFile file(fname);
+  if (!file.isOpen() || file.size() < sizeof(TransformFileHeader))
+    return false;
+  TransformFileHeader hdr;
+  std::memcpy(&hdr, file.data(), sizeof(hdr));
+  if (std::memcmp(hdr.magic, transform_file_magic, sizeof(hdr.magic)) != 0 ||
+      hdr.version != transform_file_version)
+    return false;
+  // read into a new table so this one is untouched if the file is bad
+  TransformTable table;
+  const std::size_t n = hdr.n_frames;
+  std::size_t offset = sizeof(hdr);
+  bool ok = readArray(file, offset, n, table.frame_numbers) &&
+            readArray(file, offset, n, table.frame_indices);
+  for (auto *v : {&table.timestamps, &table.x, &table.z, &table.raw_x,
+                  &table.raw_z, &table.theta})
+    ok = ok && readArray(file, offset, n, *v);
+  for (uint32_t i = 0; ok && i < hdr.n_columns; ++i) {
+    TransformBlockHeader block;
+    if (offset + sizeof(block) > file.size())
+      return false;
+    std::memcpy(&block, file.data() + offset, sizeof(block));
+    offset += sizeof(block);
+    if (block.type >= n_types)
+      return false;
+    auto &c = table.m_columns[block.type];
+    c.n_rows = block.n_rows;
+    c.n_cols = block.n_cols;
+    // n_frames * n_rows * n_cols values have to fit in the file
+    if (c.stride() == 0 || n > file.size() / sizeof(double) / c.stride())
+      return false;
+    ok = readArray(file, offset, n, c.present) &&
+         readArray(file, offset, n * c.stride(), c.values);
+  }
+  if (!ok)
+    return false;
+  *this = std::move(table);
+  return true;
+}
+
+/* ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+/  +++++++++++++++++++++++  SITiffIO  +++++++++++++++++++++++++++++++++++
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++ */
+
+void SITiffIO::updateTransforms(
+    const std::function<void(TransformTable &)> &update) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_all_transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  auto table = std::make_shared<TransformTable>(*m_all_transforms);
+  update(*table);
+  m_all_transforms = std::move(table);
+}
+
+py::array_t<double> SITiffIO::getTransformArray(TransformType T) const {
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  const auto &c = transforms->column(T);
+  const long n = transforms->size();
+  if (c.empty())
+    return py::array_t<double>(std::vector<long>{n, 0, 0});
+  // each matrix is column-major so the rows are the innermost stride
+  const long item = sizeof(double);
+  std::vector<long> shape{n, long(c.n_rows), long(c.n_cols)};
+  std::vector<long> strides{long(c.stride()) * item, item,
+                            long(c.n_rows) * item};
+  py::capsule base(new std::shared_ptr<const void>(std::move(transforms)),
+                   [](void *p) {
+                     delete static_cast<std::shared_ptr<const void> *>(p);
+                   });
+  py::array_t<double> view(shape, strides, c.values.data(), base);
+  view.attr("setflags")(false);
+  return view;
+}
+
+bool SITiffIO::saveTransforms(const std::string &fname) const {
+  auto transforms = getAllTransforms();
+  if (transforms == nullptr) {
+    throw std::invalid_argument("interpolateIndices() has to be called first");
+  }
+  return transforms->save(fname);
+}
+
+bool SITiffIO::loadTransforms(const std::string &fname) {
+  auto table = std::make_shared<TransformTable>();
+  if (!table->load(fname)) {
+    std::cout << "Could not load the transforms from " << fname << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_all_transforms = std::move(table);
+  return true;
+}
+
+} // namespace twophoton
@@ -1,12 +1,199 @@
 #include "../include/ScanImageTiff.h"
 #include <algorithm>
+#include <charconv>
 #include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iterator>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
 
 namespace twophoton {
+
+MappedFile::MappedFile(const std::string &fname) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(file, &size)) {
+    m_open = true;
+    if (size.QuadPart > 0) {
+      HANDLE mapping =
+          CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping != nullptr) {
+        m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+      }
+      if (m_data != nullptr)
+        m_size = static_cast<std::size_t>(size.QuadPart);
+      else
+        m_open = false;
+    }
+  }
+  CloseHandle(file);
+#else
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (::fstat(fd, &st) == 0) {
+    m_open = true;
+    if (st.st_size > 0) {
+      void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        m_data = data;
+        m_size = static_cast<std::size_t>(st.st_size);
+        // the files are parsed front to back
+        ::madvise(m_data, m_size, MADV_SEQUENTIAL);
+      } else
+        m_open = false;
+    }
+  }
+  ::close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+  if (m_data == nullptr)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(m_data);
+#else
+  ::munmap(m_data, m_size);
+#endif
+}
+
+// Gets the next line from [p, end) without copying it and moves p past it.
+// Like std::getline the newline isn't part of the line
+static inline bool nextLine(const char *&p, const char *end,
+                            std::string_view &line) {
+  if (p >= end)
+    return false;
+  auto nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+  const char *line_end = nl != nullptr ? nl : end;
+  line = std::string_view(p, line_end - p);
+  p = nl != nullptr ? nl + 1 : end;
+  return true;
+}
+
+// Parses a number from the start of s the way std::stoi/ std::stof do,
+// i.e. leading whitespace and a plus sign are skipped and anything after
+// the number is ignored
+template <typename T> static bool parseNumber(std::string_view s, T &value) {
+  std::size_t i = 0;
+  while (i < s.size() && (s[i] == ' ' || s[i] == '\t'))
+    ++i;
+  if (i < s.size() && s[i] == '+')
+    ++i;
+  auto result = std::from_chars(s.data() + i, s.data() + s.size(), value);
+  return result.ec == std::errc();
+}
+
+// The value after the first "=" following token in line, or an empty view
+// if there is no such token
+static std::string_view valueAfter(std::string_view line,
+                                   std::string_view token) {
+  auto pos = line.find(token);
+  if (pos == std::string_view::npos)
+    return {};
+  pos = line.find(equal_token, pos);
+  if (pos == std::string_view::npos)
+    return {};
+  return line.substr(pos + 1);
+}
+
+// Reads at most max_digits digits from p as a non-negative integer
+static inline const char *parseDigits(const char *p, const char *end,
+                                      int max_digits, int &value) {
+  int n = 0;
+  value = 0;
+  while (p < end && n < max_digits && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p++ - '0');
+    ++n;
+  }
+  return n == 0 ? nullptr : p;
+}
+
+static inline const char *expect(const char *p, const char *end, char c) {
+  return (p != nullptr && p < end && *p == c) ? p + 1 : nullptr;
+}
+
+/*
+Parses a time in logfile_time_fmt ("%Y-%m-%d %T", e.g.
+"2021-03-04 12:34:56.789") from the start of s. Like std::chrono::parse,
+pt is left alone if s doesn't start with a valid time
+*/
+static bool parseLogTime(std::string_view s, ptime &pt) {
+  const char *p = s.data();
+  const char *end = p + s.size();
+  int y, mo, d, h, mi, sec;
+  p = parseDigits(p, end, 4, y);
+  p = expect(p, end, '-');
+  if (p)
+    p = parseDigits(p, end, 2, mo);
+  p = expect(p, end, '-');
+  if (p)
+    p = parseDigits(p, end, 2, d);
+  p = expect(p, end, ' ');
+  if (p)
+    p = parseDigits(p, end, 2, h);
+  p = expect(p, end, ':');
+  if (p)
+    p = parseDigits(p, end, 2, mi);
+  p = expect(p, end, ':');
+  if (p)
+    p = parseDigits(p, end, 2, sec);
+  if (p == nullptr || h > 23 || mi > 59 || sec > 60)
+    return false;
+  const std::chrono::year_month_day ymd{std::chrono::year{y},
+                                        std::chrono::month(mo),
+                                        std::chrono::day(d)};
+  if (!ymd.ok())
+    return false;
+  // fractional seconds, to nanosecond resolution
+  long long frac = 0;
+  if (p < end && *p == '.') {
+    ++p;
+    int n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++n)
+      if (n < 9)
+        frac = frac * 10 + (*p - '0');
+    for (; n < 9; ++n)
+      frac *= 10;
+  }
+  pt = std::chrono::sys_days{ymd} + std::chrono::hours(h) +
+       std::chrono::minutes(mi) + std::chrono::seconds(sec) +
+       std::chrono::duration_cast<ptime::duration>(
+           std::chrono::nanoseconds(frac));
+  return true;
+}
+
+static std::invalid_argument malformedLine(const std::string &fname,
+                                           std::string_view line) {
+  return std::invalid_argument("Malformed line in " + fname + ": " +
+                               std::string(line));
+}
 // constrain angles to lie between 0 and 2*PI
 static double constrainAngleToPi(double x) {
   x = std::fmod(x, 2 * M_PI);
@@ -50,71 +237,321 @@ int closest(std::vector<double> const &vec, double target) {
   return std::distance(std::begin(vec), it);
 }
 
-bool VRDataFile::_calculateDurationsAndRotations(bool convertToRadians) {
+bool VRDataFile::_calculateDurationsAndRotations(double units_per_turn) {
   auto first_time = getTriggerTime();
   unsigned int count = 0;
-  double raw_rotation = 0;
-  for (std::vector<ptime>::iterator i = m_ptimes.begin(); i != m_ptimes.end();
-       ++i) {
+  m_samples.times.reserve(m_samples.size());
+  m_samples.theta.reserve(m_samples.size());
+  for (auto i = m_samples.ptimes.begin(); i != m_samples.ptimes.end(); ++i) {
     auto duration = *i - first_time;
-    m_times.push_back(FpMilliseconds(duration).count() / 1000.0);
-    if (convertToRadians) {
-      raw_rotation =
-          2 * M_PI *
-          (double(m_rotations[count]) / (double)rotary_encoder_units_per_turn);
-      m_rotations_in_rads.push_back(constrainAngleToPi(raw_rotation));
-    } else {
-      m_rotations_in_rads.push_back(m_rotations[count]);
-    }
+    m_samples.times.push_back(FpMilliseconds(duration).count() / 1000.0);
+    const double raw_rotation =
+        2 * M_PI * (m_samples.rotations[count] / units_per_turn);
+    m_samples.theta.push_back(constrainAngleToPi(raw_rotation));
     ++count;
   }
   return true;
 }
 
-bool RotaryEncoderLoader::load() {
-  std::ifstream ifs{m_filename, std::ifstream::in};
-  ifs.unsetf(std::ios_base::skipws);
-  std::string line, old_line, s1;
-  ptime pt;
-  ptime old_time;
-  ptime tmp_trigger_ptime;
-  std::size_t pos;
-  double rotation;
-  std::cout << "Loading rotary encoder file: " << m_filename << std::endl;
+/*
+The cache of a parsed log/ rotary file is a header followed by the path of
+the file and then the columns: the times (in ns since the epoch) and each
+of cachedColumns(), all 8 byte values starting on an 8 byte boundary.
+Bump vr_parser_version whenever the parsing changes so older caches are
+ignored
+*/
+static constexpr uint32_t vr_parser_version = 1;
+static constexpr char vr_cache_magic[8] = {'S', 'I', 'V', 'R', 'C', 'A', 'C',
+                                           'H'};
+
+struct VRCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_columns;
+  uint64_t file_size;
+  int64_t file_mtime;
+  uint64_t n_samples;
+  int64_t trigger_time;
+  int64_t trigger_index;
+  double init_rotation;
+  uint8_t has_acquisition;
+  uint8_t found_trigger;
+  uint8_t padding[6];
+  uint64_t path_length;
+};
+
+static fs::path cacheDirectory() {
+  if (const char *dir = std::getenv("SITIFF_CACHE_DIR"))
+    return fs::path(dir);
+#ifdef _WIN32
+  if (const char *dir = std::getenv("LOCALAPPDATA"))
+    return fs::path(dir) / "scanimagetiffio";
+#else
+  if (const char *dir = std::getenv("XDG_CACHE_HOME"))
+    return fs::path(dir) / "scanimagetiffio";
+  if (const char *dir = std::getenv("HOME"))
+    return fs::path(dir) / ".cache" / "scanimagetiffio";
+#endif
+  return fs::temp_directory_path() / "scanimagetiffio";
+}
+
+// FNV-1a, so the cache file names don't change between builds
+static uint64_t hashPath(const std::string &path) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : path) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static std::string canonicalPath(const std::string &fname) {
+  std::error_code ec;
+  auto path = fs::canonical(fname, ec);
+  return ec ? fname : path.string();
+}
+
+static int64_t toNanoseconds(const ptime &t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+static ptime fromNanoseconds(int64_t ns) {
+  return ptime(std::chrono::duration_cast<ptime::duration>(
+      std::chrono::nanoseconds(ns)));
+}
+
+std::string VRDataFile::getCachePath() const {
+  const auto path = canonicalPath(m_filename);
+  std::ostringstream name;
+  name << fs::path(path).filename().string() << "." << std::hex
+       << hashPath(path) << ".vrcache";
+  return (cacheDirectory() / name.str()).string();
+}
+
+bool VRDataFile::readCache() {
+  if (!use_cache)
+    return false;
+  std::error_code ec;
+  const auto path = canonicalPath(m_filename);
+  const auto file_size = fs::file_size(path, ec);
+  if (ec)
+    return false;
+  const auto mtime = fs::last_write_time(path, ec);
+  if (ec)
+    return false;
+  MappedFile cache(getCachePath());
+  if (cache.size() < sizeof(VRCacheHeader))
+    return false;
+  VRCacheHeader hdr;
+  std::memcpy(&hdr, cache.data(), sizeof(hdr));
+  auto columns = cachedColumns();
+  const std::size_t path_bytes = (hdr.path_length + 7) / 8 * 8;
+  if (std::memcmp(hdr.magic, vr_cache_magic, sizeof(hdr.magic)) != 0 ||
+      hdr.version != vr_parser_version || hdr.n_columns != columns.size() ||
+      hdr.file_size != file_size ||
+      hdr.file_mtime != mtime.time_since_epoch().count() ||
+      cache.size() != sizeof(hdr) + path_bytes +
+                          hdr.n_samples * 8 * (1 + columns.size()) ||
+      std::string_view(cache.data() + sizeof(hdr), hdr.path_length) != path)
+    return false;
+
+  const std::size_t n = hdr.n_samples;
+  const char *p = cache.data() + sizeof(hdr) + path_bytes;
+  std::vector<int64_t> times(n);
+  std::memcpy(times.data(), p, n * sizeof(int64_t));
+  p += n * sizeof(int64_t);
+  m_samples.ptimes.resize(n);
+  std::transform(times.begin(), times.end(), m_samples.ptimes.begin(),
+                 fromNanoseconds);
+  for (auto column : columns) {
+    column->resize(n);
+    std::memcpy(column->data(), p, n * sizeof(double));
+    p += n * sizeof(double);
+  }
+  m_trigger_time = fromNanoseconds(hdr.trigger_time);
+  m_trigger_index = static_cast<int>(hdr.trigger_index);
+  m_init_rotation = hdr.init_rotation;
+  m_hasAcquisition = hdr.has_acquisition != 0;
+  foundTrigger = hdr.found_trigger != 0;
+  return true;
+}
 
-  while (std::getline(ifs, line)) {
-    std::size_t found = line.find(rot_token);
-    if (found != std::string::npos) {
-      pos = line.find(X_token);
-      s1 = line.substr(0, pos);
-      std::istringstream is(s1);
-      is >> std::chrono::parse(logfile_time_fmt, pt);
-      if (old_time != pt) {
-        m_ptimes.push_back(pt);
-        auto pos_mx = line.find(rot_token);
-        auto rot_value = line.substr(pos_mx + 4, std::string::npos);
-        m_rotations.push_back(std::stof(rot_value));
+void VRDataFile::writeCache() {
+  std::error_code ec;
+  if (!use_cache || !fs::is_regular_file(m_filename, ec))
+    return;
+  // a missing or read-only cache directory just means there's no cache
+  try {
+    const auto path = canonicalPath(m_filename);
+    VRCacheHeader hdr{};
+    std::memcpy(hdr.magic, vr_cache_magic, sizeof(hdr.magic));
+    auto columns = cachedColumns();
+    hdr.version = vr_parser_version;
+    hdr.n_columns = columns.size();
+    hdr.file_size = fs::file_size(path);
+    hdr.file_mtime = fs::last_write_time(path).time_since_epoch().count();
+    hdr.n_samples = m_samples.ptimes.size();
+    hdr.trigger_time = toNanoseconds(m_trigger_time);
+    hdr.trigger_index = m_trigger_index;
+    hdr.init_rotation = m_init_rotation;
+    hdr.has_acquisition = m_hasAcquisition;
+    hdr.found_trigger = foundTrigger;
+    hdr.path_length = path.size();
+    for (auto column : columns)
+      if (column->size() != m_samples.ptimes.size())
+        return;
+
+    const fs::path cache_path(getCachePath());
+    fs::create_directories(cache_path.parent_path());
+    // written to a temporary and renamed so readers never see half a file
+    fs::path tmp_path = cache_path;
+    tmp_path += "." + std::to_string(std::random_device{}()) + ".tmp";
+    {
+      std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+      ofs.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+      ofs.write(path.data(), path.size());
+      const char zeros[8] = {};
+      ofs.write(zeros, (8 - path.size() % 8) % 8);
+      std::vector<int64_t> times(m_samples.ptimes.size());
+      std::transform(m_samples.ptimes.begin(), m_samples.ptimes.end(), times.begin(),
+                     toNanoseconds);
+      ofs.write(reinterpret_cast<const char *>(times.data()),
+                times.size() * sizeof(int64_t));
+      for (auto column : columns)
+        ofs.write(reinterpret_cast<const char *>(column->data()),
+                  column->size() * sizeof(double));
+      if (!ofs.good()) {
+        ofs.close();
+        fs::remove(tmp_path);
+        return;
       }
     }
-    auto scope_triggered = line.find(rotary_trigger_token);
-    if (scope_triggered != std::string::npos && foundTrigger == false) {
-      m_hasAcquisition = true;
-      tmp_trigger_ptime = pt;
-      foundTrigger = true;
-    }
-    old_time = pt;
+    fs::rename(tmp_path, cache_path);
+  } catch (const fs::filesystem_error &e) {
+    std::cout << "Could not cache " << m_filename << ": " << e.what()
+              << std::endl;
   }
-  for (unsigned int i = 0; i < m_ptimes.size(); ++i) {
-    if (tmp_trigger_ptime == m_ptimes[i]) {
-      m_trigger_time = m_ptimes[i];
-      setTriggerIndex(i);
+}
+
+/*
+The rotary encoder files are sampled at a high rate so they are split at
+line boundaries into chunks that are parsed on separate threads. Each line
+with a rotation is kept unless its timestamp fails to parse or repeats
+the last timestamp that did parse. Within a chunk that last timestamp is
+only known once the chunk has parsed one itself, so the first sample of
+each chunk is kept provisionally and the chunk seams are resolved when
+the chunks are stitched back together in order. The same goes for the
+time of the first trigger line if it comes before any timestamp in its
+chunk
+*/
+struct RotaryChunk {
+  std::vector<ptime> times;
+  std::vector<double> rotations;
+  bool parsed_time = false; // has any timestamp in the chunk parsed?
+  ptime last_time;          // the last timestamp that parsed
+  bool has_trigger = false;
+  bool trigger_time_known = false;
+  ptime trigger_time;
+};
+
+static void parseRotaryChunk(const char *p, const char *end,
+                             const std::string &fname, RotaryChunk &chunk) {
+  std::string_view line;
+  ptime pt;
+  float rotation;
+  while (nextLine(p, end, line)) {
+    auto pos = line.find(rot_token);
+    if (pos != std::string_view::npos) {
+      ptime old_time = pt;
+      if (parseLogTime(line.substr(0, line.find(X_token)), pt) &&
+          (!chunk.parsed_time || old_time != pt)) {
+        if (!parseNumber(valueAfter(line, rot_token), rotation))
+          throw malformedLine(fname, line);
+        chunk.times.push_back(pt);
+        chunk.rotations.push_back(rotation);
+        chunk.parsed_time = true;
+      }
+    }
+    if (!chunk.has_trigger &&
+        line.find(rotary_trigger_token) != std::string_view::npos) {
+      chunk.has_trigger = true;
+      chunk.trigger_time_known = chunk.parsed_time;
+      chunk.trigger_time = pt;
     }
   }
+  chunk.last_time = pt;
+}
+
+bool RotaryEncoderLoader::load() {
+  std::cout << "Loading rotary encoder file: " << m_filename << std::endl;
+  if (!readCache()) {
+    parse();
+    writeCache();
+  }
   if (calculateDurationsAndRotations()) {
     isloaded = true;
   }
   return isloaded;
 }
+
+void RotaryEncoderLoader::parse() {
+  MappedFile file(m_filename);
+  const char *data = file.data();
+  const std::size_t size = file.size();
+  const std::size_t nchunks =
+      std::max<std::size_t>(size / std::max<std::size_t>(min_chunk_size, 1), 1);
+  std::vector<std::size_t> bounds(nchunks + 1, size);
+  bounds[0] = 0;
+  for (std::size_t i = 1; i < nchunks; ++i) {
+    const std::size_t from = std::max(bounds[i - 1], i * size / nchunks);
+    auto nl = static_cast<const char *>(
+        std::memchr(data + from, '\n', size - from));
+    bounds[i] = nl != nullptr ? nl - data + 1 : size;
+  }
+  std::vector<RotaryChunk> chunks(nchunks);
+  parallelFor(
+      nchunks,
+      [&](unsigned int, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i)
+          parseRotaryChunk(data + bounds[i], data + bounds[i + 1], m_filename,
+                           chunks[i]);
+      });
+
+  // stitch the chunks, dropping the first sample of a chunk if it repeats
+  // the last timestamp of the chunks before it
+  std::size_t total = 0;
+  for (const auto &chunk : chunks)
+    total += chunk.times.size();
+  m_samples.ptimes.reserve(total);
+  m_samples.rotations.reserve(total);
+  ptime last_time;
+  ptime tmp_trigger_ptime;
+  for (const auto &chunk : chunks) {
+    const std::size_t skip =
+        (!chunk.times.empty() && chunk.times.front() == last_time) ? 1 : 0;
+    m_samples.ptimes.insert(m_samples.ptimes.end(), chunk.times.begin() + skip,
+                    chunk.times.end());
+    m_samples.rotations.insert(m_samples.rotations.end(), chunk.rotations.begin() + skip,
+                       chunk.rotations.end());
+    if (chunk.has_trigger && foundTrigger == false) {
+      m_hasAcquisition = true;
+      tmp_trigger_ptime =
+          chunk.trigger_time_known ? chunk.trigger_time : last_time;
+      foundTrigger = true;
+    }
+    if (chunk.parsed_time)
+      last_time = chunk.last_time;
+  }
+  for (unsigned int i = 0; i < m_samples.ptimes.size(); ++i) {
+    if (tmp_trigger_ptime == m_samples.ptimes[i]) {
+      m_trigger_time = m_samples.ptimes[i];
+      setTriggerIndex(i);
+    }
+  }
+}
+
 bool RotaryEncoderLoader::calculateDurationsAndRotations() {
   if (!containsAcquisition()) {
     std::cout << "Warning: The file " << m_filename
@@ -125,9 +562,9 @@ bool RotaryEncoderLoader::calculateDurationsAndRotations() {
     std::cout << "Calculating rotations and times from rotary encoder data..."
               << std::endl;
   }
-  auto result = _calculateDurationsAndRotations(false);
+  auto result = _calculateDurationsAndRotations(rotary_file_units_per_turn);
   std::cout << "Finished calculating rotations and times." << std::endl;
-  std::cout << "The rotary encoder file has " << m_times.size()
+  std::cout << "The rotary encoder file has " << m_samples.times.size()
             << " timestamps in it." << std::endl;
   return result;
 }
@@ -141,37 +578,45 @@ bool LogFileLoader::calculateDurationsAndRotations() {
     std::cout << "Calculating rotations and times from log file data..."
               << std::endl;
   }
-  auto result = _calculateDurationsAndRotations();
-  std::copy(m_x_translation.begin(), m_x_translation.end(),
-            std::back_inserter(m_original_x_translation));
-  std::copy(m_z_translation.begin(), m_z_translation.end(),
-            std::back_inserter(m_original_z_translation));
-  zeroNormalize(m_x_translation);
-  zeroNormalize(m_z_translation);
+  auto result =
+      _calculateDurationsAndRotations(rotary_encoder_units_per_turn);
+  m_samples.x = m_samples.raw_x;
+  m_samples.z = m_samples.raw_z;
+  zeroNormalize(m_samples.x);
+  zeroNormalize(m_samples.z);
   std::cout << "Finished calculating rotations and times." << std::endl;
-  std::cout << "The log file file has " << m_times.size()
+  std::cout << "The log file file has " << m_samples.times.size()
             << " timestamps in it." << std::endl;
   return result;
 };
 
 bool LogFileLoader::load() {
-  std::ifstream ifs(m_filename, std::ifstream::in);
-  ifs.unsetf(std::ios_base::skipws);
-  std::string line, old_line, s1;
+  std::cout << "\nLoading log file: " << m_filename << std::endl;
+  if (!readCache()) {
+    parse();
+    writeCache();
+  }
+  if (calculateDurationsAndRotations()) {
+    isloaded = true;
+  }
+  return isloaded;
+}
+
+void LogFileLoader::parse() {
+  MappedFile file(m_filename);
+  const char *p = file.data();
+  const char *end = p + file.size();
+  std::string_view line;
   ptime pt;
-  ptime
-      old_time; //(boost::gregorian::date(2002,1,10),boost::posix_time::time_duration(1,2,3));//
-                // old line is our "memory" - see comment in while loop below
-                // and header file
-                // see comment before loop that sets trigger index below
-                // (after the next while statement)
+  // old_time is our "memory" - see comment in while loop below
+  ptime old_time;
+  // see comment before loop that sets trigger index below
+  // (after the next while statement)
   // to understand why this temporary is used
   ptime tmp_trigger_ptime;
-  std::size_t pos, posZ;
-  double x_trans, z_trans;
-  unsigned int trig_index = 0;
-  std::cout << "\nLoading log file: " << m_filename << std::endl;
-  while (std::getline(ifs, line)) {
+  float x_trans, z_trans;
+  int rotation;
+  while (nextLine(p, end, line)) {
     /*grab the angular reference from the top of the file
     // in newer versions of the logfile; in older versions
     // this is just before the line 'MicroscopeTriggered'
@@ -182,61 +627,34 @@ bool LogFileLoader::load() {
     or its attached bit of kit, that means sometimes we get
     the same sample twice
     */
-    pos = line.find(init_rot_token);
-    if (pos != std::string::npos) {
+    auto pos = line.find(init_rot_token);
+    if (pos != std::string_view::npos) {
       auto s2 = line.substr(pos);
-      pos = s2.find_last_of(space_token);
-      auto tmp = s2.substr(pos);
-      m_init_rotation = std::stoi(tmp);
+      int init_rotation;
+      if (!parseNumber(s2.substr(s2.find_last_of(space_token)),
+                       init_rotation))
+        throw malformedLine(m_filename, line);
+      m_init_rotation = init_rotation;
     }
-    std::size_t found = line.find(rot_token);
-    if (found != std::string::npos) {
+    if (line.find(rot_token) != std::string_view::npos) {
       // get the date...
-      pos = line.find(X_token);
-      s1 = line.substr(0, pos);
-      std::istringstream is(s1);
-      is >> std::chrono::parse(logfile_time_fmt, pt);
+      parseLogTime(line.substr(0, line.find(X_token)), pt);
       if (old_time != pt) // ie skip repeats of the same time (logging error?)
       {
-        // grab the posix time
-        m_ptimes.push_back(pt);
-
-        // get the translation...
-        auto pos_MX = line.find(X_token);
-        auto pos_MY = line.find(Z_token);
-        auto pos_Rot = line.find(rot_token);
-
-        s1 = line.substr(pos_MX, pos_MY - pos_MX);
-        auto tmp_pos = s1.find(equal_token);
-        auto s2 = s1.substr(tmp_pos + 1);
-        x_trans = std::stof(s2);
-        m_x_translation.push_back(x_trans);
-
-        s1 = line.substr(pos_MY, pos_Rot - pos_MY);
-        tmp_pos = s1.find(equal_token);
-        s2 = s1.substr(tmp_pos + 1);
-        z_trans = std::stof(s2);
-        m_z_translation.push_back(z_trans);
-
-        // grab the amount of rotation...
-        pos = line.find(rot_token);
-        s1 = line.substr(pos);
-        pos = s1.find(equal_token);
-        s1 = s1.substr(pos);
-        pos = s1.find(mouse_move_token);
-        s1 = s1.substr(1, pos - 2);
-        m_rotations.push_back(std::stoi(s1));
+        // get the translation and the amount of rotation
+        if (!parseNumber(valueAfter(line, X_token), x_trans) ||
+            !parseNumber(valueAfter(line, Z_token), z_trans) ||
+            !parseNumber(valueAfter(line, rot_token), rotation))
+          throw malformedLine(m_filename, line);
+        m_samples.ptimes.push_back(pt);
+        m_samples.raw_x.push_back(x_trans);
+        m_samples.raw_z.push_back(z_trans);
+        m_samples.rotations.push_back(rotation);
       }
     }
-
-    std::size_t scope_triggered = line.find(scope_token);
-    if (scope_triggered != std::string::npos) {
-      m_hasAcquisition = true;
-      tmp_trigger_ptime = pt;
-    }
-    // deal with newer versions of the logfile
-    scope_triggered = line.find(spacebar_token);
-    if (scope_triggered != std::string::npos) {
+    // deal with newer versions of the logfile too
+    if (line.find(scope_token) != std::string_view::npos ||
+        line.find(spacebar_token) != std::string_view::npos) {
       m_hasAcquisition = true;
       tmp_trigger_ptime = pt;
     }
@@ -247,16 +665,12 @@ bool LogFileLoader::load() {
   was started, so we modify the trigger_ptime and the trigger index to be 1
   item further ahead than the time detected in the logfile
   */
-  for (unsigned int i = 0; i < m_ptimes.size(); ++i) {
-    if (tmp_trigger_ptime == m_ptimes[i]) {
-      m_trigger_time = m_ptimes[i];
+  for (unsigned int i = 0; i < m_samples.ptimes.size(); ++i) {
+    if (tmp_trigger_ptime == m_samples.ptimes[i]) {
+      m_trigger_time = m_samples.ptimes[i];
       setTriggerIndex(i);
     }
   }
-  if (calculateDurationsAndRotations()) {
-    isloaded = true;
-  }
-  return isloaded;
 }
 
 } // namespace twophoton
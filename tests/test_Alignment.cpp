@@ -0,0 +1,54 @@
+#include "../include/ScanImageTiff.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+TEST(AlignmentTest, BracketTimes) {
+  const std::vector<double> samples{0.0, 1.0, 2.0, 4.0};
+  const std::vector<double> at{-1.0, 0.0, 0.5, 2.0, 3.0, 5.0};
+  auto bracket = twophoton::bracketTimes(samples, at);
+  const std::vector<std::size_t> index{0, 0, 0, 2, 2, 3};
+  const std::vector<double> weight{0.0, 0.0, 0.5, 0.0, 0.5, 0.0};
+  EXPECT_EQ(bracket.index, index);
+  EXPECT_EQ(bracket.weight, weight);
+}
+
+TEST(AlignmentTest, InterpolateLinear) {
+  const std::vector<double> samples{0.0, 1.0, 2.0};
+  const std::vector<double> values{10.0, 20.0, 40.0};
+  const std::vector<double> at{0.25, 1.5, 3.0};
+  auto result = twophoton::interpolateLinear(
+      values, twophoton::bracketTimes(samples, at));
+  EXPECT_DOUBLE_EQ(result[0], 12.5);
+  EXPECT_DOUBLE_EQ(result[1], 30.0);
+  EXPECT_DOUBLE_EQ(result[2], 40.0);
+}
+
+TEST(AlignmentTest, InterpolateAngleWraps) {
+  const std::vector<double> samples{0.0, 1.0};
+  // halfway between just below 2PI and just above 0 is 0, not PI
+  const std::vector<double> values{2 * M_PI - 0.1, 0.1};
+  const std::vector<double> at{0.5, 0.75};
+  auto result = twophoton::interpolateAngle(
+      values, twophoton::bracketTimes(samples, at));
+  EXPECT_NEAR(result[0], 0.0, 1e-12);
+  EXPECT_NEAR(result[1], 0.05, 1e-12);
+}
+
+TEST(AlignmentTest, ResampleNearestAndBoxcar) {
+  const std::vector<double> samples{0.0, 0.5, 1.0, 1.5, 2.0, 2.5};
+  const std::vector<double> values{0.0, 1.0, 2.0, 3.0, 4.0, 5.0};
+  const std::vector<double> grid{0.0, 1.0, 2.0};
+  twophoton::Resampler nearest(samples, grid,
+                               twophoton::ResampleMode::kNearest);
+  EXPECT_EQ(nearest(values), (std::vector<double>{0.0, 2.0, 4.0}));
+  // the bins are [-0.5, 0.5), [0.5, 1.5) and [1.5, 2.5)
+  twophoton::Resampler boxcar(samples, grid, twophoton::ResampleMode::kBoxcar);
+  EXPECT_EQ(boxcar(values), (std::vector<double>{0.0, 1.5, 3.5}));
+}
+
+TEST(AlignmentTest, UnwrapAngles) {
+  const std::vector<double> angles{2 * M_PI - 0.1, 0.1, 0.3};
+  auto unwrapped = twophoton::unwrapAngles(angles);
+  EXPECT_NEAR(unwrapped[1], 2 * M_PI + 0.1, 1e-12);
+  EXPECT_NEAR(unwrapped[2], 2 * M_PI + 0.3, 1e-12);
+}
@@ -0,0 +1,132 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <cassert>
+#include <filesystem>
+#include <functional>
+#include <gtest/gtest.h>
+#include <pybind11/embed.h>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <string>
+
+namespace fs = std::filesystem;
+namespace py = pybind11;
+
+const static fs::path tiff_name{"test_file1.tif"};
+const static fs::path log_name{"test_logfile.txt"};
+
+/*
+The async functions hand back asyncio futures that are completed from the
+worker threads, so each test runs a coroutine on a new event loop in an
+embedded interpreter. The coroutine awaits what start() returns, which
+is called once the loop is running as the async functions need it to be
+*/
+class AsyncIOTest : public ::testing::Test {
+protected:
+  static void SetUpTestSuite() {
+    // the interpreter lives until the process exits
+    if (!Py_IsInitialized())
+      py::initialize_interpreter();
+  }
+  void SetUp() override {
+    assert(fs::exists(tiff_name));
+    S.openTiff(tiff_name.string(), "r");
+  }
+  // the result of awaiting body (a Python expression using start) in a
+  // coroutine run to completion with asyncio.run()
+  py::object run(std::function<py::object()> start,
+                 const std::string &body = "await start()") {
+    py::dict scope;
+    scope["asyncio"] = py::module_::import("asyncio");
+    scope["start"] = py::cpp_function(std::move(start));
+    py::exec("async def main():\n    return " + body + "\n", scope);
+    return py::eval("asyncio.run(main())", scope);
+  }
+  // whether running start raises a Python exception of type
+  bool raises(std::function<py::object()> start, PyObject *type) {
+    try {
+      run(std::move(start));
+    } catch (py::error_already_set &e) {
+      return e.matches(type);
+    }
+    return false;
+  }
+  twophoton::SITiffIO S{};
+};
+
+TEST_F(AsyncIOTest, CountDirectories) {
+  auto n = run([this]() { return S.countDirectoriesAsync(); });
+  EXPECT_EQ(n.cast<unsigned int>(), S.countDirectories());
+}
+
+TEST_F(AsyncIOTest, ReadFrames) {
+  auto result = run([this]() { return S.readFramesAsync({3, 1}, 1); });
+  auto frames = result.cast<py::array_t<int16_t>>();
+  auto [h, w] = S.getImageSize();
+  ASSERT_EQ(frames.ndim(), 3);
+  EXPECT_EQ(frames.shape(0), 2);
+  EXPECT_EQ(frames.shape(1), h);
+  EXPECT_EQ(frames.shape(2), w);
+  twophoton::SITiffReader R{tiff_name.string()};
+  EXPECT_TRUE(R.open());
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  const std::size_t frame_size = std::size_t(h) * w;
+  // in the order asked for
+  auto third = R.readframe(2 * nchans);
+  auto first = R.readframe(0);
+  EXPECT_TRUE(std::equal(third.begin(), third.end(), frames.data()));
+  EXPECT_TRUE(
+      std::equal(first.begin(), first.end(), frames.data() + frame_size));
+  R.close();
+}
+
+TEST_F(AsyncIOTest, Tail) {
+  EXPECT_TRUE(S.openLog(log_name.string()));
+  const unsigned int n = 2;
+  auto result = run([this]() { return S.tailAsync(n); }).cast<py::tuple>();
+  ASSERT_EQ(result.size(), 2);
+  // the last n frames of the display channel, as as_array has them
+  auto array = S.asArray(0);
+  const py::ssize_t n_frames = array.nFrames();
+  py::object whole = array.toNumpy(py::none(), py::none());
+  py::object last = whole[py::slice(n_frames - n, n_frames, 1)];
+  EXPECT_TRUE(py::module_::import("numpy")
+                  .attr("array_equal")(result[0], last)
+                  .cast<bool>());
+  // the transforms now start at the first of them and the angles are theirs
+  auto transforms = S.getAllTransforms();
+  ASSERT_NE(transforms, nullptr);
+  ASSERT_EQ(transforms->size(), n);
+  EXPECT_EQ(transforms->frame_indices.front(), array.nFrames() - n);
+  auto angles = result[1].cast<py::list>();
+  ASSERT_EQ(angles.size(), n);
+  for (unsigned int i = 0; i < n; ++i)
+    EXPECT_EQ(angles[i].cast<double>(), transforms->theta[i]);
+}
+
+TEST_F(AsyncIOTest, ConcurrentCalls) {
+  // more calls than there are workers, all in flight at once
+  auto results =
+      run([this]() { return S.countDirectoriesAsync(); },
+          "await asyncio.gather(*(start() for _ in range(10)))")
+          .cast<py::list>();
+  EXPECT_EQ(results.size(), 10);
+  for (auto n : results)
+    EXPECT_EQ(n.cast<unsigned int>(), S.countDirectories());
+}
+
+TEST_F(AsyncIOTest, ExceptionsPropagate) {
+  // thrown on a worker thread and raised from the await as the exception
+  // pybind11 would have translated them to
+  EXPECT_TRUE(raises([this]() { return S.readFramesAsync({0}); },
+                     PyExc_ValueError));
+  EXPECT_TRUE(raises([this]() { return S.tailAsync(0); }, PyExc_ValueError));
+  // the workers carry on after a failure
+  auto n = run([this]() { return S.countDirectoriesAsync(); });
+  EXPECT_EQ(n.cast<unsigned int>(), S.countDirectories());
+}
+
+TEST_F(AsyncIOTest, NeedsRunningLoop) {
+  // without a running event loop there is nowhere to deliver the result
+  EXPECT_THROW(S.countDirectoriesAsync(), py::error_already_set);
+}
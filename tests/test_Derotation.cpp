@@ -0,0 +1,74 @@
+#include "../include/ScanImageTiff.h"
+#include <cstdint>
+#include <gtest/gtest.h>
+
+class DerotatorTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    src = arma::Mat<int16_t>(h, w, arma::fill::zeros);
+    // frames are row-major in memory so this is the pixel at x = 3, y = 0
+    src.memptr()[3] = 100;
+  }
+  const unsigned int h = 4;
+  const unsigned int w = 4;
+  arma::Mat<int16_t> src;
+};
+
+TEST_F(DerotatorTest, ZeroAngleIsIdentity) {
+  twophoton::Derotator D{h, w, twophoton::InterpolationType::kBilinear};
+  auto dst = D.derotate(src, 0.0);
+  for (unsigned int i = 0; i < src.n_elem; ++i)
+    EXPECT_EQ(dst.memptr()[i], src.memptr()[i]);
+}
+
+TEST_F(DerotatorTest, QuarterTurn) {
+  for (auto interp : {twophoton::InterpolationType::kNearest,
+                      twophoton::InterpolationType::kBilinear,
+                      twophoton::InterpolationType::kBicubic}) {
+    twophoton::Derotator D{h, w, interp};
+    auto dst = D.derotate(src, M_PI / 2);
+    // the output pixel at (0, 0) samples the source at (3, 0)
+    EXPECT_EQ(dst.memptr()[0], 100);
+    EXPECT_EQ(dst.memptr()[3], 0);
+  }
+}
+
+TEST_F(DerotatorTest, WrongSizeFrame) {
+  twophoton::Derotator D{8, 8};
+  EXPECT_TRUE(D.derotate(src, 0.1).empty());
+}
+
+TEST_F(DerotatorTest, SameAngleForEveryRow) {
+  twophoton::Derotator D{h, w, twophoton::InterpolationType::kNearest};
+  const std::vector<double> angles(h, M_PI / 2);
+  auto rows = D.derotate(src, angles);
+  auto frame = D.derotate(src, M_PI / 2);
+  for (unsigned int i = 0; i < src.n_elem; ++i)
+    EXPECT_EQ(rows.memptr()[i], frame.memptr()[i]);
+}
+
+TEST(DerotatorRows, EachRowUsesItsOwnAngle) {
+  const unsigned int h = 9, w = 9;
+  arma::Mat<int16_t> src(h, w);
+  for (unsigned int i = 0; i < src.n_elem; ++i)
+    src.memptr()[i] = static_cast<int16_t>((i * 37) % 101);
+  // the bearing turns by a degree per line
+  std::vector<double> angles(h);
+  for (unsigned int r = 0; r < h; ++r)
+    angles[r] = r * twophoton::deg2rad(1.0);
+  twophoton::Derotator D{h, w, twophoton::InterpolationType::kNearest};
+  auto rows = D.derotate(src, angles);
+  // the middle column of each row comes from the same row of the source so
+  // matches derotating the whole frame by that row's angle
+  for (unsigned int y = 0; y < h; ++y) {
+    auto frame = D.derotate(src, angles[y]);
+    EXPECT_EQ(rows.memptr()[y * w + w / 2], frame.memptr()[y * w + w / 2]);
+  }
+}
+
+TEST(DerotatorRows, WrongNumberOfAngles) {
+  twophoton::Derotator D{4, 4};
+  arma::Mat<int16_t> src(4, 4, arma::fill::zeros);
+  EXPECT_THROW(D.derotate(src, std::vector<double>(3, 0.0)),
+               std::invalid_argument);
+}
@@ -0,0 +1,274 @@
+#include "../include/ScanImageTiff.h"
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <vector>
+
+// smooth blobs scattered over a background, h x w row-major, moved by
+// (dx, dy) and magnified by scale about the centre
+static std::vector<float> blobs(unsigned int h, unsigned int w, double dx,
+                                double dy, double scale = 1.0) {
+  struct Blob {
+    double y, x, sigma;
+  };
+  std::vector<Blob> centres;
+  uint32_t seed = 1;
+  auto next = [&seed]() {
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 8) % 1000 / 1000.0;
+  };
+  for (int i = 0; i < 60; ++i)
+    centres.push_back({next(), next(), 2 + 4 * next()});
+  const double cx = (w - 1) / 2.0, cy = (h - 1) / 2.0;
+  std::vector<float> img(std::size_t(h) * w);
+  for (unsigned int y = 0; y < h; ++y) {
+    for (unsigned int x = 0; x < w; ++x) {
+      double v = 100;
+      for (const auto &c : centres) {
+        const double ex = x - dx - cx - (c.x * w - cx) * scale;
+        const double ey = y - dy - cy - (c.y * h - cy) * scale;
+        const double sigma = c.sigma * scale;
+        v += 1000 * std::exp(-(ex * ex + ey * ey) / (2 * sigma * sigma));
+      }
+      img[y * w + x] = float(v);
+    }
+  }
+  return img;
+}
+
+static std::vector<int16_t> toInt16(const std::vector<float> &img) {
+  return std::vector<int16_t>(img.begin(), img.end());
+}
+
+TEST(FFTTest, MatchesDFT) {
+  const std::size_t rows = 4, cols = 8;
+  std::vector<std::complex<float>> data(rows * cols);
+  for (std::size_t i = 0; i < data.size(); ++i)
+    data[i] = {float(i % 5), float(i % 3) - 1.0f};
+  auto spectrum = data;
+  twophoton::fft2d(spectrum.data(), rows, cols);
+  for (std::size_t ky = 0; ky < rows; ++ky) {
+    for (std::size_t kx = 0; kx < cols; ++kx) {
+      std::complex<double> sum = 0;
+      for (std::size_t y = 0; y < rows; ++y)
+        for (std::size_t x = 0; x < cols; ++x)
+          sum += std::complex<double>(data[y * cols + x]) *
+                 std::polar(1.0, -2 * M_PI *
+                                     (double(ky * y) / rows +
+                                      double(kx * x) / cols));
+      EXPECT_NEAR(std::abs(sum - std::complex<double>(
+                                     spectrum[ky * cols + kx])),
+                  0, 1e-4);
+    }
+  }
+  // the inverse is unscaled
+  twophoton::fft2d(spectrum.data(), rows, cols, true);
+  for (std::size_t i = 0; i < data.size(); ++i)
+    EXPECT_NEAR(std::abs(spectrum[i] / float(rows * cols) - data[i]), 0, 1e-5);
+}
+
+TEST(FFTTest, OnlyPowersOfTwo) {
+  EXPECT_THROW(twophoton::FFTPlan(12), std::invalid_argument);
+  EXPECT_EQ(twophoton::FFTPlan::get(64), twophoton::FFTPlan::get(64));
+}
+
+TEST(PhaseCorrelatorTest, FindsShifts) {
+  // not powers of two so the frames are padded
+  const unsigned int h = 100, w = 120;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::PhaseCorrelator P(reference.data(), h, w);
+  for (auto [dx, dy] : {std::pair{0.0, 0.0}, {3.0, -5.0}, {-7.5, 2.25}}) {
+    auto frame = toInt16(blobs(h, w, dx, dy));
+    auto [ex, ey] = P.shift(frame.data());
+    EXPECT_NEAR(ex, dx, 0.25);
+    EXPECT_NEAR(ey, dy, 0.25);
+  }
+}
+
+TEST(PhaseCorrelatorTest, MaxShift) {
+  const unsigned int h = 64, w = 64;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::PhaseCorrelator P(reference.data(), h, w, 4);
+  auto frame = toInt16(blobs(h, w, 10, 0));
+  auto [ex, ey] = P.shift(frame.data());
+  EXPECT_LE(std::abs(ex), 4.5);
+  EXPECT_LE(std::abs(ey), 4.5);
+}
+
+TEST(LogPolarEstimatorTest, FindsRotation) {
+  const unsigned int h = 128, w = 128;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::LogPolarEstimator E(reference.data(), h, w);
+  twophoton::Derotator D(h, w, twophoton::InterpolationType::kBicubic);
+  auto src = toInt16(reference);
+  std::vector<int16_t> rotated(h * w), frame(h * w);
+  for (double angle : {0.0, 0.05, -0.12}) {
+    // the reference rotated by angle and moved, which shouldn't matter
+    D.derotate(src.data(), rotated.data(), -angle);
+    twophoton::translateFrame(rotated.data(), frame.data(), h, w, 3, -2);
+    auto [a, scale] = E.estimate(frame.data());
+    EXPECT_NEAR(a, angle, twophoton::deg2rad(0.5));
+    EXPECT_NEAR(scale, 1.0, 0.01);
+  }
+}
+
+TEST(LogPolarEstimatorTest, FindsScale) {
+  const unsigned int h = 128, w = 128;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::LogPolarEstimator E(reference.data(), h, w);
+  twophoton::Derotator D(h, w, twophoton::InterpolationType::kBicubic);
+  std::vector<int16_t> frame(h * w);
+  for (auto [angle, scale] :
+       {std::pair{0.0, 1.1}, {0.06, 1.1}, {-0.04, 0.92}}) {
+    // the reference magnified then rotated by angle
+    auto magnified = toInt16(blobs(h, w, 0, 0, scale));
+    D.derotate(magnified.data(), frame.data(), -angle);
+    auto [a, s] = E.estimate(frame.data());
+    EXPECT_NEAR(a, angle, twophoton::deg2rad(0.5));
+    EXPECT_NEAR(s, scale, 0.01);
+  }
+}
+
+TEST(PiecewiseRegistrationTest, FindsPatchShifts) {
+  const unsigned int h = 192, w = 160;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::PiecewiseRegistration P(reference.data(), h, w, 64, 0.5);
+  EXPECT_EQ(P.nPatchRows(), 5);
+  EXPECT_EQ(P.nPatchCols(), 4);
+  auto frame = toInt16(blobs(h, w, 3, -2));
+  auto shifts = P.shifts(frame.data());
+  ASSERT_EQ(shifts.size(), 2 * P.nPatches());
+  for (std::size_t i = 0; i < P.nPatches(); ++i) {
+    EXPECT_NEAR(shifts[i], 3, 0.5);
+    EXPECT_NEAR(shifts[P.nPatches() + i], -2, 0.5);
+  }
+  EXPECT_THROW(twophoton::PiecewiseRegistration(reference.data(), h, w, 64, 1),
+               std::invalid_argument);
+}
+
+TEST(PiecewiseRegistrationTest, WarpUndoesShifts) {
+  const unsigned int h = 64, w = 64;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::PiecewiseRegistration P(reference.data(), h, w, 32, 0.5);
+  auto src = toInt16(blobs(h, w, 1.5, -2));
+  // the same shift everywhere is a translation
+  std::vector<double> shifts(2 * P.nPatches(), 1.5);
+  std::fill(shifts.begin() + P.nPatches(), shifts.end(), -2.0);
+  std::vector<int16_t> warped(h * w), translated(h * w);
+  P.warp(src.data(), warped.data(), shifts);
+  twophoton::translateFrame(src.data(), translated.data(), h, w, -1.5, 2);
+  EXPECT_EQ(warped, translated);
+  shifts.pop_back();
+  EXPECT_THROW(P.warp(src.data(), warped.data(), shifts),
+               std::invalid_argument);
+}
+
+TEST(TemplateTrackerTest, FollowsDrift) {
+  const unsigned int h = 128, w = 128;
+  auto reference = blobs(h, w, 0, 0);
+  // a 32 x 32 box with its top-left corner at (48, 40)
+  std::vector<float> tmpl;
+  for (unsigned int y = 40; y < 72; ++y)
+    tmpl.insert(tmpl.end(), reference.begin() + y * w + 48,
+                reference.begin() + y * w + 80);
+  twophoton::TemplateTracker T(tmpl.data(), 32, 32, h, w, 48, 40, 4);
+  // further in all than the search window, but never more than it per frame
+  for (auto [dx, dy] : {std::pair{1.0, 0.5}, {3.5, -1.0}, {6.0, -3.25},
+                        {8.5, -6.0}, {9.0, -7.5}}) {
+    auto frame = toInt16(blobs(h, w, dx, dy));
+    auto [ex, ey] = T.track(frame.data());
+    EXPECT_NEAR(ex, dx, 0.25);
+    EXPECT_NEAR(ey, dy, 0.25);
+    EXPECT_GT(T.getScore(), 0.9);
+  }
+  std::vector<float> flat(16 * 16, 1.0f);
+  EXPECT_THROW(twophoton::TemplateTracker(flat.data(), 16, 16, h, w, 0, 0),
+               std::invalid_argument);
+  EXPECT_THROW(twophoton::TemplateTracker(tmpl.data(), 32, 32, h, w, 100, 0),
+               std::invalid_argument);
+}
+
+TEST(OpticalFlowTest, FindsTranslation) {
+  const unsigned int h = 128, w = 128;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::OpticalFlow F(reference.data(), h, w);
+  std::vector<float> u, v;
+  // beyond what one level could follow
+  for (auto [dx, dy] : {std::pair{0.0, 0.0}, {1.5, -0.75}, {-4.0, 5.5}}) {
+    auto frame = toInt16(blobs(h, w, dx, dy));
+    F.flow(frame.data(), u, v);
+    ASSERT_EQ(u.size(), h * w);
+    // the middle of the frame, where nothing comes in from outside it
+    double mean_u = 0, mean_v = 0;
+    unsigned int n = 0;
+    for (unsigned int y = 24; y < h - 24; ++y) {
+      for (unsigned int x = 24; x < w - 24; ++x) {
+        mean_u += u[y * w + x];
+        mean_v += v[y * w + x];
+        ++n;
+      }
+    }
+    EXPECT_NEAR(mean_u / n, dx, 0.2);
+    EXPECT_NEAR(mean_v / n, dy, 0.2);
+  }
+}
+
+TEST(OpticalFlowTest, FollowsVaryingFlow) {
+  const unsigned int h = 128, w = 128, step = 32;
+  auto reference = blobs(h, w, 0, 0);
+  twophoton::OpticalFlow F(reference.data(), h, w);
+  // the left half moves right and the right half left
+  auto left = blobs(h, w, 2, 0.5);
+  auto right = blobs(h, w, -2, -0.5);
+  std::vector<float> spliced(h * w);
+  for (unsigned int y = 0; y < h; ++y) {
+    for (unsigned int x = 0; x < w; ++x)
+      spliced[y * w + x] = x < w / 2 ? left[y * w + x] : right[y * w + x];
+  }
+  auto frame = toInt16(spliced);
+  std::vector<float> u, v;
+  F.flow(frame.data(), u, v);
+  twophoton::OpticalFlowFields fields;
+  fields.n_frames = 2;
+  fields.step = step;
+  fields.rows = h / step;
+  fields.cols = w / step;
+  fields.values.assign(2 * 2 * fields.rows * fields.cols, 0);
+  // into the second field, leaving the first alone
+  auto [mean, largest] = fields.store(1, u, v, h, w);
+  EXPECT_TRUE(std::all_of(fields.values.begin(),
+                          fields.values.begin() + fields.values.size() / 2,
+                          [](int16_t q) { return q == 0; }));
+  const int16_t *cells = fields.values.data() + fields.values.size() / 2;
+  const float q = twophoton::OpticalFlowFields::quantum;
+  // the cells away from the top and bottom of the frame and the seam
+  for (unsigned int r = 1; r + 1 < fields.rows; ++r) {
+    for (unsigned int c : {0u, fields.cols - 1}) {
+      const std::size_t i = 2 * (std::size_t(r) * fields.cols + c);
+      const double sign = c < fields.cols / 2 ? 1 : -1;
+      EXPECT_NEAR(cells[i] * q, 2 * sign, 0.25);
+      EXPECT_NEAR(cells[i + 1] * q, 0.5 * sign, 0.25);
+    }
+  }
+  // both halves move by the same amount
+  EXPECT_NEAR(mean, std::hypot(2, 0.5), 0.3);
+  EXPECT_GE(largest, mean);
+}
+
+TEST(TranslateFrameTest, UndoesShift) {
+  const unsigned int h = 8, w = 8;
+  std::vector<int16_t> src(h * w, 0), dst(h * w), back(h * w);
+  src[3 * w + 4] = 100;
+  twophoton::translateFrame(src.data(), dst.data(), h, w, 2, -1);
+  EXPECT_EQ(dst[2 * w + 6], 100);
+  EXPECT_EQ(dst[3 * w + 4], 0);
+  twophoton::translateFrame(src.data(), dst.data(), h, w, 0.5, 0);
+  EXPECT_EQ(dst[3 * w + 4], 50);
+  EXPECT_EQ(dst[3 * w + 5], 50);
+  // pixels from outside the frame are zero
+  std::vector<int16_t> ones(h * w, 1);
+  twophoton::translateFrame(ones.data(), dst.data(), h, w, 3, 0);
+  EXPECT_EQ(dst[0], 0);
+  EXPECT_EQ(dst[3], 1);
+}
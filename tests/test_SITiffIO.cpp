@@ -1,12 +1,19 @@
 #include "../include/ScanImageTiff.h"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <pybind11/embed.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <random>
+#include <zlib.h>
 
 namespace fs = std::filesystem;
 
@@ -77,4 +84,563 @@ TEST_F(SITiffIOTest, Tags) {
   EXPECT_STRNE(S.getSWTag(1).c_str(), "blah");
   EXPECT_STRNE(S.getImageDescTag(1).c_str(), "blah");
   EXPECT_NE(S.getChannelLUT().first, -1000000);
-}
\ No newline at end of file
+}
+
+TEST_F(SITiffIOTest, SaveFrames) {
+  const fs::path out_name("test_save_frames.tif");
+  EXPECT_TRUE(S.saveFrames(out_name.string(), 1, 2, {1}));
+  twophoton::SITiffReader R{out_name.string()};
+  EXPECT_TRUE(R.open());
+  EXPECT_EQ(R.countDirectories(), 2);
+  // the strips are copied so the frames are the source's to the pixel
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  for (unsigned int i = 0; i < 2; ++i) {
+    auto written = R.readframe(i);
+    auto expected = src.readframe(i * nchans);
+    ASSERT_EQ(written.n_elem, expected.n_elem);
+    EXPECT_TRUE(std::equal(written.begin(), written.end(), expected.begin()));
+  }
+  src.close();
+  R.close();
+  fs::remove(out_name);
+}
+
+// the number of channels a file written by SITiffIO says it holds
+static unsigned int savedChannels(const fs::path &path) {
+  twophoton::SITiffIO S{};
+  if (!S.openTiff(path.string(), "r"))
+    return 0;
+  return std::get<0>(S.getNChannels());
+}
+
+// transform T of frame (0-indexed) or an empty matrix if it hasn't one
+static arma::mat frameTransform(const twophoton::TransformTable &table,
+                                twophoton::TransformType T,
+                                unsigned int frame) {
+  for (std::size_t row = 0; row < table.size(); ++row) {
+    if (table.frame_indices[row] == frame)
+      return table.getTransform(T, row);
+  }
+  return arma::mat();
+}
+
+/*
+Writes n_frames h x w frames of every channel to path with the ScanImage
+headers of the test file, so SITiffIO opens it the same way. The first
+channel's pixel (y, x) of frame f (0-indexed) is pixel(f, y, x) and the
+other channels are zero
+*/
+static void writeTestFrames(
+    const fs::path &path, unsigned int n_frames, unsigned int h,
+    unsigned int w,
+    const std::function<int16_t(unsigned int, unsigned int, unsigned int)>
+        &pixel) {
+  twophoton::SITiffIO S{};
+  ASSERT_TRUE(S.openTiff(tiff_name.string(), "r"));
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  const unsigned int n_dirs = S.countDirectories();
+  twophoton::SITiffReader R{tiff_name.string()};
+  ASSERT_TRUE(R.open());
+  twophoton::SITiffWriter W;
+  ASSERT_TRUE(W.open(path.string()));
+  std::string swTag, imDescTag;
+  for (unsigned int f = 0; f < n_frames; ++f) {
+    for (unsigned int c = 0; c < nchans; ++c) {
+      // the test file's headers are reused if it has fewer frames
+      ASSERT_TRUE(R.readTags((f * nchans + c) % n_dirs, swTag, imDescTag));
+      arma::Mat<int16_t> img(h, w, arma::fill::zeros);
+      int16_t *p = img.memptr();
+      for (unsigned int y = 0; y < h && c == 0; ++y) {
+        for (unsigned int x = 0; x < w; ++x)
+          p[std::size_t(y) * w + x] = pixel(f, y, x);
+      }
+      W.writeSIHdr(swTag, imDescTag);
+      W.writeHdr(img);
+      W << img;
+    }
+  }
+  W.close();
+  R.close();
+}
+
+TEST_F(SITiffIOTest, Derotate) {
+  const fs::path out_name("test_derotated.tif");
+  S.openLog(log_name.string());
+  S.interpolateIndices(0);
+  EXPECT_TRUE(S.derotate(out_name.string(), 1, 3));
+  // the header says the file holds the one channel so it reopens with
+  // the frames where they were written
+  EXPECT_EQ(savedChannels(out_name), 1);
+  auto angle = frameTransform(*S.getAllTransforms(),
+                              twophoton::TransformType::kInitialRotation, 1);
+  ASSERT_EQ(angle.n_elem, 1);
+  auto [h, w] = S.getImageSize();
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  auto expected = twophoton::Derotator(h, w).derotate(
+      src.readframe(std::get<0>(S.getNChannels())), angle[0]);
+  twophoton::SITiffReader R{out_name.string()};
+  EXPECT_TRUE(R.open());
+  EXPECT_EQ(R.countDirectories(), 3);
+  auto written = R.readframe(1);
+  ASSERT_EQ(written.n_elem, expected.n_elem);
+  EXPECT_TRUE(std::equal(written.begin(), written.end(), expected.begin()));
+  src.close();
+  R.close();
+  fs::remove(out_name);
+}
+
+TEST_F(SITiffIOTest, SplitChannels) {
+  auto names = S.splitChannels("test_split.tif", 1, 2);
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  ASSERT_EQ(names.size(), nchans);
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  const auto source_ids = src.getSavedChans();
+  for (unsigned int c = 0; c < nchans; ++c) {
+    EXPECT_EQ(savedChannels(names[c]), 1);
+    twophoton::SITiffReader R{names[c]};
+    EXPECT_TRUE(R.open());
+    EXPECT_EQ(R.countDirectories(), 2);
+    // the header names the one channel the file holds, by the number the
+    // source knew it by
+    const auto ids = R.getSavedChans();
+    ASSERT_EQ(ids.size(), 1);
+    const auto source_id = source_ids.find(c);
+    EXPECT_EQ(ids.begin()->second,
+              source_id != source_ids.end() ? source_id->second : c + 1);
+    // the strips are copied so the frames are the source channel's
+    for (unsigned int i = 0; i < 2; ++i) {
+      auto written = R.readframe(i);
+      auto expected = src.readframe(i * nchans + c);
+      ASSERT_EQ(written.n_elem, expected.n_elem);
+      EXPECT_TRUE(
+          std::equal(written.begin(), written.end(), expected.begin()));
+    }
+    R.close();
+    fs::remove(names[c]);
+  }
+  src.close();
+}
+
+// the whole of a file written by the exports
+static std::vector<char> readBytes(const fs::path &path) {
+  std::ifstream ifs(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+}
+
+TEST_F(SITiffIOTest, ExportArrays) {
+  const fs::path zarr_name("test_export.zarr");
+  const fs::path tiled_name("test_export_tiled.zarr");
+  const fs::path npy_name("test_export.npy");
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  auto [h, w] = S.getImageSize();
+  const std::size_t frame_size = std::size_t(h) * w;
+  twophoton::SITiffReader R{tiff_name.string()};
+  EXPECT_TRUE(R.open());
+  auto frame3 = R.readframe(2 * nchans);
+  ASSERT_EQ(frame3.n_elem, frame_size);
+
+  EXPECT_TRUE(S.exportZarr(zarr_name.string(), 1, 1, 3, 2, 0, 0, 1));
+  EXPECT_TRUE(fs::exists(zarr_name / ".zarray"));
+  // the second time-chunk holds frame 3 then the zero padding
+  auto compressed = readBytes(zarr_name / "1.0.0");
+  std::vector<int16_t> chunk(2 * frame_size, -1);
+  uLongf chunk_bytes = chunk.size() * sizeof(int16_t);
+  ASSERT_EQ(uncompress(reinterpret_cast<Bytef *>(chunk.data()), &chunk_bytes,
+                       reinterpret_cast<const Bytef *>(compressed.data()),
+                       compressed.size()),
+            Z_OK);
+  EXPECT_EQ(chunk_bytes, chunk.size() * sizeof(int16_t));
+  EXPECT_TRUE(std::equal(frame3.begin(), frame3.end(), chunk.begin()));
+  EXPECT_TRUE(std::all_of(chunk.begin() + frame_size, chunk.end(),
+                          [](int16_t v) { return v == 0; }));
+
+  // an uncompressed 16 x 16 tile from the middle of frame 3
+  EXPECT_TRUE(S.exportZarr(tiled_name.string(), 1, 1, 3, 1, 16, 16));
+  auto tile = readBytes(tiled_name / "2.1.1");
+  ASSERT_EQ(tile.size(), 16 * 16 * sizeof(int16_t));
+  const auto *T = reinterpret_cast<const int16_t *>(tile.data());
+  for (unsigned int y = 0; y < 16; ++y)
+    EXPECT_TRUE(std::equal(T + y * 16, T + (y + 1) * 16,
+                           frame3.memptr() + (16 + y) * w + 16));
+
+  // chunk_frames = 0 picks a time-chunk from the memory budget, which
+  // for three small frames is all of them
+  fs::remove_all(tiled_name);
+  EXPECT_TRUE(S.exportZarr(tiled_name.string(), 1, 1, 3, 0));
+  auto zarray = readBytes(tiled_name / ".zarray");
+  const std::string chunks = "\"chunks\": [3, " + std::to_string(h) + ", " +
+                             std::to_string(w) + "]";
+  EXPECT_NE(std::string(zarray.begin(), zarray.end()).find(chunks),
+            std::string::npos);
+  EXPECT_TRUE(fs::exists(tiled_name / "0.0.0"));
+  EXPECT_FALSE(fs::exists(tiled_name / "1.0.0"));
+
+  EXPECT_TRUE(S.exportNpy(npy_name.string(), 1, 1, 3));
+  auto npy = readBytes(npy_name);
+  ASSERT_GT(npy.size(), 10);
+  const std::size_t data_offset =
+      10 + uint8_t(npy[8]) + (std::size_t(uint8_t(npy[9])) << 8);
+  ASSERT_EQ(npy.size(), data_offset + 3 * frame_size * sizeof(int16_t));
+  const auto *D = reinterpret_cast<const int16_t *>(npy.data() + data_offset);
+  EXPECT_TRUE(std::equal(frame3.begin(), frame3.end(), D + 2 * frame_size));
+  R.close();
+  fs::remove_all(zarr_name);
+  fs::remove_all(tiled_name);
+  fs::remove(npy_name);
+}
+
+TEST_F(SITiffIOTest, Project) {
+  auto [h, w] = S.getImageSize();
+  auto [mean, max] = S.project(1, 1, 3);
+  EXPECT_EQ(mean.n_elem, std::size_t(h) * w);
+  EXPECT_EQ(max.n_elem, std::size_t(h) * w);
+  for (std::size_t i = 0; i < mean.n_elem; ++i)
+    EXPECT_LE(mean[i], float(max[i]) + 1e-3f);
+}
+
+TEST(ProjectionTest, NonSquareFrame) {
+  // one pixel off the diagonal is bright in every other frame
+  const fs::path name("test_projection.tif");
+  const unsigned int h = 24, w = 40, y0 = 5, x0 = 17, n_frames = 4;
+  writeTestFrames(name, n_frames, h, w,
+                  [&](unsigned int f, unsigned int y, unsigned int x) {
+                    return int16_t(y == y0 && x == x0 ? 1000 * (f % 2) : 10);
+                  });
+  twophoton::SITiffIO S{};
+  ASSERT_TRUE(S.openTiff(name.string(), "r"));
+  // numpy arrays need the interpreter
+  if (!Py_IsInitialized())
+    pybind11::initialize_interpreter();
+  auto [mean, max] = S.getProjection(1, 1, n_frames);
+  for (const auto &img : {pybind11::array(mean), pybind11::array(max)}) {
+    ASSERT_EQ(img.ndim(), 2);
+    EXPECT_EQ(img.shape(0), h);
+    EXPECT_EQ(img.shape(1), w);
+  }
+  // indexed (y, x) like the frames
+  auto m = mean.unchecked<2>();
+  auto M = max.unchecked<2>();
+  EXPECT_FLOAT_EQ(m(y0, x0), 500.0f);
+  EXPECT_EQ(M(y0, x0), 1000);
+  // not at the transposed position
+  EXPECT_FLOAT_EQ(m(x0, y0), 10.0f);
+  EXPECT_EQ(std::count(max.data(), max.data() + h * w, 1000), 1);
+  fs::remove(name);
+}
+
+TEST_F(SITiffIOTest, ArrayReadsRowBands) {
+  auto A = S.asArray(1);
+  EXPECT_EQ(A.nFrames(), S.countDirectories());
+  const unsigned int w = A.width();
+  const std::size_t n_chans = std::get<0>(S.getNChannels());
+  const std::vector<std::size_t> frames{0, 2};
+  std::vector<int16_t> block(frames.size() * 4 * w);
+  A.read(frames, 1, 5, block.data());
+  twophoton::SITiffReader R{tiff_name.string()};
+  R.open();
+  for (std::size_t i = 0; i < frames.size(); ++i) {
+    // frames from readframe are row-major too
+    auto F = R.readframe(frames[i] * n_chans);
+    EXPECT_TRUE(std::equal(block.begin() + i * 4 * w,
+                           block.begin() + (i + 1) * 4 * w,
+                           F.memptr() + w));
+  }
+}
+
+TEST_F(SITiffIOTest, RegisterTranslation) {
+  const fs::path out_name("test_registered.tif");
+  S.interpolateIndices(0);
+  EXPECT_EQ(S.registerTranslation(1, 1, 3, out_name.string(), 3), 3);
+  auto transforms = S.getAllTransforms();
+  for (std::size_t row = 0; row < 3; ++row) {
+    EXPECT_TRUE(transforms->hasTransform(
+        twophoton::TransformType::kHaimanFFTTranslation, row));
+  }
+  EXPECT_FALSE(transforms->hasTransform(
+      twophoton::TransformType::kHaimanFFTTranslation, 3));
+  EXPECT_FALSE(
+      transforms->hasTransform(twophoton::TransformType::kLogPolarRotation));
+  EXPECT_EQ(S.registerTranslation(1, 1, 3, "", 3, 0, true), 3);
+  EXPECT_TRUE(S.getAllTransforms()->hasTransform(
+      twophoton::TransformType::kLogPolarRotation, 0));
+  EXPECT_EQ(savedChannels(out_name), 1);
+  // frame 2 of the output is the source frame moved back by its shift
+  auto shift = frameTransform(
+      *transforms, twophoton::TransformType::kHaimanFFTTranslation, 1);
+  ASSERT_EQ(shift.n_elem, 2);
+  auto [h, w] = S.getImageSize();
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  auto frame = src.readframe(std::get<0>(S.getNChannels()));
+  std::vector<int16_t> expected(std::size_t(h) * w);
+  twophoton::translateFrame(frame.memptr(), expected.data(), h, w, -shift[0],
+                            -shift[1]);
+  twophoton::SITiffReader R{out_name.string()};
+  EXPECT_TRUE(R.open());
+  EXPECT_EQ(R.countDirectories(), 3);
+  auto written = R.readframe(1);
+  ASSERT_EQ(written.n_elem, expected.size());
+  EXPECT_TRUE(std::equal(written.begin(), written.end(), expected.begin()));
+  src.close();
+  R.close();
+  fs::remove(out_name);
+}
+
+TEST_F(SITiffIOTest, RegisterPiecewise) {
+  const fs::path out_name("test_piecewise.tif");
+  S.interpolateIndices(0);
+  EXPECT_EQ(S.registerTranslation(1, 1, 3, "", 3), 3);
+  EXPECT_EQ(S.registerPiecewise(1, 1, 3, out_name.string(), 64, 0.5, 3), 3);
+  auto transforms = S.getAllTransforms();
+  auto M = transforms->getTransform(
+      twophoton::TransformType::kHaimanPieceWiseMapping, 0);
+  EXPECT_GT(M.n_rows, 1);
+  EXPECT_EQ(M.n_cols, 2);
+  EXPECT_FALSE(transforms->hasTransform(
+      twophoton::TransformType::kHaimanPieceWiseMapping, 3));
+  // the rigid registration is kept
+  EXPECT_TRUE(transforms->hasTransform(
+      twophoton::TransformType::kHaimanFFTTranslation, 0));
+  EXPECT_EQ(savedChannels(out_name), 1);
+  // frame 2 of the output is the source frame moved back by its rigid
+  // shift then warped by its patch shifts. The patch grid only depends on
+  // the frame size, patch size and overlap
+  auto shift = frameTransform(
+      *transforms, twophoton::TransformType::kHaimanFFTTranslation, 1);
+  auto patch_shifts = frameTransform(
+      *transforms, twophoton::TransformType::kHaimanPieceWiseMapping, 1);
+  ASSERT_EQ(shift.n_elem, 2);
+  ASSERT_EQ(patch_shifts.n_elem, M.n_elem);
+  auto [h, w] = S.getImageSize();
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  auto frame = src.readframe(std::get<0>(S.getNChannels()));
+  std::vector<int16_t> translated(std::size_t(h) * w), expected(translated);
+  twophoton::translateFrame(frame.memptr(), translated.data(), h, w,
+                            -shift[0], -shift[1]);
+  const std::vector<float> blank(std::size_t(h) * w, 0.0f);
+  twophoton::PiecewiseRegistration registration(blank.data(), h, w, 64, 0.5);
+  ASSERT_EQ(registration.nPatches(), M.n_rows);
+  registration.warp(translated.data(), expected.data(),
+                    {patch_shifts.memptr(), patch_shifts.n_elem});
+  twophoton::SITiffReader R{out_name.string()};
+  EXPECT_TRUE(R.open());
+  EXPECT_EQ(R.countDirectories(), 3);
+  auto written = R.readframe(1);
+  ASSERT_EQ(written.n_elem, expected.size());
+  EXPECT_TRUE(std::equal(written.begin(), written.end(), expected.begin()));
+  src.close();
+  R.close();
+  fs::remove(out_name);
+}
+
+TEST_F(SITiffIOTest, TrackTemplates) {
+  S.interpolateIndices(0);
+  EXPECT_THROW(S.trackTemplates({}), std::invalid_argument);
+  const std::vector<std::array<unsigned int, 4>> boxes{{10, 10, 32, 32},
+                                                       {60, 40, 24, 24}};
+  EXPECT_EQ(S.trackTemplates(boxes, 1, 1, 3, 16, 1), 3);
+  auto transforms = S.getAllTransforms();
+  auto M = transforms->getTransform(
+      twophoton::TransformType::kMultiTrackerTranslation, 0);
+  EXPECT_EQ(M.n_rows, 2);
+  EXPECT_EQ(M.n_cols, 2);
+  // the templates are cut from the first frame so don't move in it
+  auto [x, y] = S.getTrackerTranslation(transforms->frame_numbers[0]);
+  EXPECT_LT(std::abs(x), 1);
+  EXPECT_LT(std::abs(y), 1);
+  auto [xs, ys] = S.getAllTrackerTranslation();
+  EXPECT_EQ(xs.size(), 3);
+  // the same as following the templates, cut from the first frame, through
+  // the source frames with TemplateTracker, and kTrackerTranslation is
+  // their mean
+  auto [h, w] = S.getImageSize();
+  twophoton::SITiffReader src{tiff_name.string()};
+  EXPECT_TRUE(src.open());
+  const unsigned int nchans = std::get<0>(S.getNChannels());
+  auto reference = src.readframe(0);
+  std::vector<twophoton::TemplateTracker> trackers;
+  std::vector<float> tmpl;
+  for (const auto &[x, y, bw, bh] : boxes) {
+    tmpl.resize(std::size_t(bw) * bh);
+    for (unsigned int r = 0; r < bh; ++r)
+      std::copy_n(reference.memptr() + std::size_t(y + r) * w + x, bw,
+                  tmpl.data() + std::size_t(r) * bw);
+    trackers.emplace_back(tmpl.data(), bh, bw, h, w, x, y, 16);
+  }
+  for (unsigned int i = 0; i < 3; ++i) {
+    auto frame = src.readframe(i * nchans);
+    auto shifts = frameTransform(
+        *transforms, twophoton::TransformType::kMultiTrackerTranslation, i);
+    auto mean = frameTransform(
+        *transforms, twophoton::TransformType::kTrackerTranslation, i);
+    ASSERT_EQ(shifts.n_elem, 4);
+    ASSERT_EQ(mean.n_elem, 2);
+    double mx = 0, my = 0;
+    for (std::size_t b = 0; b < trackers.size(); ++b) {
+      auto [dx, dy] = trackers[b].track(frame.memptr());
+      EXPECT_DOUBLE_EQ(shifts(b, 0), dx);
+      EXPECT_DOUBLE_EQ(shifts(b, 1), dy);
+      mx += dx / trackers.size();
+      my += dy / trackers.size();
+    }
+    EXPECT_NEAR(mean[0], mx, 1e-9);
+    EXPECT_NEAR(mean[1], my, 1e-9);
+  }
+  src.close();
+}
+
+TEST_F(SITiffIOTest, EstimateOpticalFlow) {
+  S.interpolateIndices(0);
+  EXPECT_EQ(S.getOpticalFlowFields(), nullptr);
+  EXPECT_EQ(S.estimateOpticalFlow(1, 1, 3, 32, 3), 3);
+  auto fields = S.getOpticalFlowFields();
+  ASSERT_NE(fields, nullptr);
+  EXPECT_EQ(fields->n_frames, 3);
+  EXPECT_EQ(fields->values.size(),
+            std::size_t(3) * fields->rows * fields->cols * 2);
+  auto M = S.getAllTransforms()->getTransform(
+      twophoton::TransformType::kOpticalFlow, 0);
+  EXPECT_EQ(M.n_cols, 2);
+  // each frame's summary is the mean and largest speed over its cells,
+  // which the quantised fields give to within a quantum
+  const float q = twophoton::OpticalFlowFields::quantum;
+  const std::size_t n_cells = std::size_t(fields->rows) * fields->cols;
+  for (unsigned int i = 0; i < 3; ++i) {
+    auto summary = frameTransform(*S.getAllTransforms(),
+                                  twophoton::TransformType::kOpticalFlow, i);
+    ASSERT_EQ(summary.n_elem, 2);
+    const int16_t *cells = fields->values.data() + i * 2 * n_cells;
+    double total = 0, largest = 0;
+    for (std::size_t c = 0; c < n_cells; ++c) {
+      const double speed = std::hypot(cells[2 * c] * q, cells[2 * c + 1] * q);
+      total += speed;
+      largest = std::max(largest, speed);
+    }
+    EXPECT_NEAR(summary[0], total / n_cells, q);
+    EXPECT_NEAR(summary[1], largest, q);
+  }
+  // getOpticalFlow() hands back the fields in pixels, which needs numpy
+  if (!Py_IsInitialized())
+    pybind11::initialize_interpreter();
+  auto flow = S.getOpticalFlow();
+  ASSERT_EQ(flow.ndim(), 4);
+  EXPECT_EQ(flow.shape(0), 3);
+  EXPECT_EQ(flow.shape(1), fields->rows);
+  EXPECT_EQ(flow.shape(2), fields->cols);
+  EXPECT_EQ(flow.shape(3), 2);
+  for (std::size_t i = 0; i < fields->values.size(); ++i)
+    ASSERT_EQ(flow.data()[i], fields->values[i] * q);
+  EXPECT_THROW(S.estimateOpticalFlow(1, 1, 3, 0), std::invalid_argument);
+}
+
+TEST_F(SITiffIOTest, ExtractTraces) {
+  twophoton::RoiMasks masks;
+  // the second ROI's pixels are out of order
+  masks.indptr = {0, 1, 3};
+  masks.indices = {5, 10, 3};
+  masks.weights = {2, 1, 1};
+  auto traces = S.extractTraces(masks, 1, 1, 3);
+  EXPECT_EQ(traces.n_rows, 2);
+  EXPECT_EQ(traces.n_cols, 3);
+  // the traces averaged over the frames are the mean projection under the
+  // masks
+  auto mean = std::get<0>(S.project(1, 1, 3));
+  const float *m = mean.memptr();
+  EXPECT_NEAR(arma::mean(traces.row(0)), m[5], 1e-2);
+  EXPECT_NEAR(arma::mean(traces.row(1)), 0.5 * (m[10] + m[3]), 1e-2);
+}
+
+TEST(RoiMasksTest, Check) {
+  twophoton::RoiMasks masks;
+  masks.indptr = {0, 2};
+  masks.indices = {7, 1};
+  masks.weights = {1, 3};
+  EXPECT_NO_THROW(masks.check(8));
+  EXPECT_THROW(masks.check(7), std::invalid_argument);
+  masks.sort();
+  EXPECT_EQ(masks.indices, std::vector<uint32_t>({1, 7}));
+  EXPECT_EQ(masks.weights, std::vector<float>({3, 1}));
+  masks.indptr = {0, 1};
+  EXPECT_THROW(masks.check(8), std::invalid_argument);
+}
+
+TEST(LocalCorrelationTest, Correlations) {
+  const unsigned int h = 4, w = 5;
+  twophoton::LocalCorrelation C4(h, w, 4), C8(h, w, 8);
+  uint32_t seed = 1;
+  auto noise = [&seed]() {
+    seed = seed * 1103515245u + 12345u;
+    return int16_t((seed >> 16) % 200);
+  };
+  std::vector<int16_t> frame(h * w);
+  for (int t = 0; t < 2000; ++t) {
+    // the left two columns share a signal, the rest are independent
+    const int16_t common = noise();
+    for (unsigned int y = 0; y < h; ++y)
+      for (unsigned int x = 0; x < w; ++x)
+        frame[y * w + x] = x < 2 ? common : noise();
+    C4.add(frame.data());
+    const int16_t *frames[] = {frame.data()};
+    C8.add(frames, 2);
+  }
+  EXPECT_EQ(C4.count(), 2000);
+  auto I4 = C4.image();
+  auto I8 = C8.image();
+  const float *i4 = I4.memptr();
+  const float *i8 = I8.memptr();
+  // (0, 0) only has neighbours with the same signal
+  EXPECT_NEAR(i4[0], 1, 1e-5);
+  EXPECT_NEAR(i8[0], 1, 1e-5);
+  // (1, 1) has the column to its right among its neighbours
+  EXPECT_NEAR(i4[w + 1], 0.75, 0.05);
+  EXPECT_NEAR(i8[w + 1], 5.0 / 8, 0.05);
+  EXPECT_NEAR(i8[w + 3], 0, 0.05);
+  EXPECT_THROW(twophoton::LocalCorrelation(h, w, 6), std::invalid_argument);
+}
+
+TEST_F(SITiffIOTest, LocalCorrelation) {
+  auto img = S.localCorrelation(1, 1, 3, 4);
+  auto [h, w] = S.getImageSize();
+  EXPECT_EQ(img.n_elem, std::size_t(h) * w);
+  EXPECT_LE(img.max(), 1.0f + 1e-5f);
+  EXPECT_GE(img.min(), -1.0f - 1e-5f);
+}
+
+TEST(LocalCorrelationImageTest, NonSquareFrame) {
+  // noise everywhere except a cross of pixels around (y0, x0), off the
+  // diagonal, that all flicker together so (y0, x0) correlates perfectly
+  // with its 4 neighbours
+  const fs::path name("test_local_correlation.tif");
+  const unsigned int h = 24, w = 40, y0 = 5, x0 = 17, n_frames = 12;
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> noise(0, 99);
+  writeTestFrames(name, n_frames, h, w,
+                  [&](unsigned int f, unsigned int y, unsigned int x) {
+                    const unsigned int d = (y > y0 ? y - y0 : y0 - y) +
+                                           (x > x0 ? x - x0 : x0 - x);
+                    return int16_t(d <= 1 ? 1000 + 300 * (f % 3)
+                                          : noise(rng));
+                  });
+  twophoton::SITiffIO S{};
+  ASSERT_TRUE(S.openTiff(name.string(), "r"));
+  EXPECT_EQ(S.getImageSize(), std::make_tuple(h, w));
+  // numpy arrays need the interpreter
+  if (!Py_IsInitialized())
+    pybind11::initialize_interpreter();
+  auto img = S.getLocalCorrelation(1, 1, n_frames, 4);
+  ASSERT_EQ(img.ndim(), 2);
+  EXPECT_EQ(img.shape(0), h);
+  EXPECT_EQ(img.shape(1), w);
+  // indexed (y, x) like the frames and the pixel indices of get_traces
+  auto r = img.unchecked<2>();
+  EXPECT_NEAR(r(y0, x0), 1.0f, 1e-4f);
+  const float *data = img.data();
+  const auto peak = std::max_element(data, data + h * w) - data;
+  EXPECT_EQ(peak, y0 * w + x0);
+  fs::remove(name);
+}
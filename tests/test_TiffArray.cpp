@@ -0,0 +1,104 @@
+#include "../include/ScanImageTiff.h"
+#include <cassert>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <pybind11/embed.h>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace py = pybind11;
+
+const static fs::path tiff_name{"test_file1.tif"};
+
+/*
+SITiffArray::getItem() translates a numpy index into the frames and rows to
+read and the index that finishes the job on the block read, so each index
+here is checked against numpy indexing the whole array. The indices are
+written in Python so they are exactly what a user would pass; n and h are
+the number of frames and rows
+*/
+class TiffArrayTest : public ::testing::Test {
+protected:
+  static void SetUpTestSuite() {
+    // the interpreter lives until the process exits
+    if (!Py_IsInitialized())
+      py::initialize_interpreter();
+  }
+  void SetUp() override {
+    assert(fs::exists(tiff_name));
+    S.openTiff(tiff_name.string(), "r");
+    scope["np"] = py::module_::import("numpy");
+    scope["n"] = A().nFrames();
+    scope["h"] = A().height();
+    whole = A().toNumpy(py::none(), py::none());
+  }
+  twophoton::SITiffArray A() { return S.asArray(1); }
+  py::object index(const std::string &expr) { return py::eval(expr, scope); }
+  bool matchesNumpy(const std::string &expr) {
+    auto idx = index(expr);
+    py::object expected = whole[idx];
+    py::object result = A().getItem(idx);
+    return py::module_::import("numpy")
+        .attr("array_equal")(result, expected)
+        .cast<bool>();
+  }
+  twophoton::SITiffIO S{};
+  py::dict scope;
+  py::object whole;
+};
+
+TEST_F(TiffArrayTest, Integers) {
+  EXPECT_TRUE(matchesNumpy("1"));
+  EXPECT_TRUE(matchesNumpy("-1"));
+  EXPECT_TRUE(matchesNumpy("np.int64(-2)"));
+  EXPECT_TRUE(matchesNumpy("(0, h - 1, 3)"));
+  EXPECT_TRUE(matchesNumpy("(-1, -h)"));
+}
+
+TEST_F(TiffArrayTest, Slices) {
+  EXPECT_TRUE(matchesNumpy("slice(None)"));
+  EXPECT_TRUE(matchesNumpy("slice(None, None, -1)"));
+  EXPECT_TRUE(matchesNumpy("(slice(None, None, -2), slice(h - 1, 3, -3))"));
+  EXPECT_TRUE(matchesNumpy("(slice(1, 3), slice(2, 20, 5), slice(-4, None))"));
+  EXPECT_TRUE(matchesNumpy("(slice(-1, -n - 1, -1), slice(None, None, -1))"));
+  // an empty selection reads nothing but still has the right shape
+  EXPECT_TRUE(matchesNumpy("(slice(2, 2), slice(5, 1))"));
+}
+
+TEST_F(TiffArrayTest, Ellipsis) {
+  EXPECT_TRUE(matchesNumpy("..."));
+  EXPECT_TRUE(matchesNumpy("(..., 3)"));
+  EXPECT_TRUE(matchesNumpy("(0, ...)"));
+  EXPECT_TRUE(matchesNumpy("(1, ..., slice(None, None, -1))"));
+  EXPECT_TRUE(matchesNumpy("(..., 2, 1)"));
+}
+
+TEST_F(TiffArrayTest, IntegerArrays) {
+  // repeats, out of order and negative indices
+  EXPECT_TRUE(matchesNumpy("[2, 0, 2, -1]"));
+  EXPECT_TRUE(matchesNumpy("(slice(None), [5, 1, 1, -2])"));
+  EXPECT_TRUE(matchesNumpy("(slice(None), np.array([[1, 2], [3, 0]]))"));
+  // advanced indices either side of a slice
+  EXPECT_TRUE(matchesNumpy("([2, 0], slice(None), [1, 3])"));
+  EXPECT_TRUE(matchesNumpy("(np.array([1, 0], dtype=np.uint8), [4, 2])"));
+}
+
+TEST_F(TiffArrayTest, BooleanArrays) {
+  EXPECT_TRUE(matchesNumpy("np.arange(n) % 2 == 0"));
+  EXPECT_TRUE(matchesNumpy("(slice(None), np.arange(h) > h - 4)"));
+  EXPECT_TRUE(matchesNumpy("(0, np.arange(h) < 3, slice(None, 2))"));
+}
+
+TEST_F(TiffArrayTest, InvalidIndices) {
+  EXPECT_THROW(A().getItem(index("n")), py::index_error);
+  EXPECT_THROW(A().getItem(index("(0, -h - 1)")), py::index_error);
+  EXPECT_THROW(A().getItem(index("[0, n]")), py::index_error);
+  EXPECT_THROW(A().getItem(index("np.ones(n + 1, dtype=bool)")),
+               py::index_error);
+  EXPECT_THROW(A().getItem(index("(..., ...)")), py::index_error);
+  EXPECT_THROW(A().getItem(index("(0, 0, 0, 0)")), py::index_error);
+  EXPECT_THROW(A().getItem(index("1.5")), py::index_error);
+}
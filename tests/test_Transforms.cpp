@@ -0,0 +1,163 @@
+#include "../include/ScanImageTiff.h"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <vector>
+
+using twophoton::TransformTable;
+using twophoton::TransformType;
+
+TEST(TransformTableTest, SetAndGet) {
+  TransformTable table;
+  table.resize(3);
+  table.frame_numbers = {1, 2, 4};
+  EXPECT_FALSE(table.hasTransform(TransformType::kTrackerTranslation));
+  arma::mat M = {{1.0, 2.0}};
+  table.setTransform(TransformType::kTrackerTranslation, 1, M);
+  EXPECT_TRUE(table.hasTransform(TransformType::kTrackerTranslation, 1));
+  EXPECT_FALSE(table.hasTransform(TransformType::kTrackerTranslation, 0));
+  auto T = table.getTransform(TransformType::kTrackerTranslation, 1);
+  EXPECT_EQ(T.at(0, 1), 2.0);
+  EXPECT_TRUE(
+      table.getTransform(TransformType::kTrackerTranslation, 2).empty());
+  // tracker translations accumulate
+  table.updateTransform(TransformType::kTrackerTranslation, 1, M);
+  T = table.getTransform(TransformType::kTrackerTranslation, 1);
+  EXPECT_EQ(T.at(0, 0), 2.0);
+  EXPECT_EQ(T.at(0, 1), 4.0);
+  // every matrix in a column has the same shape
+  EXPECT_THROW(table.setTransform(TransformType::kTrackerTranslation, 0,
+                                  arma::mat(2, 2, arma::fill::zeros)),
+               std::invalid_argument);
+}
+
+TEST(TransformTableTest, FindAndResize) {
+  TransformTable table;
+  table.resize(3);
+  table.frame_numbers = {1, 2, 4};
+  table.setTransforms(TransformType::kInitialRotation, 1, 1, {0.1, 0.2, 0.3});
+  EXPECT_EQ(table.find(4), 2u);
+  EXPECT_EQ(table.find(3), table.size());
+  table.resize(5);
+  EXPECT_EQ(table.column(TransformType::kInitialRotation).values.size(), 5u);
+  EXPECT_TRUE(table.hasTransform(TransformType::kInitialRotation, 2));
+  EXPECT_FALSE(table.hasTransform(TransformType::kInitialRotation, 4));
+}
+
+TEST(TransformTableTest, SetFrameTransforms) {
+  TransformTable table;
+  table.resize(4);
+  // the table doesn't have to hold every frame or be in file order
+  table.frame_indices = {5, 1, 2, 3};
+  // 2 x 1 matrices for frames 2 to 4
+  table.setFrameTransforms(TransformType::kOpticalFlow, 2, 3, 2, 1,
+                           {1.0, 2.0, 3.0, 4.0, 5.0, 6.0});
+  const auto &c = table.column(TransformType::kOpticalFlow);
+  EXPECT_EQ(c.n_rows, 2u);
+  EXPECT_EQ(c.n_cols, 1u);
+  const std::vector<uint8_t> present{0, 1, 1, 1};
+  EXPECT_EQ(c.present, present);
+  const std::vector<double> values{0, 0, 1, 2, 3, 4, 5, 6};
+  EXPECT_EQ(c.values, values);
+  EXPECT_THROW(table.setFrameTransforms(TransformType::kOpticalFlow, 2, 3, 2,
+                                        1, {1.0, 2.0}),
+               std::invalid_argument);
+}
+
+TEST(TransformTableTest, SaveAndLoad) {
+  TransformTable table;
+  table.resize(4);
+  table.frame_numbers = {1, 2, 3, 4};
+  table.frame_indices = {0, 1, 2, 3};
+  table.x = {0.5, 1.5, 2.5, 3.5};
+  table.setTransforms(TransformType::kInitialRotation, 1, 1,
+                      {0.1, 0.2, 0.3, 0.4});
+  table.setTransform(TransformType::kTrackerTranslation, 2,
+                     arma::mat{{3.0, 4.0}});
+  auto path = std::filesystem::temp_directory_path() / "sitiff_transforms.bin";
+  ASSERT_TRUE(table.save(path.string()));
+
+  TransformTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  EXPECT_EQ(loaded.size(), 4u);
+  EXPECT_EQ(loaded.frame_numbers, table.frame_numbers);
+  EXPECT_EQ(loaded.x, table.x);
+  EXPECT_EQ(loaded.column(TransformType::kInitialRotation).values,
+            table.column(TransformType::kInitialRotation).values);
+  EXPECT_TRUE(loaded.hasTransform(TransformType::kTrackerTranslation, 2));
+  EXPECT_FALSE(loaded.hasTransform(TransformType::kTrackerTranslation, 1));
+  EXPECT_EQ(loaded.getTransform(TransformType::kTrackerTranslation, 2).at(0, 1),
+            4.0);
+  std::filesystem::remove(path);
+}
+
+TEST(TransformTableTest, LoadRejectsOtherFiles) {
+  auto path = std::filesystem::temp_directory_path() / "sitiff_not_transforms";
+  {
+    std::ofstream ofs(path);
+    ofs << "not a transform file at all";
+  }
+  TransformTable table;
+  EXPECT_FALSE(table.load(path.string()));
+  EXPECT_FALSE(table.load("/no/such/file"));
+  std::filesystem::remove(path);
+}
+
+// overwrites the bytes of a file at offset with value
+template <typename T>
+static void patchFile(const std::filesystem::path &path, std::size_t offset,
+                      T value) {
+  std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
+  fs.seekp(offset);
+  fs.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+TEST(TransformTableTest, LoadRejectsOversizedCounts) {
+  TransformTable table;
+  table.resize(4);
+  table.frame_numbers = {1, 2, 3, 4};
+  table.setTransforms(TransformType::kInitialRotation, 1, 1,
+                      {0.1, 0.2, 0.3, 0.4});
+  auto path = std::filesystem::temp_directory_path() / "sitiff_oversized.bin";
+  ASSERT_TRUE(table.save(path.string()));
+  TransformTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  // a frame count that would overflow once multiplied by the value size
+  patchFile(path, 16, ~uint64_t(0));
+  EXPECT_FALSE(loaded.load(path.string()));
+  // the frames are intact but the matrices claim to be 2^32 x 2^32; the
+  // header (24 bytes) and the 8 per-frame arrays come before the block
+  ASSERT_TRUE(table.save(path.string()));
+  const std::size_t block = 24 + 2 * 4 * sizeof(unsigned int) +
+                            6 * 4 * sizeof(double);
+  patchFile(path, block + 4, ~uint32_t(0));
+  patchFile(path, block + 8, ~uint32_t(0));
+  EXPECT_FALSE(loaded.load(path.string()));
+  // the table is left as it was by the loads that failed
+  EXPECT_EQ(loaded.size(), 4u);
+  std::filesystem::remove(path);
+}
+
+TEST(TransformTableTest, SaveReplacesFileWhole) {
+  const auto dir = std::filesystem::temp_directory_path() / "sitiff_save_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  const auto path = dir / "transforms.bin";
+  TransformTable table;
+  table.resize(2);
+  table.frame_numbers = {1, 2};
+  ASSERT_TRUE(table.save(path.string()));
+  table.resize(3);
+  table.frame_numbers = {1, 2, 3};
+  ASSERT_TRUE(table.save(path.string()));
+  // only the file itself is left, the temporary it was written to is gone
+  EXPECT_EQ(std::distance(std::filesystem::directory_iterator(dir),
+                          std::filesystem::directory_iterator()),
+            1);
+  TransformTable loaded;
+  ASSERT_TRUE(loaded.load(path.string()));
+  EXPECT_EQ(loaded.size(), 3u);
+  EXPECT_FALSE(table.save((dir / "no_such_dir" / "t.bin").string()));
+  std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,202 @@
+#include "../include/ScanImageTiff.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// writes contents to a file in the temp directory, returning its path
+static fs::path writeTestFile(const std::string &name,
+                              const std::string &contents) {
+  const fs::path path = fs::temp_directory_path() / name;
+  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  ofs << contents;
+  return path;
+}
+
+// sets an environment variable for the lifetime of the guard, restoring
+// its old value (or unsetting it) afterwards
+class ScopedEnv {
+public:
+  ScopedEnv(const char *name, const std::string &value) : m_name(name) {
+    if (const char *old = std::getenv(name))
+      m_old = old;
+    set(value.c_str());
+  }
+  ~ScopedEnv() {
+    if (m_old)
+      set(m_old->c_str());
+    else {
+#ifdef _WIN32
+      _putenv_s(m_name.c_str(), "");
+#else
+      unsetenv(m_name.c_str());
+#endif
+    }
+  }
+
+private:
+  void set(const char *value) {
+#ifdef _WIN32
+    _putenv_s(m_name.c_str(), value);
+#else
+    setenv(m_name.c_str(), value, 1);
+#endif
+  }
+  std::string m_name;
+  std::optional<std::string> m_old;
+};
+
+static double secondsBetween(twophoton::ptime a, twophoton::ptime b) {
+  return std::chrono::duration<double>(b - a).count();
+}
+
+TEST(LogFileLoaderTest, Parse) {
+  const auto path =
+      writeTestFile("sitiff_test_logfile.txt",
+                    "2021-03-04 12:00:00 X=0.0 Z=0.0 Rot=0\n"
+                    "2021-03-04 12:00:00.25 X=1.0 Z=2.0 Rot=10\n"
+                    // a repeat of the last timestamp is skipped
+                    "2021-03-04 12:00:00.250 X=5.0 Z=5.0 Rot=99\n"
+                    "MicroscopeTriggered\n"
+                    "2021-03-04 12:00:01.5 X=2.0 Z=4.0 Rot=20\n"
+                    "2021-03-04 12:00:01.500000001 X=3.0 Z=6.0 Rot=30\n");
+  twophoton::LogFileLoader L(path.string());
+  L.use_cache = false;
+  EXPECT_TRUE(L.load());
+  auto times = L.getPTimes();
+  ASSERT_EQ(times.size(), 4);
+  EXPECT_DOUBLE_EQ(secondsBetween(times[0], times[1]), 0.25);
+  EXPECT_DOUBLE_EQ(secondsBetween(times[0], times[2]), 1.5);
+  // fractional seconds are kept to the resolution of the clock
+  EXPECT_GT(times[3], times[2]);
+  const std::vector<double> raw_x{0.0, 1.0, 2.0, 3.0};
+  EXPECT_TRUE(std::ranges::equal(L.getRawX(), raw_x));
+  EXPECT_EQ(L.getRotation(1), 10);
+  EXPECT_EQ(L.getRotation(2), 20);
+  // the trigger is at the last sample before the trigger line
+  EXPECT_TRUE(L.containsAcquisition());
+  EXPECT_EQ(L.getTriggerIndex(), 1);
+  EXPECT_EQ(L.getTriggerTime(), times[1]);
+  EXPECT_DOUBLE_EQ(L.getTime(0), -0.25);
+  EXPECT_DOUBLE_EQ(L.getTime(2), 1.25);
+  fs::remove(path);
+}
+
+TEST(LogFileLoaderTest, NoTrigger) {
+  const auto path =
+      writeTestFile("sitiff_test_logfile_notrigger.txt",
+                    "2021-03-04 12:00:00 X=0.0 Z=0.0 Rot=0\n"
+                    "2021-03-04 12:00:01 X=1.0 Z=2.0 Rot=10\n");
+  twophoton::LogFileLoader L(path.string());
+  L.use_cache = false;
+  EXPECT_FALSE(L.load());
+  EXPECT_FALSE(L.containsAcquisition());
+  fs::remove(path);
+}
+
+TEST(LogFileLoaderTest, MalformedLineThrows) {
+  const auto path =
+      writeTestFile("sitiff_test_logfile_malformed.txt",
+                    "2021-03-04 12:00:00 X=0.0 Z=0.0 Rot=0\n"
+                    "MicroscopeTriggered\n"
+                    "2021-03-04 12:00:01 X=abc Z=2.0 Rot=10\n");
+  twophoton::LogFileLoader L(path.string());
+  L.use_cache = false;
+  EXPECT_THROW(L.load(), std::invalid_argument);
+  fs::remove(path);
+}
+
+TEST(RotaryEncoderLoaderTest, ChunkedParseMatchesSingleChunk) {
+  // repeated timestamps and the trigger are spread through the file so
+  // some of them land on the seams between chunks
+  std::string contents;
+  for (int i = 0; i < 200; ++i) {
+    const int ms = (i / 3) * 10 + (i % 3 == 2 ? 5 : 0);
+    char line[96];
+    std::snprintf(line, sizeof(line),
+                  "2021-03-04 12:00:%02d.%03d Rot=%d\n", ms / 1000,
+                  ms % 1000, i);
+    contents += line;
+    if (i == 120)
+      contents += "Trigger=1.000000\n";
+  }
+  const auto path = writeTestFile("sitiff_test_rotaryfile.txt", contents);
+  twophoton::RotaryEncoderLoader single(path.string());
+  single.use_cache = false;
+  EXPECT_TRUE(single.load());
+  twophoton::RotaryEncoderLoader chunked(path.string());
+  chunked.use_cache = false;
+  chunked.min_chunk_size = 64;
+  EXPECT_TRUE(chunked.load());
+  EXPECT_TRUE(std::ranges::equal(single.getPTimes(), chunked.getPTimes()));
+  EXPECT_TRUE(std::ranges::equal(single.getTheta(), chunked.getTheta()));
+  EXPECT_EQ(single.getTriggerIndex(), chunked.getTriggerIndex());
+  EXPECT_EQ(single.getTriggerTime(), chunked.getTriggerTime());
+  EXPECT_TRUE(chunked.containsAcquisition());
+  // the repeats of each timestamp were dropped
+  EXPECT_LT(single.getPTimes().size(), 200);
+  fs::remove(path);
+}
+
+TEST(VRDataFileTest, LoadFromCache) {
+  const fs::path cache_dir = fs::temp_directory_path() / "sitiff_test_cache";
+  fs::remove_all(cache_dir);
+  ScopedEnv env("SITIFF_CACHE_DIR", cache_dir.string());
+  const auto path = writeTestFile("sitiff_test_cached_rotaryfile.txt",
+                                  "2021-03-04 12:00:00.000 Rot=10\n"
+                                  "Trigger=1.000000\n"
+                                  "2021-03-04 12:00:00.010 Rot=20\n"
+                                  "2021-03-04 12:00:00.020 Rot=30\n");
+  twophoton::RotaryEncoderLoader parsed(path.string());
+  EXPECT_TRUE(parsed.load());
+  EXPECT_TRUE(fs::exists(parsed.getCachePath()));
+  EXPECT_EQ(fs::path(parsed.getCachePath()).parent_path(), cache_dir);
+  // change the rotations without changing the size or modification time
+  // of the file, which is all the cache checks, so only a load from the
+  // cache still has the old values
+  const auto mtime = fs::last_write_time(path);
+  writeTestFile(path.filename().string(), "2021-03-04 12:00:00.000 Rot=40\n"
+                                          "Trigger=1.000000\n"
+                                          "2021-03-04 12:00:00.010 Rot=50\n"
+                                          "2021-03-04 12:00:00.020 Rot=60\n");
+  fs::last_write_time(path, mtime);
+  twophoton::RotaryEncoderLoader cached(path.string());
+  EXPECT_TRUE(cached.load());
+  EXPECT_EQ(cached.getRotation(0), 10);
+  EXPECT_TRUE(std::ranges::equal(parsed.getPTimes(), cached.getPTimes()));
+  EXPECT_TRUE(std::ranges::equal(parsed.getTheta(), cached.getTheta()));
+  EXPECT_EQ(parsed.getTriggerIndex(), cached.getTriggerIndex());
+  EXPECT_EQ(parsed.getTriggerTime(), cached.getTriggerTime());
+  twophoton::RotaryEncoderLoader reparsed(path.string());
+  reparsed.use_cache = false;
+  EXPECT_TRUE(reparsed.load());
+  EXPECT_EQ(reparsed.getRotation(0), 40);
+  fs::remove(path);
+  fs::remove_all(cache_dir);
+}
+
+TEST(RotaryEncoderLoaderTest, ThetaInRadians) {
+  const auto path = writeTestFile("sitiff_test_rotary_degrees.txt",
+                                  "Trigger=1.000000\n"
+                                  "2021-03-04 12:00:00.000 Rot=90\n"
+                                  "2021-03-04 12:00:00.010 Rot=-90\n"
+                                  "2021-03-04 12:00:00.020 Rot=540\n");
+  twophoton::RotaryEncoderLoader R(path.string());
+  R.use_cache = false;
+  EXPECT_TRUE(R.load());
+  auto theta = R.getTheta();
+  ASSERT_EQ(theta.size(), 3);
+  // the file is in degrees and theta is wrapped to [0, 2PI) like the log's
+  EXPECT_NEAR(theta[0], M_PI / 2, 1e-12);
+  EXPECT_NEAR(theta[1], 3 * M_PI / 2, 1e-12);
+  EXPECT_NEAR(theta[2], M_PI, 1e-12);
+  fs::remove(path);
+}
@@ -2,6 +2,9 @@
 #include "../include/ScanImageTiff.h"
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -97,6 +100,45 @@ TEST_F(TiffReaderTest, ImageSizeNotZero)
     EXPECT_GT(w, 0) << "Image height = " << std::to_string(h);
 }
 
+// threads sharing a reader take turns so each gets the frame it asked for
+TEST_F(TiffReaderTest, ConcurrentReads)
+{
+    const int n = std::min(R.countDirectories(), 8);
+    std::vector<arma::Mat<int16_t>> expected(n), got(n);
+    for (int i = 0; i < n; ++i)
+        expected[i] = R.readframe(i);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            for (int i = n - 1 - t; i >= 0; i -= 4)
+                got[i] = R.readframe(i);
+        });
+    for (auto &thread : threads)
+        thread.join();
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(expected[i].n_elem, got[i].n_elem);
+        EXPECT_TRUE(std::equal(expected[i].memptr(),
+                               expected[i].memptr() + expected[i].n_elem,
+                               got[i].memptr()));
+    }
+}
+
+TEST(TiffReaderPoolTest, ReusesReaders)
+{
+    auto pool = std::make_shared<twophoton::SITiffReaderPool>(tiff_name.string());
+    twophoton::SITiffReader *first = nullptr;
+    {
+        auto a = pool->acquire();
+        auto b = pool->acquire();
+        EXPECT_NE(a.get(), b.get());
+        EXPECT_TRUE(a->isOpen());
+        first = a.get();
+    }
+    auto c = pool->acquire();
+    auto d = pool->acquire();
+    EXPECT_TRUE(c.get() == first || d.get() == first);
+}
+
 // TEST_F(TiffReaderTest, ReadFrame) {
 //     FrameTest();
 // }